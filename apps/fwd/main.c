@@ -16,7 +16,10 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <rvs.h>
+#include <rvif_mem.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,10 +28,20 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/futex.h>
+
+#include <stdatomic.h>
 
 #include <pthread.h>
+#include <sched.h>
 
 int rvs_lock_init(char *lock)
 {
@@ -60,84 +73,819 @@ int rvs_rdunlock(char *lock)
 	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
 }
 
-int rvs_notify(struct rvs *vs __attribute__((unused)),
-	       unsigned short vid __attribute__((unused)),
-	       unsigned short qid __attribute__((unused)))
+#define PORT_RING(_vid, _qid, _r, _field) \
+	RVIF_RING(vs->port[_vid].vif, vs->port[_vid].ver, _qid, _r, _field)
+
+int rvs_notify(struct rvs *vs, unsigned short vid, unsigned short qid)
+{
+	unsigned int *ev = &PORT_RING(vid, qid, 0, event);
+	/* the update of head has to be visible before we read the request of the consumer */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (__atomic_load_n(ev, __ATOMIC_RELAXED) != RVIF_EVENT_NONE) {
+		__atomic_store_n(ev, RVIF_EVENT_NONE, __ATOMIC_RELAXED);
+		syscall(SYS_futex, ev, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static const char *copy_name[RVS_COPY_NUM] = {
+	[RVS_COPY_SCALAR] = "scalar",
+	[RVS_COPY_SSE2] = "sse2",
+	[RVS_COPY_AVX2] = "avx2",
+	[RVS_COPY_AVX512] = "avx512",
+};
+
+/* a pair of a port and a queue, forwarded by one worker at a time */
+struct fwd_queue {
+	unsigned short vid;
+	unsigned short qid;
+	_Atomic unsigned char busy;
+} __attribute__((aligned(64)));
+
+struct fwd_worker {
+	pthread_t th;
+	int core;
+	unsigned short id;
+	_Atomic unsigned long cnt; /* only the worker itself updates it */
+	_Atomic unsigned long seq; /* odd while the worker may use an rvif, only the worker itself updates it */
+	struct rvs_stat *stat; /* in the stats file, NULL if it is not exported */
+} __attribute__((aligned(64)));
+
+/* a sleeping worker wakes up after this period even if no peer requests it */
+#define FWD_SLEEP_TIMEOUT_US (10000)
+
+/* a lossless port holds back the sources for this period at most by default */
+#define FWD_HOL_TIMEOUT_US (100000)
+
+#define FWD_OPTS "a:b:c:C:F:i:l:m:M:n:p:r:R:s:u:X:"
+
+/* the capacity of the routing table of -r */
+#define FWD_LPM_NUM_TBL8 (1U << 14)
+#define FWD_LPM_NUM_ROUTE (1UL << 20)
+
+static struct rvs *vs = NULL;
+static unsigned short num_port = 0, batch_size = RVS_BATCH_MAX;
+static unsigned long idle_us = 0;
+static unsigned short nt_thresh = 0;
+static unsigned long lossless_all = 0; /* the head-of-line timeout of -l all */
+
+/* the mapping of the rvif of each port; size is 0 for a port in a pool file */
+static struct rvif_mem port_mem[RVS_MAX_PORT];
+
+static struct rvs_stat_hdr *stat_hdr = NULL;
+
+/* the pairs of all the ports, indexed by vid * RVIF_MAX_QUEUE + qid, whose busy flags outlive the lists */
+static struct fwd_queue *fwd_queue = NULL;
+
+/*
+ * the pairs of the attached ports, which a worker reads once for an iteration;
+ * worker i owns the pairs whose index modulo the number of workers is i
+ */
+struct fwd_list {
+	unsigned int num;
+	struct fwd_queue *q[];
+};
+
+static _Atomic(struct fwd_list *) fwd_list = NULL;
+
+static struct fwd_worker *worker = NULL;
+static unsigned short num_worker = 0;
+
+/*
+ * loads the routes of the file, each line of which is "addr/len port
+ * dst_mac src_mac", and makes rvs route IPv4 packets by them
+ */
+static void route_load(const char *path)
+{
+	struct rvs_lpm *lpm;
+	unsigned long size = rvs_lpm_size(FWD_LPM_NUM_TBL8, FWD_LPM_NUM_ROUTE), num = 0;
+	unsigned short num_nh = 0;
+	void *mem;
+	assert((lpm = aligned_alloc(64, ((sizeof(struct rvs_lpm) + 63) / 64) * 64)) != NULL);
+	assert((mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	assert(!rvs_lpm_setup(lpm, vs, mem, size, FWD_LPM_NUM_TBL8));
+	{
+		FILE *f;
+		char line[256];
+		assert((f = fopen(path, "r")) != NULL);
+		while (fgets(line, sizeof(line), f)) {
+			unsigned int a[4], d[6], s[6];
+			unsigned short len, port, nh;
+			if (line[0] == '#' || line[0] == '\n')
+				continue;
+			assert(sscanf(line, "%u.%u.%u.%u/%hu %hu %x:%x:%x:%x:%x:%x %x:%x:%x:%x:%x:%x",
+						&a[0], &a[1], &a[2], &a[3], &len, &port,
+						&d[0], &d[1], &d[2], &d[3], &d[4], &d[5],
+						&s[0], &s[1], &s[2], &s[3], &s[4], &s[5]) == 18);
+			assert(len <= 32 && port < RVS_MAX_PORT);
+			{
+				unsigned char dst[6], src[6];
+				unsigned short i;
+				for (i = 0; i < 6; i++) {
+					dst[i] = (unsigned char) d[i];
+					src[i] = (unsigned char) s[i];
+				}
+				/* the routes having the same port and addresses share a next hop */
+				for (nh = 0; nh < num_nh; nh++) {
+					if (lpm->nh[nh].port == port && !memcmp(lpm->nh[nh].dst, dst, 6) && !memcmp(lpm->nh[nh].src, src, 6))
+						break;
+				}
+				if (nh == num_nh) {
+					assert(num_nh < RVS_LPM_NUM_NH);
+					assert(!rvs_lpm_nh_set(lpm, nh, port, dst, src));
+					num_nh++;
+				}
+			}
+			assert(!rvs_lpm_add(lpm, (a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3], (unsigned char) len, nh));
+			num++;
+		}
+		fclose(f);
+	}
+	assert(!rvs_lookup_set(vs, rvs_lookup_lpm, lpm));
+	printf("routing: %lu routes, %u next hops from %s\n", num, num_nh, path);
+}
+
+static void vif_wait_init(struct rvif *vif)
+{
+	/* the process/system sets num after it has initialized the rvif, including the version header */
+	if (!__atomic_load_n(&vif->num, __ATOMIC_ACQUIRE)) {
+		printf("waiting for the rvif at %p to be initialized\n", vif);
+		while (!__atomic_load_n(&vif->num, __ATOMIC_ACQUIRE))
+			usleep(1000);
+	}
+}
+
+/*
+ * the rvif of a port, or NULL if it is not attached; a detached rvif stays
+ * mapped until every worker has finished the iteration that may have read it
+ */
+static struct rvif *port_vif(unsigned short vid)
+{
+	return __atomic_load_n(&vs->port[vid].vif, __ATOMIC_ACQUIRE);
+}
+
+#define VIF_RING(_vif, _vid, _qid, _r, _field) \
+	RVIF_RING(_vif, vs->port[_vid].ver, _qid, _r, _field)
+
+static unsigned short fwd_queue_fwd(struct fwd_worker *w, struct fwd_queue *fq)
+{
+	unsigned short cnt = 0;
+	struct rvif *vif = port_vif(fq->vid);
+	if (vif && fq->qid < vif->num) {
+		if (num_worker == 1)
+			cnt = rvs_fwd_stat(vs, fq->vid, fq->qid, batch_size, w->stat);
+		else if (!atomic_exchange_explicit(&fq->busy, 1, memory_order_acquire)) {
+			cnt = rvs_fwd_stat(vs, fq->vid, fq->qid, batch_size, w->stat);
+			atomic_store_explicit(&fq->busy, 0, memory_order_release);
+		}
+	}
+	return cnt;
+}
+
+static void fwd_sleep(struct fwd_worker *w, const struct fwd_list *l)
+{
+	struct futex_waitv wv[FUTEX_WAITV_MAX];
+	unsigned int wq[FUTEX_WAITV_MAX], n = 0; /* the pairs of wv */
+	struct rvif *wvif[FUTEX_WAITV_MAX];
+	{
+		/* ask the producers of our TX rings to wake us up; FUTEX_WAITV_MAX rings at most, the others rely on the timeout */
+		unsigned int i;
+		for (i = w->id; i < l->num && n < FUTEX_WAITV_MAX; i += num_worker) {
+			struct rvif *vif = port_vif(l->q[i]->vid);
+			if (vif && l->q[i]->qid < vif->num) {
+				__atomic_store_n(&VIF_RING(vif, l->q[i]->vid, l->q[i]->qid, 1, event), RVIF_EVENT_WAIT, __ATOMIC_RELAXED);
+				wv[n].val = RVIF_EVENT_WAIT;
+				wv[n].uaddr = (unsigned long) &VIF_RING(vif, l->q[i]->vid, l->q[i]->qid, 1, event);
+				wv[n].flags = FUTEX_32;
+				wv[n].__reserved = 0;
+				wq[n] = i;
+				wvif[n] = vif;
+				n++;
+			}
+		}
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	{
+		/* a packet may have been queued before the producer saw our request */
+		unsigned int j;
+		for (j = 0; j < n; j++) {
+			struct fwd_queue *fq = l->q[wq[j]];
+			if (VIF_RING(wvif[j], fq->vid, fq->qid, 1, head) != __atomic_load_n(&VIF_RING(wvif[j], fq->vid, fq->qid, 1, tail), __ATOMIC_ACQUIRE))
+				break;
+		}
+		if (j == n) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += FWD_SLEEP_TIMEOUT_US * 1000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			syscall(SYS_futex_waitv, wv, n, 0, &ts, CLOCK_MONOTONIC);
+		}
+	}
+	{
+		unsigned int j;
+		for (j = 0; j < n; j++)
+			__atomic_store_n((unsigned int *)(unsigned long) wv[j].uaddr, RVIF_EVENT_NONE, __ATOMIC_RELAXED);
+	}
+}
+
+static void *fwd_th(void *data)
+{
+	struct fwd_worker *w = (struct fwd_worker *) data;
+	struct timespec idle_since = { 0 }; /* tv_sec == 0 means the worker is not idle */
+
+	if (w->core >= 0) {
+		cpu_set_t cs;
+		CPU_ZERO(&cs);
+		CPU_SET(w->core, &cs);
+		assert(!pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs));
+	}
+
+	while (1) {
+		unsigned long cnt = 0;
+		struct fwd_list *l;
+		unsigned int nq;
+		/* the control thread waits for this iteration before it unmaps a detached rvif or frees the list */
+		atomic_store_explicit(&w->seq, atomic_load_explicit(&w->seq, memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		l = atomic_load_explicit(&fwd_list, memory_order_acquire);
+		nq = l->num;
+		{
+			unsigned int i;
+			for (i = w->id; i < nq; i += num_worker)
+				cnt += fwd_queue_fwd(w, l->q[i]);
+		}
+		if (!cnt && num_worker > 1) {
+			/* nothing to do on our own queues; steal the most occupied one of the others */
+			unsigned int i, victim = nq;
+			unsigned short max = 0;
+			for (i = 0; i < nq; i++) {
+				struct fwd_queue *fq = l->q[i];
+				struct rvif *vif = port_vif(fq->vid);
+				if (i % num_worker != w->id
+						&& vif && fq->qid < vif->num
+						&& !atomic_load_explicit(&fq->busy, memory_order_relaxed)) {
+					volatile unsigned short h = VIF_RING(vif, fq->vid, fq->qid, 1, head), t = VIF_RING(vif, fq->vid, fq->qid, 1, tail);
+					unsigned short n = (t < h ? t + VIF_RING(vif, fq->vid, fq->qid, 1, num) - h : t - h);
+					if (n > max) {
+						max = n;
+						victim = i;
+					}
+				}
+			}
+			if (victim < nq)
+				cnt += fwd_queue_fwd(w, l->q[victim]);
+		}
+		if (cnt) {
+			atomic_store_explicit(&w->cnt, atomic_load_explicit(&w->cnt, memory_order_relaxed) + cnt, memory_order_relaxed);
+			idle_since.tv_sec = 0;
+		} else if (idle_us) {
+			/* busy-poll for idle_us after the last packet, then sleep until a producer wakes us up */
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			if (!idle_since.tv_sec)
+				idle_since = ts;
+			else if ((unsigned long) ((ts.tv_sec - idle_since.tv_sec) * 1000000L + (ts.tv_nsec - idle_since.tv_nsec) / 1000) >= idle_us) {
+				/* we stay idle unless we find packets after waking up, then sleep again without polling for idle_us */
+				fwd_sleep(w, l);
+			}
+		}
+		atomic_store_explicit(&w->seq, atomic_load_explicit(&w->seq, memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	return NULL;
+}
+
+/* waits until every worker has finished the iteration running at the call */
+static void worker_sync(void)
+{
+	unsigned short i;
+	atomic_thread_fence(memory_order_seq_cst);
+	for (i = 0; i < num_worker; i++) {
+		unsigned long seq = atomic_load_explicit(&worker[i].seq, memory_order_acquire);
+		if (seq & 1) {
+			while (atomic_load_explicit(&worker[i].seq, memory_order_acquire) == seq)
+				usleep(10);
+		}
+	}
+}
+
+/*
+ * publishes the list of the pairs of the attached ports, and frees the old one
+ * after the workers have finished the iterations that may have read it; the
+ * ports are interleaved, and each round of queue ids starts at the next port,
+ * so that the queues of a port and the same queue of the ports are spread
+ * over the workers
+ */
+static void fwd_list_update(void)
+{
+	struct fwd_list *l, *old;
+	assert((l = malloc(sizeof(*l) + sizeof(l->q[0]) * num_port * RVIF_MAX_QUEUE)) != NULL);
+	l->num = 0;
+	{
+		unsigned short qid;
+		for (qid = 0; qid < RVIF_MAX_QUEUE && num_port; qid++) {
+			unsigned short k;
+			for (k = 0; k < num_port; k++) {
+				unsigned short vid = (unsigned short)((qid + k) % num_port);
+				struct rvif *vif = port_vif(vid);
+				if (vif && qid < vif->num)
+					l->q[l->num++] = &fwd_queue[vid * RVIF_MAX_QUEUE + qid];
+			}
+		}
+	}
+	old = atomic_exchange_explicit(&fwd_list, l, memory_order_acq_rel);
+	if (old) {
+		worker_sync();
+		free(old);
+	}
+}
+
+/*
+ * attaches the rvif in the shared memory file to the first free port, and
+ * returns the port, or -1 on failure; with wait, it waits for the file to be
+ * created and the rvif to be initialized, otherwise, a missing file or an
+ * uninitialized rvif is a failure
+ */
+static int port_attach(const char *path, int wait)
+{
+	struct rvif_mem m;
+	unsigned short vid;
+	for (vid = 0; vid < vs->max_port && vs->port[vid].vif; vid++) ;
+	if (vid == vs->max_port)
+		return -1;
+	if (wait) {
+		/* the process/system creates the file and sets its size at once */
+		struct stat st;
+		if (stat(path, &st) || !st.st_size) {
+			printf("waiting for %s to be created\n", path);
+			while (stat(path, &st) || !st.st_size)
+				usleep(1000);
+		}
+	}
+	if (rvif_mem_open(&m, path, 0, RVIF_MEM_PREFAULT))
+		return -1;
+	if (m.size < sizeof(struct rvif_hdr)) {
+		rvif_mem_close(&m);
+		return -1;
+	}
+	if (wait)
+		vif_wait_init((struct rvif *) m.mem);
+	/* the settings applied to all the ports take effect before the port gets frames */
+	assert(!rvs_port_copy_nt(vs, vid, nt_thresh));
+	if (lossless_all)
+		assert(!rvs_port_lossless(vs, vid, lossless_all));
+	/* rvs does not know the size of the mapping, thus, the buffers of the slots are checked here */
+	if (!__atomic_load_n(&((struct rvif *) m.mem)->num, __ATOMIC_ACQUIRE)
+			|| rvif_check((struct rvif *) m.mem, m.size)
+			|| rvs_vif_attach(vs, vid, (struct rvif *) m.mem)) {
+		rvif_mem_close(&m);
+		return -1;
+	}
+	port_mem[vid] = m;
+	printf("port[%u]: %s (%p, %lu-byte pages) rvif version %u\n", vid, path, m.mem, m.page_size, vs->port[vid].ver);
+	if (vid >= num_port) {
+		num_port = vid + 1;
+		if (stat_hdr)
+			__atomic_store_n(&stat_hdr->num_port, num_port, __ATOMIC_RELEASE);
+	}
+	/* the workers look at the pairs of the new port */
+	if (fwd_queue)
+		fwd_list_update();
+	return vid;
+}
+
+/* detaches the rvif of the port, and unmaps it unless it is in a pool file */
+static int port_detach(unsigned short vid)
 {
+	struct rvif *vif;
+	if (vid >= vs->max_port || !(vif = vs->port[vid].vif) || rvs_vif_detach(vs, vid, vif))
+		return -1;
+	/*
+	 * rvs no longer uses the rvif, and the workers may still look at its
+	 * rings; fwd_list_update() waits for their iterations before freeing
+	 * the old list, and the later ones see the port without the rvif
+	 */
+	fwd_list_update();
+	if (port_mem[vid].size)
+		rvif_mem_close(&port_mem[vid]);
+	printf("port[%u]: detached\n", vid);
 	return 0;
 }
 
-static _Atomic unsigned long fwd_cnt = 0;
+/*
+ * serves the control socket; a client sends lines of "attach file", which
+ * replies the port, or "detach port", which replies "ok", and a failed
+ * command replies "error"
+ */
+static void *ctl_th(void *data)
+{
+	int sfd;
+	{
+		struct sockaddr_un sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		assert(strlen((const char *) data) < sizeof(sa.sun_path));
+		strcpy(sa.sun_path, (const char *) data);
+		unlink(sa.sun_path);
+		assert((sfd = socket(AF_UNIX, SOCK_STREAM, 0)) != -1);
+		assert(!bind(sfd, (struct sockaddr *) &sa, sizeof(sa)));
+		assert(!listen(sfd, 8));
+	}
+	while (1) {
+		int fd;
+		FILE *f;
+		char line[PATH_MAX + 16];
+		if ((fd = accept(sfd, NULL, NULL)) == -1)
+			continue;
+		assert((f = fdopen(fd, "r")) != NULL);
+		while (fgets(line, sizeof(line), f)) {
+			char arg[PATH_MAX];
+			unsigned short vid;
+			if (sscanf(line, "attach %4095s", arg) == 1) {
+				int ret = port_attach(arg, 0);
+				if (ret < 0)
+					dprintf(fd, "error\n");
+				else
+					dprintf(fd, "%d\n", ret);
+			} else if (sscanf(line, "detach %hu", &vid) == 1)
+				dprintf(fd, "%s\n", (port_detach(vid) ? "error" : "ok"));
+			else
+				dprintf(fd, "error\n");
+			fflush(stdout);
+		}
+		fclose(f);
+	}
+	close(sfd);
+	return NULL;
+}
 
 static void *monitor_th(void *data __attribute__((unused)))
 {
+	unsigned long *prev, *diff;
+	assert((prev = calloc(num_worker, sizeof(unsigned long))) != NULL);
+	assert((diff = calloc(num_worker, sizeof(unsigned long))) != NULL);
 	while (1) {
 		sleep(1);
+		rvs_ft_tick(vs);
 		{
-			unsigned long cnt = fwd_cnt;
-			fwd_cnt = 0;
-			printf("%4lu.%06lu Mpps\n", cnt / 1000000UL, cnt % 1000000UL);
+			unsigned long cnt = 0;
+			{
+				unsigned short i;
+				for (i = 0; i < num_worker; i++) {
+					unsigned long c = atomic_load_explicit(&worker[i].cnt, memory_order_relaxed);
+					diff[i] = c - prev[i];
+					prev[i] = c;
+					cnt += diff[i];
+				}
+			}
+			printf("%4lu.%06lu Mpps", cnt / 1000000UL, cnt % 1000000UL);
+			if (num_worker > 1) {
+				unsigned short i;
+				printf(" (");
+				for (i = 0; i < num_worker; i++)
+					printf(" %lu.%03lu", diff[i] / 1000000UL, (diff[i] % 1000000UL) / 1000UL);
+				printf(" )");
+			}
+			if (vs->mirror_drop)
+				printf(" (mirror drop %lu)", __atomic_load_n(&vs->mirror_drop, __ATOMIC_RELAXED));
+			printf("\n");
 		}
 	}
+	free(diff);
+	free(prev);
 	pthread_exit(NULL);
 }
 
 int main(int argc, char *const *argv)
 {
-	unsigned short num_port = 0, batch_size = 512;
-	struct rvs *vs;
-
-	assert((vs = malloc(sizeof(struct rvs))) != NULL);
+	unsigned short ft_age = RVS_FT_AGE;
+	unsigned long ft_ent = 0;
+	int core[CPU_SETSIZE];
+	const char *stat_path = NULL, *route_path = NULL, *ctl_path = NULL;
 
 	assert(sizeof(pthread_rwlock_t) < RVS_LOCK_BUF_SIZE);
 
-	assert(!rvs_init(vs));
+	{
+		/* the rvs instance is sized for the ports of -m and -p, or for all the ports with the control socket */
+		unsigned short max_port = 0;
+		int ch, ctl = 0;
+		opterr = 0;
+		while ((ch = getopt(argc, argv, FWD_OPTS)) != -1) {
+			if (ch == 'm')
+				max_port++;
+			else if (ch == 'p' && strchr(optarg, ':')) {
+				unsigned short num_vif;
+				if (sscanf(strchr(optarg, ':') + 1, "%hu", &num_vif) == 1)
+					max_port += num_vif;
+			} else if (ch == 'u')
+				ctl = 1;
+		}
+		opterr = 1;
+		optind = 1;
+		if (ctl || !max_port || max_port > RVS_MAX_PORT)
+			max_port = RVS_MAX_PORT;
+		assert((vs = malloc(rvs_size(max_port, RVIF_MAX_QUEUE))) != NULL);
+		assert(!rvs_init(vs, max_port, RVIF_MAX_QUEUE));
+	}
 
 	{
 		int ch;
-		while ((ch = getopt(argc, argv, "b:m:")) != -1) {
+		while ((ch = getopt(argc, argv, FWD_OPTS)) != -1) {
 			switch (ch) {
+				case 'a':
+					assert(sscanf(optarg, "%hu", &ft_age) == 1);
+					break;
 				case 'b':
 					assert(sscanf(optarg, "%hu", &batch_size));
 					break;
+				case 'c':
+					{
+						char *c;
+						for (c = strtok(optarg, ","); c; c = strtok(NULL, ",")) {
+							int from, to;
+							switch (sscanf(c, "%d-%d", &from, &to)) {
+							case 1:
+								to = from;
+								break;
+							case 2:
+								break;
+							default:
+								assert(0);
+								break;
+							}
+							assert(0 <= from && from <= to);
+							for (; from <= to; from++) {
+								assert(num_worker < sizeof(core) / sizeof(core[0]));
+								core[num_worker++] = from;
+							}
+						}
+					}
+					break;
+				case 'C':
+					{
+						unsigned short i;
+						for (i = 0; i < RVS_COPY_NUM; i++) {
+							if (!strcmp(copy_name[i], optarg))
+								break;
+						}
+						assert(i < RVS_COPY_NUM);
+						assert(!rvs_copy_select(vs, i));
+					}
+					break;
+				case 'F':
+					assert(sscanf(optarg, "%lu", &ft_ent) == 1);
+					break;
+				case 'i':
+					assert(sscanf(optarg, "%lu", &idle_us) == 1);
+					break;
+				case 'l':
+					{
+						unsigned long timeout = FWD_HOL_TIMEOUT_US;
+						if (strchr(optarg, ':'))
+							assert(sscanf(strchr(optarg, ':') + 1, "%lu", &timeout) == 1);
+						assert(timeout);
+						if (!strncmp(optarg, "all", 3))
+							lossless_all = timeout;
+						else {
+							unsigned short vid;
+							assert(sscanf(optarg, "%hu", &vid) == 1);
+							assert(!rvs_port_lossless(vs, vid, timeout));
+							printf("port[%u] is lossless (timeout %lu us)\n", vid, timeout);
+						}
+					}
+					break;
+				case 'M':
+					{
+						unsigned short vid;
+						assert(sscanf(optarg, "%hu", &vid) == 1);
+						assert(!rvs_mirror_set(vs, vid));
+						printf("port[%u] is the monitor port\n", vid);
+					}
+					break;
+				case 'n':
+					assert(sscanf(optarg, "%hu", &nt_thresh) == 1);
+					break;
 				case 'm':
+					assert(port_attach(optarg, 1) >= 0);
+					break;
+				case 'p':
 					{
-						struct stat st;
-						assert(!stat(optarg, &st));
+						unsigned short num_vif;
+						assert(strchr(optarg, ':'));
+						assert(sscanf(strchr(optarg, ':') + 1, "%hu", &num_vif) == 1);
+						*strchr(optarg, ':') = '\0';
 						{
-							int fd;
-							assert((fd = open(optarg, O_RDWR)) != -1);
+							/* the mapping stays for the process, and port_mem of the ports in the pool is empty */
+							struct rvif_mem m;
+							assert(!rvif_mem_open(&m, optarg, 0, RVIF_MEM_PREFAULT));
+							assert(RVIF_POOL_VIF_SIZE * num_vif < m.size);
 							{
-								void *mem;
-								assert((mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
-								printf("port[%u]: %s (%p)\n", num_port, optarg, mem);
-								assert(!rvs_vif_attach(vs, num_port++, (struct rvif *) mem));
+								unsigned short i;
+								unsigned long buf_size = RVS_BUF_SIZE;
+								vif_wait_init((struct rvif *) m.mem);
+								/* the pool is a multiple of the buffer size, which is the same for the rvifs sharing it */
+								if (RVIF_VERSION(m.mem) == RVIF_VERSION_3)
+									buf_size = ((struct rvif3 *) m.mem)->buf_size;
+								assert(buf_size && RVIF_POOL_VIF_SIZE * num_vif + buf_size <= m.size);
+								for (i = 0; i < num_vif; i++) {
+									vif_wait_init((struct rvif *)((unsigned long) m.mem + RVIF_POOL_VIF_SIZE * i));
+									assert(!rvs_vif_attach_pool(vs, num_port,
+												(struct rvif *)((unsigned long) m.mem + RVIF_POOL_VIF_SIZE * i),
+												(void *)((unsigned long) m.mem + RVIF_POOL_VIF_SIZE * num_vif),
+												((m.size - RVIF_POOL_VIF_SIZE * num_vif) / buf_size) * buf_size));
+									printf("port[%u]: %s (%p) pool[%u] rvif version %u\n", num_port, optarg, (void *)((unsigned long) m.mem + RVIF_POOL_VIF_SIZE * i), i, vs->port[num_port].ver);
+									num_port++;
+								}
 							}
 						}
 					}
 					break;
+				case 'r':
+					route_path = optarg;
+					break;
+				case 'R':
+					{
+						unsigned char key[RVS_RSS_KEY_LEN];
+						unsigned short func;
+						if (!strncmp(optarg, "toeplitz", 8))
+							func = RVS_RSS_TOEPLITZ;
+						else if (!strncmp(optarg, "crc32", 5))
+							func = RVS_RSS_CRC32;
+						else
+							assert(0);
+						if (strchr(optarg, ':')) {
+							/* the key in hex, RVS_RSS_KEY_LEN bytes at most, the rest is zero */
+							const char *h = strchr(optarg, ':') + 1;
+							unsigned short i;
+							memset(key, 0, sizeof(key));
+							for (i = 0; i < RVS_RSS_KEY_LEN && h[0] && h[1]; i++, h += 2) {
+								unsigned int b;
+								assert(sscanf(h, "%2x", &b) == 1);
+								key[i] = (unsigned char) b;
+							}
+							assert(!h[0]);
+							assert(!rvs_rss_set(vs, func, key));
+						} else
+							assert(!rvs_rss_set(vs, func, NULL));
+						printf("rss: %s%s\n", (func == RVS_RSS_TOEPLITZ ? "toeplitz" : "crc32"),
+								(func == RVS_RSS_CRC32 && vs->rss[vs->cur_rss].hw ? " (sse4.2)" : ""));
+					}
+					break;
+				case 's':
+					stat_path = optarg;
+					break;
+				case 'u':
+					ctl_path = optarg;
+					break;
+				case 'X':
+					{
+						unsigned short vid, dir = 0;
+						char d[4] = { 0 };
+						assert(sscanf(optarg, "%hu:%3s", &vid, d) == 2);
+						if (strchr(d, 'i'))
+							dir |= RVS_MIRROR_INGRESS;
+						if (strchr(d, 'e'))
+							dir |= RVS_MIRROR_EGRESS;
+						assert(dir);
+						assert(!rvs_port_mirror(vs, vid, dir));
+					}
+					break;
 			}
 		}
 	}
 
+	{
+		unsigned short i;
+		for (i = 0; i < num_port; i++)
+			assert(!rvs_port_copy_nt(vs, i, nt_thresh));
+	}
+
+	if (lossless_all) {
+		unsigned short i;
+		for (i = 0; i < num_port; i++)
+			assert(!rvs_port_lossless(vs, i, lossless_all));
+		printf("all ports are lossless (timeout %lu us)\n", lossless_all);
+	}
+
+	if (ft_ent) {
+		unsigned long size = ((ft_ent + RVS_FT_WAY - 1) / RVS_FT_WAY) * sizeof(struct rvs_ft_bucket);
+		void *mem;
+		assert((mem = aligned_alloc(64, size)) != NULL);
+		assert(!rvs_ft_setup(vs, mem, size, ft_age));
+		printf("forwarding table: %lu buckets (%u ways), age %u sec\n", (vs->ft.tbl[vs->cur_ft].mask + 1), RVS_FT_WAY, ft_age);
+	} else
+		assert(!rvs_ft_setup(vs, NULL, 0, ft_age));
+
+	if (route_path)
+		route_load(route_path);
+
+	printf("copy: %s\n", copy_name[vs->copy]);
+
+	if (idle_us)
+		printf("workers sleep after %lu usec idle\n", idle_us);
+
+	if (!num_worker)
+		core[num_worker++] = -1;
+
+	{
+		/* the pairs of the ports attached later through the control socket are there in advance */
+		assert((fwd_queue = aligned_alloc(64, sizeof(struct fwd_queue) * vs->max_port * RVIF_MAX_QUEUE)) != NULL);
+		{
+			unsigned int i;
+			for (i = 0; i < (unsigned int) vs->max_port * RVIF_MAX_QUEUE; i++) {
+				fwd_queue[i].vid = i / RVIF_MAX_QUEUE;
+				fwd_queue[i].qid = i % RVIF_MAX_QUEUE;
+				atomic_init(&fwd_queue[i].busy, 0);
+			}
+		}
+		fwd_list_update();
+	}
+
+	{
+		assert((worker = aligned_alloc(64, sizeof(struct fwd_worker) * num_worker)) != NULL);
+		{
+			unsigned short i;
+			for (i = 0; i < num_worker; i++) {
+				worker[i].core = core[i];
+				worker[i].id = i;
+				atomic_init(&worker[i].cnt, 0);
+				atomic_init(&worker[i].seq, 0);
+				worker[i].stat = NULL;
+				if (core[i] >= 0)
+					printf("worker[%u]: core %d\n", i, core[i]);
+			}
+		}
+		if (stat_path) {
+			/* a worker has the counters of the ports and queues of vs, not of RVS_MAX_PORT and RVIF_MAX_QUEUE */
+			unsigned long size = RVS_STAT_SIZE(vs->max_port, vs->max_queue);
+			int fd;
+			assert((fd = open(stat_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) != -1);
+			assert(!ftruncate(fd, sizeof(struct rvs_stat_hdr) + size * num_worker));
+			{
+				void *mem;
+				assert((mem = mmap(NULL, sizeof(struct rvs_stat_hdr) + size * num_worker,
+								PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
+				{
+					struct rvs_stat_hdr *hdr = (struct rvs_stat_hdr *) mem;
+					unsigned short i;
+					/* ftruncate zero-fills the counters */
+					for (i = 0; i < num_worker; i++)
+						worker[i].stat = (struct rvs_stat *)((unsigned long) mem + sizeof(struct rvs_stat_hdr) + size * i);
+					hdr->num = num_worker;
+					hdr->num_port = num_port;
+					hdr->max_port = vs->max_port;
+					hdr->max_queue = vs->max_queue;
+					__atomic_store_n(&hdr->magic, RVS_STAT_MAGIC, __ATOMIC_RELEASE);
+					stat_hdr = hdr;
+				}
+			}
+			close(fd);
+			printf("stats: %s\n", stat_path);
+		}
+	}
+
 	{
 		pthread_t th;
 
 		assert(!pthread_create(&th, NULL, monitor_th, NULL));
 
+		if (ctl_path) {
+			pthread_t ctl;
+			assert(!pthread_create(&ctl, NULL, ctl_th, (void *) ctl_path));
+			assert(!pthread_detach(ctl));
+			printf("control: %s\n", ctl_path);
+		}
+
 		printf("-- FWD --\n");
-		while (1) {
+		{
 			unsigned short i;
-			for (i = 0; i < num_port; i++) {
-				unsigned short j;
-				for (j = 0; j < vs->port[i].vif->num; j++)
-					fwd_cnt += rvs_fwd(vs, i, j, batch_size);
-			}
+			for (i = 1; i < num_worker; i++)
+				assert(!pthread_create(&worker[i].th, NULL, fwd_th, &worker[i]));
+		}
+
+		fwd_th(&worker[0]);
+
+		{
+			unsigned short i;
+			for (i = 1; i < num_worker; i++)
+				pthread_join(worker[i].th, NULL);
 		}
 
 		pthread_join(th, NULL);
 	}
 
+	free(worker);
+	free(atomic_load_explicit(&fwd_list, memory_order_relaxed));
+	free(fwd_queue);
+
 	assert(!rvs_exit(vs));
 
 	free(vs);
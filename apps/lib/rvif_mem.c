@@ -0,0 +1,244 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+
+#include <linux/magic.h>
+#include <linux/mempolicy.h>
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE (23) /* Linux 5.14 */
+#endif
+
+#define ROUND_UP(_v, _a) ((((_v) + (_a) - 1) / (_a)) * (_a))
+
+static unsigned long fs_page_size(const struct statfs *sfs)
+{
+	return (sfs->f_type == HUGETLBFS_MAGIC ? (unsigned long) sfs->f_bsize : (unsigned long) sysconf(_SC_PAGESIZE));
+}
+
+/* the page size of the file system of path, which may not exist yet, or 0 on failure */
+unsigned long rvif_mem_page_size(const char *path)
+{
+	struct statfs sfs;
+	if (statfs(path, &sfs)) {
+		char dir[PATH_MAX];
+		if (strlen(path) >= sizeof(dir))
+			return 0;
+		strcpy(dir, path);
+		if (statfs(dirname(dir), &sfs))
+			return 0;
+	}
+	return fs_page_size(&sfs);
+}
+
+/*
+ * maps the rvif file at path; with RVIF_MEM_CREATE, the file is created,
+ * or extended, to size bytes rounded up to the page size, otherwise, the
+ * file has to exist and size is ignored; returns 0, or -1 on failure
+ */
+int rvif_mem_open(struct rvif_mem *m, const char *path, unsigned long size, unsigned int flags)
+{
+	int fd, ret = -1;
+	if ((fd = open(path, O_RDWR | (flags & RVIF_MEM_CREATE ? O_CREAT : 0), 0644)) == -1)
+		return -1;
+	{
+		struct statfs sfs;
+		struct stat st;
+		if (fstatfs(fd, &sfs) || fstat(fd, &st))
+			goto out;
+		m->page_size = fs_page_size(&sfs);
+		if (flags & RVIF_MEM_CREATE) {
+			size = ROUND_UP(size, m->page_size);
+			if ((unsigned long) st.st_size < size && ftruncate(fd, size))
+				goto out;
+		}
+		if ((unsigned long) st.st_size > size)
+			size = st.st_size;
+		if (!size)
+			goto out;
+		m->size = ROUND_UP(size, m->page_size);
+		if ((m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | (flags & RVIF_MEM_PREFAULT ? MAP_POPULATE : 0), fd, 0)) == MAP_FAILED)
+			goto out;
+		/* tmpfs gives huge pages on request if shmem_enabled of transparent_hugepage is advise */
+		if (sfs.f_type != HUGETLBFS_MAGIC)
+			madvise(m->mem, m->size, MADV_HUGEPAGE);
+		ret = 0;
+	}
+out:
+	close(fd);
+	return ret;
+}
+
+void rvif_mem_close(struct rvif_mem *m)
+{
+	munmap(m->mem, m->size);
+	m->mem = NULL;
+	m->size = 0;
+}
+
+/*
+ * makes the pages of [off, off + len) of the mapping be allocated on the
+ * NUMA node, or on another one if the node has none left; the range is
+ * aligned to the page size, and the pages already allocated are not moved
+ */
+int rvif_mem_bind(struct rvif_mem *m, unsigned long off, unsigned long len, int node)
+{
+	unsigned long mask[1024 / (sizeof(unsigned long) * 8)];
+	if (node < 0 || (unsigned long) node >= sizeof(mask) * 8
+			|| off % m->page_size || len % m->page_size || off + len > m->size)
+		return -1;
+	memset(mask, 0, sizeof(mask));
+	mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+	return (syscall(SYS_mbind, (unsigned long) m->mem + off, len, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, 0) ? -1 : 0);
+}
+
+/* allocates the pages of [off, off + len) of the mapping without changing the contents */
+void rvif_mem_prefault(struct rvif_mem *m, unsigned long off, unsigned long len)
+{
+	if (off + len > m->size)
+		len = m->size - off;
+	if (madvise((char *) m->mem + off, len, MADV_POPULATE_WRITE)) {
+		/* a write fault for each page, which does not disturb the other writers */
+		unsigned long p;
+		for (p = off - off % m->page_size; p < off + len; p += m->page_size)
+			__atomic_fetch_add((char *) m->mem + p, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* the NUMA node of the CPU core, or -1 if it is unknown */
+int rvif_cpu_node(int cpu)
+{
+	int node = -1;
+	char path[64];
+	DIR *d;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((d = opendir(path)) != NULL) {
+		struct dirent *e;
+		while ((e = readdir(d)) != NULL) {
+			if (sscanf(e->d_name, "node%d", &node) == 1)
+				break;
+			node = -1;
+		}
+		closedir(d);
+	}
+	return node;
+}
+
+/* sets buf_off, queue_size, and size of the layout from the other members */
+void rvif_layout(struct rvif_layout *l, unsigned long align)
+{
+	if (align < 0x1000)
+		align = 0x1000;
+	l->buf_off = ROUND_UP(RVIF_SIZE(l->ver), align);
+	l->queue_size = ROUND_UP(2UL * l->num_slot * l->buf_size, align);
+	l->size = l->buf_off + l->queue_size * l->num_queue;
+}
+
+/*
+ * writes the header, the rings, and the slots of the rvif by the layout, and
+ * leaves num zero, which the caller sets when it has finished the setup
+ */
+void rvif_format(struct rvif *vif, const struct rvif_layout *l)
+{
+	/* rvs regards an rvif whose num is zero as not initialized yet */
+	vif->num = 0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	((struct rvif_hdr *) vif)->magic = RVIF_MAGIC;
+	((struct rvif_hdr *) vif)->version = l->ver;
+	if (l->ver == RVIF_VERSION_3)
+		((struct rvif3 *) vif)->buf_size = l->buf_size;
+	{
+		unsigned int i;
+		for (i = 0; i < l->num_queue; i++) {
+			unsigned long off = l->buf_off + l->queue_size * i;
+			unsigned short j;
+			for (j = 0; j < 2; j++) {
+				unsigned short k;
+				RVIF_RING(vif, l->ver, i, j, num) = l->num_slot;
+				RVIF_RING(vif, l->ver, i, j, head) = 0;
+				RVIF_RING(vif, l->ver, i, j, tail) = 0;
+				RVIF_RING(vif, l->ver, i, j, event) = RVIF_EVENT_NONE;
+				for (k = 0; k < l->num_slot; k++) {
+					RVIF_SLOT(vif, l->ver, i, j, k, off) = off;
+					RVIF_SLOT(vif, l->ver, i, j, k, len) = 0;
+					if (l->ver == RVIF_VERSION_3)
+						((struct rvif3 *) vif)->queue[i].ring[j].slot[k].flags = 0;
+					off += l->buf_size;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * whether the initialized rvif in a mapping of size bytes is sane, that is,
+ * the rings are in range and the buffers of the slots are 64-byte aligned and
+ * in the mapping after the rings; returns 0, or -1 if it is not
+ */
+int rvif_check(const struct rvif *vif, unsigned long size)
+{
+	unsigned int ver, buf_size = 2048;
+	if (size < sizeof(struct rvif_hdr))
+		return -1;
+	ver = RVIF_VERSION(vif);
+	if ((ver != RVIF_VERSION_1 && ver != RVIF_VERSION_2 && ver != RVIF_VERSION_3) || size < RVIF_SIZE(ver))
+		return -1;
+	if (ver == RVIF_VERSION_3) {
+		buf_size = ((const struct rvif3 *) vif)->buf_size;
+		if (!buf_size || buf_size % 64 || buf_size > 0xffff)
+			return -1;
+	}
+	if (!vif->num || vif->num > RVIF_MAX_QUEUE)
+		return -1;
+	{
+		unsigned int i;
+		for (i = 0; i < vif->num; i++) {
+			unsigned short j;
+			for (j = 0; j < 2; j++) {
+				unsigned short num = RVIF_RING(vif, ver, i, j, num), k;
+				if (!num || num > RVIF_MAX_SLOT
+						|| RVIF_RING(vif, ver, i, j, head) >= num || RVIF_RING(vif, ver, i, j, tail) >= num)
+					return -1;
+				for (k = 0; k < num; k++) {
+					unsigned long off = RVIF_SLOT(vif, ver, i, j, k, off);
+					/* rvs rounds up a copy to 64 bytes, which overruns the buffer not starting at a 64-byte boundary */
+					if (off % 64 || off < RVIF_SIZE(ver) || off > size - buf_size)
+						return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
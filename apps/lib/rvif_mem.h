@@ -0,0 +1,67 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _RVIF_MEM_H
+#define _RVIF_MEM_H
+
+#include <rvif.h>
+
+/*
+ * the memory of rvifs for the applications on Linux; an rvif is a file on
+ * tmpfs (e.g., /dev/shm) or hugetlbfs, whose page size is taken from the
+ * file system, thus, a file on a hugetlbfs mount with pagesize=2M or 1G
+ * gets 2 MB or 1 GB pages
+ */
+
+#define RVIF_MEM_CREATE (1U << 0) /* creates the file, or extends it, to the given size */
+#define RVIF_MEM_PREFAULT (1U << 1) /* maps all the pages at once */
+
+/* a mapping of an rvif file */
+struct rvif_mem {
+	void *mem;
+	unsigned long size; /* of the mapping, a multiple of page_size */
+	unsigned long page_size;
+};
+
+/*
+ * the layout of an rvif whose buffers follow the rings; the buffers of queue
+ * i are at buf_off + queue_size * i, and both are multiples of the alignment
+ * given to rvif_layout(), so that the buffers of a queue can have their own
+ * NUMA policy
+ */
+struct rvif_layout {
+	unsigned int ver;
+	unsigned int num_queue;
+	unsigned short num_slot; /* of each ring */
+	unsigned int buf_size;
+	unsigned long buf_off;
+	unsigned long queue_size;
+	unsigned long size;
+};
+
+unsigned long rvif_mem_page_size(const char *path);
+int rvif_mem_open(struct rvif_mem *m, const char *path, unsigned long size, unsigned int flags);
+void rvif_mem_close(struct rvif_mem *m);
+int rvif_mem_bind(struct rvif_mem *m, unsigned long off, unsigned long len, int node);
+void rvif_mem_prefault(struct rvif_mem *m, unsigned long off, unsigned long len);
+int rvif_cpu_node(int cpu);
+void rvif_layout(struct rvif_layout *l, unsigned long align);
+void rvif_format(struct rvif *vif, const struct rvif_layout *l);
+int rvif_check(const struct rvif *vif, unsigned long size);
+
+#endif
@@ -16,7 +16,11 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <rvif.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,22 +28,173 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <limits.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/futex.h>
 
 #include <arpa/inet.h>
 
 #include <pthread.h>
+#include <sched.h>
+
+/* a frame larger than buf_size is put on multiple slots of an rvif of version 3 */
+#define PKT_LEN_MAX (9216)
 
 static short pkt_len = 64;
 static int mode_rx = 1;
 static struct rvif *vif = NULL;
+static char (*pool_pkt)[PKT_LEN_MAX] = NULL;
+static char (*pkt_tmpl)[PKT_LEN_MAX] = NULL; /* the frame to be sent by each thread */
+static unsigned long idle_us = 0, rate = 0; /* rate, if not 0, limits the TX or RX packets per second */
+static unsigned int vif_ver = RVIF_VERSION_2;
+static unsigned int buf_size = 2048;
+static int core[CPU_SETSIZE]; /* the i-th thread runs on core[i % num_core] */
+static unsigned int num_core = 0;
+
+#define RING(_qid, _r, _field) RVIF_RING(vif, vif_ver, _qid, _r, _field)
+#define SLOT(_qid, _r, _s, _field) RVIF_SLOT(vif, vif_ver, _qid, _r, _s, _field)
+#define SLOT_FLAGS(_qid, _r, _s) (((struct rvif3 *) vif)->queue[_qid].ring[_r].slot[_s].flags)
+
+/* a sleeping rx thread wakes up after this period even if rvs does not request it */
+#define RX_SLEEP_TIMEOUT_US (10000)
 
 static _Atomic unsigned char global_counter_id = 0;
 static _Atomic unsigned long global_pkt_cnt[2] = { 0 };
 static _Atomic unsigned long global_pkt_byte[2] = { 0 };
 
+/*
+ * in the latency mode, a tx thread puts pkt_stamp at the top of the UDP
+ * payload of each packet, and an rx thread records the latency of it
+ * in a log-linear histogram, which has LAT_SUB buckets for each power
+ * of two, and detects lost and reordered packets by the sequence number;
+ * the sequence numbers are counted for each flow of a tx thread, because
+ * the flows may be spread over the rx threads by the flow hash, and the
+ * flows beyond LAT_FLOW_MAX share the counters
+ */
+struct pkt_stamp {
+	unsigned long seq; /* the tx thread, the flow, and the sequence number of the flow */
+	unsigned long ts; /* CLOCK_MONOTONIC in nanosecond, zero for a packet without the stamp */
+};
+
+#define LAT_FLOW_MAX (1024)
+
+#define PKT_STAMP_OFF (42)
+#define PKT_STAMP(_stream, _flow, _seq) (((unsigned long)(_stream) << 48) | ((unsigned long)(_flow) << 32) | (_seq))
+#define PKT_STAMP_STREAM(_seq) ((_seq) >> 48)
+#define PKT_STAMP_FLOW(_seq) (((_seq) >> 32) & 0xffff)
+#define PKT_STAMP_SEQ(_seq) ((unsigned int)(_seq))
+
+#define LAT_SUB_BITS (5)
+#define LAT_SUB (1U << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct lat_stat {
+	unsigned long hist[2][LAT_BUCKETS]; /* indexed by global_counter_id */
+	unsigned long max[2];
+	unsigned long lost[2];
+	unsigned long reordered[2];
+	unsigned int (*next)[LAT_FLOW_MAX]; /* the sequence number expected next for each flow of each tx thread */
+};
+
+static int latency = 0;
+static int rewrite = 0; /* write the headers of every packet, as a router on the path modifies them */
+static struct lat_stat *lat_stat = NULL;
+
+/*
+ * a traffic profile cycles through num_flow_src sources and num_flow_dst
+ * destinations, and the packet sizes of size_seq; the one's complement
+ * sums of the header fields of each of them are computed in advance,
+ * thus, the checksums of a packet are the sums of three partial ones
+ */
+struct flow_ep {
+	unsigned char mac[6];
+	unsigned int ip4_be;
+	unsigned short port_be;
+	unsigned int ip_sum; /* the sum of the address */
+	unsigned int udp_sum; /* the sum of the address and the port */
+};
+
+struct pkt_size {
+	unsigned short len;
+	unsigned short ip_len_be;
+	unsigned short udp_len_be;
+	unsigned int ip_sum; /* the sum of the IP header except the addresses */
+	unsigned int udp_sum; /* the sum of the pseudo header except the addresses, the UDP length, and the payload */
+};
+
+#define PKT_SIZE_MAX (16)
+#define SIZE_SEQ_MAX (256)
+
+static struct flow_ep *flow_src = NULL, *flow_dst = NULL;
+static unsigned int num_flow_src = 1, num_flow_dst = 1;
+static struct pkt_size pkt_size[PKT_SIZE_MAX] = { { .len = 64, }, };
+static unsigned short size_weight[PKT_SIZE_MAX] = { 1, };
+static unsigned int num_size = 1;
+static unsigned char size_seq[SIZE_SEQ_MAX] = { 0 }; /* indexes of pkt_size */
+static unsigned int size_seq_len = 1;
+
+/*
+ * the replay mode sends the frames of a pcap file, which is mapped
+ * by mmap, and the i-th frame is sent by the (i % num_thread)-th thread
+ */
+struct rep_pkt {
+	unsigned long off; /* the frame data in rep_map */
+	unsigned long ts; /* nanosecond from the first frame */
+	unsigned short len;
+};
+
+static int replay = 0, rep_timing = 0;
+static const char *rep_map = NULL;
+static struct rep_pkt *rep_pkt = NULL;
+static unsigned long rep_cnt = 0, rep_loop = 1; /* rep_loop 0 means forever */
+static _Atomic unsigned int rep_done = 0; /* the number of the threads that have finished */
+
+/*
+ * an rx thread copies the received frames to one of its two buffers,
+ * and passes it to the writer thread when it is full or the thread is
+ * idle; the frames are dropped if the writer has not finished the other
+ */
+#define CAP_BUF_SIZE (4UL << 20)
+
+struct cap_buf {
+	char *b[2];
+	unsigned long len[2];
+	_Atomic int full[2]; /* set by the rx thread, and cleared by the writer */
+	int cur;
+	int skip; /* the current frame is dropped */
+	unsigned long hdr; /* the record header of the current frame in b[cur] */
+	_Atomic unsigned long drop;
+};
+
+static FILE *cap_file = NULL;
+static struct cap_buf *cap_buf = NULL;
+
+struct pcap_hdr {
+	unsigned int magic;
+	unsigned short ver_major;
+	unsigned short ver_minor;
+	int thiszone;
+	unsigned int sigfigs;
+	unsigned int snaplen;
+	unsigned int network;
+};
+
+struct pcap_rec {
+	unsigned int ts_sec;
+	unsigned int ts_frac; /* microsecond or nanosecond */
+	unsigned int incl_len;
+	unsigned int orig_len;
+};
+
+#define PCAP_MAGIC_US (0xa1b2c3d4)
+#define PCAP_MAGIC_NS (0xa1b23c4d)
+#define PCAP_LINKTYPE_ETHERNET (1)
+
 struct udp_pseudo {
 	unsigned int src;
 	unsigned int dst;
@@ -102,46 +257,568 @@ struct bchain {
 	(unsigned short)~((unsigned short) _r); \
 })
 
+/* the one's complement sum of big-endian 16-bit words, not folded */
+static unsigned int csum_add(unsigned int sum, const void *b, unsigned short len)
+{
+	unsigned short i;
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (((const unsigned char *) b)[i] << 8) | ((const unsigned char *) b)[i + 1];
+	if (len % 2)
+		sum += ((const unsigned char *) b)[len - 1] << 8;
+	return sum;
+}
+
+static unsigned short csum_fold(unsigned int sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (unsigned short) ~sum;
+}
+
+static void flow_ep_init(struct flow_ep *ep, const char *mac, int ip4_be, short port, unsigned int k)
+{
+	memcpy(ep->mac, mac, 6);
+	{ /* k is added to the lower 16 bits of the MAC address */
+		unsigned short v = ((ep->mac[4] << 8) | ep->mac[5]) + k;
+		ep->mac[4] = v >> 8;
+		ep->mac[5] = v & 0xff;
+	}
+	ep->ip4_be = htonl(ntohl(ip4_be) + k);
+	ep->port_be = htons(port + k);
+	ep->ip_sum = csum_add(0, &ep->ip4_be, 4);
+	ep->udp_sum = csum_add(ep->ip_sum, &ep->port_be, 2);
+}
+
+static void pkt_size_init(struct pkt_size *ps, const char *pkt)
+{
+	struct udpkt p;
+	memcpy(&p, pkt, sizeof(p));
+	ps->ip_len_be = htons(ps->len - 14);
+	ps->udp_len_be = htons(ps->len - 34);
+	p.ip4.len_be = ps->ip_len_be;
+	p.ip4.src_be = p.ip4.dst_be = 0;
+	p.ip4.csum_be = 0;
+	ps->ip_sum = csum_add(0, &p.ip4, sizeof(p.ip4));
+	ps->udp_sum = p.ip4.proto;
+	ps->udp_sum = csum_add(ps->udp_sum, &ps->udp_len_be, 2); /* pseudo header */
+	ps->udp_sum = csum_add(ps->udp_sum, &ps->udp_len_be, 2); /* UDP header */
+	ps->udp_sum = csum_add(ps->udp_sum, &pkt[42], ps->len - 42);
+}
+
+/* writes the headers of a packet of the size and the flow */
+static void pkt_hdr(char *b, const struct pkt_size *ps, const struct flow_ep *src, const struct flow_ep *dst)
+{
+	struct udpkt *p = (struct udpkt *) b;
+	memcpy(p->eth.dst, dst->mac, 6);
+	memcpy(p->eth.src, src->mac, 6);
+	p->ip4.len_be = ps->ip_len_be;
+	p->ip4.ttl = 64; /* as the template, which the checksum is computed with */
+	p->ip4.src_be = src->ip4_be;
+	p->ip4.dst_be = dst->ip4_be;
+	p->ip4.csum_be = htons(csum_fold(ps->ip_sum + src->ip_sum + dst->ip_sum));
+	p->udp.src_be = src->port_be;
+	p->udp.dst_be = dst->port_be;
+	p->udp.len_be = ps->udp_len_be;
+	if (!latency) {
+		unsigned short c = csum_fold(ps->udp_sum + src->udp_sum + dst->udp_sum);
+		p->udp.csum_be = htons(c ? c : 0xffff); /* zero means no checksum */
+	}
+}
+
+/* parses a size, or a comma-separated list of size:weight, or imix */
+static void size_parse(const char *arg)
+{
+	if (!strcmp(arg, "imix"))
+		arg = "64:7,594:4,1518:1"; /* the simple IMIX */
+	num_size = 0;
+	while (1) {
+		unsigned short len, w = 1;
+		int n;
+		assert(num_size < PKT_SIZE_MAX);
+		if (sscanf(arg, "%hu:%hu%n", &len, &w, &n) != 2) {
+			w = 1;
+			assert(sscanf(arg, "%hu%n", &len, &n) == 1);
+		}
+		assert(42 <= len && len <= PKT_LEN_MAX && w);
+		pkt_size[num_size].len = len;
+		size_weight[num_size++] = w;
+		if (pkt_len < (short) len)
+			pkt_len = len;
+		if (arg[n] != ',')
+			break;
+		arg += n + 1;
+	}
+}
+
+/* repeats each size by its weight, and interleaves them */
+static void size_seq_build(void)
+{
+	unsigned int i, j, k = 0, x = 1;
+	for (i = 0; i < num_size; i++) {
+		for (j = 0; j < size_weight[i]; j++) {
+			assert(k < SIZE_SEQ_MAX);
+			size_seq[k++] = i;
+		}
+	}
+	size_seq_len = k;
+	for (i = k - 1; i > 0; i--) { /* a shuffle with a fixed seed */
+		unsigned char tmp = size_seq[i];
+		x = x * 1103515245U + 12345U;
+		j = (x >> 16) % (i + 1);
+		size_seq[i] = size_seq[j];
+		size_seq[j] = tmp;
+	}
+}
+
+static unsigned int pcap_u32(unsigned int v, int swap)
+{
+	return (swap ? __builtin_bswap32(v) : v);
+}
+
+/* maps a pcap file, and indexes the frames */
+static void rep_open(const char *path)
+{
+	unsigned long size, off, ns = 0, first = 0;
+	int swap = 0;
+	{
+		struct stat st;
+		int fd;
+		assert((fd = open(path, O_RDONLY)) != -1);
+		assert(!fstat(fd, &st));
+		size = st.st_size;
+		assert(sizeof(struct pcap_hdr) <= size);
+		assert((rep_map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED);
+		close(fd);
+		madvise((void *) rep_map, size, MADV_SEQUENTIAL);
+	}
+	{
+		const struct pcap_hdr *ph = (const struct pcap_hdr *) rep_map;
+		switch (ph->magic) {
+		case PCAP_MAGIC_US:
+			break;
+		case PCAP_MAGIC_NS:
+			ns = 1;
+			break;
+		default:
+			swap = 1;
+			assert(__builtin_bswap32(ph->magic) == PCAP_MAGIC_US || __builtin_bswap32(ph->magic) == PCAP_MAGIC_NS);
+			ns = (__builtin_bswap32(ph->magic) == PCAP_MAGIC_NS);
+			break;
+		}
+		assert(pcap_u32(ph->network, swap) == PCAP_LINKTYPE_ETHERNET);
+	}
+	{
+		unsigned long cap = 0, skip = 0;
+		for (off = sizeof(struct pcap_hdr); off + sizeof(struct pcap_rec) <= size; ) {
+			const struct pcap_rec *pr = (const struct pcap_rec *)(rep_map + off);
+			unsigned int len = pcap_u32(pr->incl_len, swap);
+			unsigned long ts = pcap_u32(pr->ts_sec, swap) * 1000000000UL + pcap_u32(pr->ts_frac, swap) * (ns ? 1UL : 1000UL);
+			if (off + sizeof(*pr) + len > size)
+				break; /* truncated */
+			if (14 <= len && len <= PKT_LEN_MAX && (vif_ver == RVIF_VERSION_3 || len <= buf_size)) {
+				if (rep_cnt == cap) {
+					cap = (cap ? cap * 2 : 1024);
+					assert((rep_pkt = realloc(rep_pkt, cap * sizeof(rep_pkt[0]))) != NULL);
+				}
+				if (!rep_cnt)
+					first = ts;
+				rep_pkt[rep_cnt].off = off + sizeof(*pr);
+				rep_pkt[rep_cnt].ts = (ts > first ? ts - first : 0);
+				rep_pkt[rep_cnt].len = len;
+				rep_cnt++;
+			} else
+				skip++;
+			off += sizeof(*pr) + len;
+		}
+		printf("%s: %lu frames (%lu frames not fitting the rvif are skipped)\n", path, rep_cnt, skip);
+		assert(rep_cnt);
+	}
+}
+
+static void cap_open(const char *path, unsigned int num_thread)
+{
+	struct pcap_hdr ph = {
+		.magic = PCAP_MAGIC_NS,
+		.ver_major = 2,
+		.ver_minor = 4,
+		.snaplen = PKT_LEN_MAX,
+		.network = PCAP_LINKTYPE_ETHERNET,
+	};
+	assert((cap_file = fopen(path, "w")) != NULL);
+	assert(fwrite(&ph, sizeof(ph), 1, cap_file) == 1);
+	assert((cap_buf = calloc(num_thread, sizeof(cap_buf[0]))) != NULL);
+	{
+		unsigned int i;
+		for (i = 0; i < num_thread; i++)
+			assert((cap_buf[i].b[0] = malloc(CAP_BUF_SIZE)) != NULL && (cap_buf[i].b[1] = malloc(CAP_BUF_SIZE)) != NULL);
+	}
+}
+
+/* passes the current buffer to the writer if the other one is available */
+static int cap_pass(struct cap_buf *cb)
+{
+	if (__atomic_load_n(&cb->full[!cb->cur], __ATOMIC_ACQUIRE))
+		return 0;
+	__atomic_store_n(&cb->full[cb->cur], 1, __ATOMIC_RELEASE);
+	cb->cur = !cb->cur;
+	cb->len[cb->cur] = 0;
+	return 1;
+}
+
+static void cap_begin(struct cap_buf *cb, unsigned long wall)
+{
+	struct pcap_rec *pr;
+	if (CAP_BUF_SIZE - cb->len[cb->cur] < sizeof(*pr) + PKT_LEN_MAX && !cap_pass(cb)) {
+		cb->skip = 1;
+		cb->drop++;
+		return;
+	}
+	cb->skip = 0;
+	cb->hdr = cb->len[cb->cur];
+	pr = (struct pcap_rec *)(cb->b[cb->cur] + cb->hdr);
+	pr->ts_sec = wall / 1000000000UL;
+	pr->ts_frac = wall % 1000000000UL;
+	pr->incl_len = pr->orig_len = 0;
+	cb->len[cb->cur] += sizeof(*pr);
+}
+
+static void cap_append(struct cap_buf *cb, const char *b, unsigned short len)
+{
+	if (!cb->skip) {
+		struct pcap_rec *pr = (struct pcap_rec *)(cb->b[cb->cur] + cb->hdr);
+		if (pr->incl_len + len > PKT_LEN_MAX)
+			len = PKT_LEN_MAX - pr->incl_len;
+		memcpy(cb->b[cb->cur] + cb->len[cb->cur], b, len);
+		cb->len[cb->cur] += len;
+		pr->incl_len += len;
+		pr->orig_len += len;
+	}
+}
+
+static void *cap_writer_fn(void *data)
+{
+	unsigned int num_thread = (unsigned int)(unsigned long) data;
+	while (1) {
+		unsigned int i, k, written = 0;
+		for (i = 0; i < num_thread; i++) {
+			for (k = 0; k < 2; k++) {
+				if (__atomic_load_n(&cap_buf[i].full[k], __ATOMIC_ACQUIRE)) {
+					assert(fwrite(cap_buf[i].b[k], 1, cap_buf[i].len[k], cap_file) == cap_buf[i].len[k]);
+					__atomic_store_n(&cap_buf[i].full[k], 0, __ATOMIC_RELEASE);
+					written = 1;
+				}
+			}
+		}
+		if (written)
+			fflush(cap_file);
+		else
+			usleep(1000);
+	}
+	pthread_exit(NULL);
+}
+
+static void ring_kick(unsigned int *ev)
+{
+	/* the update of tail has to be visible before we read the request of the consumer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(ev, __ATOMIC_RELAXED) != RVIF_EVENT_NONE) {
+		__atomic_store_n(ev, RVIF_EVENT_NONE, __ATOMIC_RELAXED);
+		syscall(SYS_futex, ev, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+static void rx_sleep(unsigned long qid)
+{
+	unsigned int *ev = &RING(qid, 0, event);
+	__atomic_store_n(ev, RVIF_EVENT_WAIT, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	/* a packet may have arrived before rvs saw our request */
+	if (__atomic_load_n(&RING(qid, 0, head), __ATOMIC_ACQUIRE) == RING(qid, 0, tail)) {
+		struct timespec ts = {
+			.tv_sec = RX_SLEEP_TIMEOUT_US / 1000000,
+			.tv_nsec = (RX_SLEEP_TIMEOUT_US % 1000000) * 1000,
+		};
+		syscall(SYS_futex, ev, FUTEX_WAIT, RVIF_EVENT_WAIT, &ts, NULL, 0);
+	}
+	__atomic_store_n(ev, RVIF_EVENT_NONE, __ATOMIC_RELAXED);
+}
+
+static unsigned long elapsed_us(struct timespec *from)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - from->tv_sec) * 1000000L + (ts.tv_nsec - from->tv_nsec) / 1000;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned long wall_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned int lat_bucket(unsigned long v)
+{
+	if (v < 2 * LAT_SUB)
+		return v;
+	else {
+		unsigned int shift = 63 - __builtin_clzl(v) - LAT_SUB_BITS;
+		return (shift + 1) * LAT_SUB + ((v >> shift) & (LAT_SUB - 1));
+	}
+}
+
+/* the largest value of the bucket */
+static unsigned long lat_value(unsigned int b)
+{
+	if (b < 2 * LAT_SUB)
+		return b;
+	else {
+		unsigned int shift = b / LAT_SUB - 1;
+		return ((unsigned long)(LAT_SUB + b % LAT_SUB + 1) << shift) - 1;
+	}
+}
+
+static void lat_record(struct lat_stat *ls, unsigned char id, const struct pkt_stamp *st, unsigned long now)
+{
+	unsigned int seq = PKT_STAMP_SEQ(st->seq), *next = &ls->next[PKT_STAMP_STREAM(st->seq) % RVIF_MAX_QUEUE][PKT_STAMP_FLOW(st->seq) % LAT_FLOW_MAX];
+	if (!st->ts)
+		return;
+	{
+		unsigned long v = (now > st->ts ? now - st->ts : 0);
+		ls->hist[id][lat_bucket(v)]++;
+		if (ls->max[id] < v)
+			ls->max[id] = v;
+	}
+	if (seq - *next < (1U << 31)) { /* the 32-bit sequence number wraps around */
+		ls->lost[id] += seq - *next;
+		*next = seq + 1;
+	} else {
+		/* counted as lost when the later one arrived */
+		ls->reordered[id]++;
+		if (ls->lost[id])
+			ls->lost[id]--;
+	}
+}
+
+static void lat_report(unsigned int num_thread, unsigned char id)
+{
+	static unsigned long hist[LAT_BUCKETS];
+	unsigned long cnt = 0, max = 0, lost = 0, reordered = 0;
+	{
+		unsigned int i, b;
+		memset(hist, 0, sizeof(hist));
+		for (i = 0; i < num_thread; i++) {
+			for (b = 0; b < LAT_BUCKETS; b++) {
+				hist[b] += lat_stat[i].hist[id][b];
+				cnt += lat_stat[i].hist[id][b];
+			}
+			if (max < lat_stat[i].max[id])
+				max = lat_stat[i].max[id];
+			lost += lat_stat[i].lost[id];
+			reordered += lat_stat[i].reordered[id];
+			memset(lat_stat[i].hist[id], 0, sizeof(lat_stat[i].hist[id]));
+			lat_stat[i].max[id] = lat_stat[i].lost[id] = lat_stat[i].reordered[id] = 0;
+		}
+	}
+	{
+		const unsigned long q[3][2] = { { 50, 100 }, { 99, 100 }, { 999, 1000 } };
+		unsigned long p[3] = { 0 };
+		if (cnt) {
+			unsigned int b, k = 0;
+			unsigned long sum = 0;
+			for (b = 0; b < LAT_BUCKETS && k < 3; b++) {
+				sum += hist[b];
+				while (k < 3 && sum * q[k][1] >= cnt * q[k][0])
+					p[k++] = (lat_value(b) < max ? lat_value(b) : max);
+			}
+		}
+		printf("   latency (us) p50 %lu.%03lu p99 %lu.%03lu p99.9 %lu.%03lu max %lu.%03lu, lost %lu reordered %lu\n",
+				p[0] / 1000, p[0] % 1000, p[1] / 1000, p[1] % 1000, p[2] / 1000, p[2] % 1000,
+				max / 1000, max % 1000, lost, reordered);
+	}
+}
+
 static void *pktgen_fn(void *data)
 {
 	unsigned long qid = (unsigned long) data;
+	unsigned long rate_cnt = 0; /* the packets sent or received, for the rate */
+	struct rvif_ring rg; /* the RX ring in the rx mode, otherwise, the TX ring */
+	unsigned int seq[LAT_FLOW_MAX] = { 0 }; /* the sequence numbers of the flows in the latency mode */
+	int mid = 0; /* the rx thread is in the middle of a multi-slot frame */
+	unsigned int flow_idx = 0, size_idx = 0; /* the flow and the size of the next packet */
+	unsigned long rep_idx = qid, rep_loop_cnt = 0, rep_start = now_ns(), rep_now = 0; /* the replay mode */
+	struct timespec start, idle_since = { 0 }; /* idle_since.tv_sec == 0 means the thread is not idle */
+	if (num_core) {
+		cpu_set_t cs;
+		CPU_ZERO(&cs);
+		CPU_SET(core[qid % num_core], &cs);
+		assert(!pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	{ /* xmit a packet for learning bridge */
-		volatile unsigned short h, t;
-		h = vif->queue[qid].ring[1].head;
-		asm volatile ("" ::: "memory");
-		t = vif->queue[qid].ring[1].tail;
-		assert((t + 1 == vif->queue[qid].ring[1].num ? 0 : t + 1) != h);
-		if (++t == vif->queue[qid].ring[1].num) t = 0;
-		asm volatile ("" ::: "memory");
-		vif->queue[qid].ring[1].tail = t;
+		struct rvif_ring tx;
+		unsigned short t;
+		rvif_ring_init(&tx, vif, vif_ver, qid, 1);
+		assert(rvif_ring_reserve(&tx, 1));
+		t = rvif_ring_slot(&tx, 0);
+		if ((unsigned int) pkt_len > buf_size) /* the head part is enough for learning */
+			SLOT(qid, 1, t, len) = buf_size;
+		if (vif_ver == RVIF_VERSION_3)
+			SLOT_FLAGS(qid, 1, t) = 0;
+		rvif_ring_commit(&tx, 1);
+		ring_kick(&RING(qid, 1, event));
 	}
+	rvif_ring_init(&rg, vif, vif_ver, qid, (mode_rx ? 0 : 1));
 	while (1) {
-		unsigned long pkt_cnt = 0, pkt_byte = 0;
+		unsigned long pkt_cnt = 0, pkt_byte = 0, quota = ~0UL;
+		if (rate) {
+			quota = elapsed_us(&start) * rate / 1000000UL - rate_cnt;
+			if (!quota) {
+				/* wait for the interval of a packet */
+				struct timespec ts = {
+					.tv_sec = 1 / rate,
+					.tv_nsec = (1000000000UL / rate) % 1000000000UL,
+				};
+				nanosleep(&ts, NULL);
+			}
+		}
 		if (mode_rx) {
-			volatile unsigned short h, t;
-			h = vif->queue[qid].ring[0].head;
-			asm volatile ("" ::: "memory");
-			t = vif->queue[qid].ring[0].tail;
-			while (t != h) {
-				pkt_byte += vif->queue[qid].ring[0].slot[t].len;
-				pkt_cnt++;
-				if (++t == vif->queue[qid].ring[0].num) t = 0;
+			unsigned short t = rg.tail, a = rvif_ring_peek(&rg, 1), i = 0;
+			if ((latency || cap_file) && a) {
+				/* timestamps for the batch */
+				unsigned long now = (latency ? now_ns() : 0), wall = (cap_file ? wall_ns() : 0);
+				unsigned char id = global_counter_id;
+				while (i < a && pkt_cnt < quota) {
+					const char *b = (const char *)((unsigned long) vif + SLOT(qid, 0, t, off));
+					if (!mid) {
+						if (latency)
+							lat_record(&lat_stat[qid], id, (const struct pkt_stamp *)(b + PKT_STAMP_OFF), now);
+						if (cap_file)
+							cap_begin(&cap_buf[qid], wall);
+					}
+					if (cap_file)
+						cap_append(&cap_buf[qid], b, SLOT(qid, 0, t, len));
+					pkt_byte += SLOT(qid, 0, t, len);
+					mid = RVIF_SLOT_MORE(vif, vif_ver, qid, 0, t);
+					if (!mid)
+						pkt_cnt++;
+					t = rvif_ring_next(&rg, t, 1);
+					i++;
+				}
+			}
+			while (i < a && pkt_cnt < quota) {
+				pkt_byte += SLOT(qid, 0, t, len);
+				if (!RVIF_SLOT_MORE(vif, vif_ver, qid, 0, t))
+					pkt_cnt++;
+				t = rvif_ring_next(&rg, t, 1);
+				i++;
+			}
+			if (i)
+				rvif_ring_release(&rg, i);
+			rate_cnt += pkt_cnt;
+			if (cap_file && !pkt_cnt && !mid && cap_buf[qid].len[cap_buf[qid].cur])
+				cap_pass(&cap_buf[qid]); /* the writer has the frames while we are idle */
+			if (pkt_cnt)
+				idle_since.tv_sec = 0;
+			else if (idle_us) {
+				/* busy-poll for idle_us after the last packet, then sleep until rvs wakes us up */
+				if (!idle_since.tv_sec)
+					clock_gettime(CLOCK_MONOTONIC, &idle_since);
+				else if (elapsed_us(&idle_since) >= idle_us) {
+					/* we stay idle unless we find packets after waking up, then sleep again without polling for idle_us */
+					rx_sleep(qid);
+				}
 			}
-			asm volatile ("" ::: "memory");
-			vif->queue[qid].ring[0].tail = t;
 		} else {
-			volatile unsigned short h, t;
-			h = vif->queue[qid].ring[1].head;
-			asm volatile ("" ::: "memory");
-			t = vif->queue[qid].ring[1].tail;
-			while ((t + 1 == vif->queue[qid].ring[1].num ? 0 : t + 1) != h) {
-				vif->queue[qid].ring[1].slot[t].len = pkt_len;
-				pkt_byte += vif->queue[qid].ring[1].slot[t].len;
+			unsigned short k = 0; /* the slots written in this round, which are committed at once */
+			unsigned long now = 0;
+			if (replay && rep_timing)
+				rep_now = now_ns() - rep_start;
+			while (pkt_cnt < quota) {
+				const struct pkt_size *ps = &pkt_size[size_seq[size_idx]];
+				const char *src = NULL; /* the frame replayed */
+				unsigned short len = ps->len, nseg;
+				unsigned int f; /* the flow of the packet for the sequence number */
+				char *b;
+				if (replay) {
+					if (rep_idx >= rep_cnt) {
+						/* the end of a loop */
+						if (rep_loop && rep_loop_cnt + 1 >= rep_loop) {
+							rep_loop_cnt = rep_loop;
+							break;
+						}
+						rep_loop_cnt++;
+						rep_idx = qid;
+						rep_start = now_ns();
+						rep_now = 0;
+						continue;
+					}
+					if (rep_timing && rep_now < rep_pkt[rep_idx].ts)
+						break; /* not yet */
+					src = rep_map + rep_pkt[rep_idx].off;
+					len = rep_pkt[rep_idx].len;
+				}
+				nseg = (len + buf_size - 1) / buf_size; /* slots per frame */
+				if (rvif_ring_reserve(&rg, k + nseg) < k + nseg)
+					break;
+				b = rvif_ring_buf(&rg, rvif_ring_slot(&rg, k));
+				if (nseg == 1) {
+					unsigned short t = rvif_ring_slot(&rg, k++);
+					if (src)
+						memcpy(b, src, len);
+					else if (pool_pkt) /* rvs may have swapped the buffer of this slot */
+						memcpy(b, pool_pkt[qid], len);
+					SLOT(qid, 1, t, len) = len;
+					if (vif_ver == RVIF_VERSION_3)
+						SLOT_FLAGS(qid, 1, t) = 0;
+				} else {
+					/* the slot offset of a fragment varies, thus, we always copy it */
+					unsigned short i;
+					for (i = 0; i < nseg; i++) {
+						unsigned short t = rvif_ring_slot(&rg, k++);
+						unsigned short l = (i + 1 == nseg ? len - i * buf_size : buf_size);
+						memcpy(rvif_ring_buf(&rg, t), (src ? src : pkt_tmpl[qid]) + i * buf_size, l);
+						SLOT(qid, 1, t, len) = l;
+						SLOT_FLAGS(qid, 1, t) = (i + 1 == nseg ? 0 : RVIF_SLOT_F_MORE);
+					}
+				}
+				f = flow_idx % LAT_FLOW_MAX;
+				if (src)
+					rep_idx += vif->num;
+				else if (num_flow_src * num_flow_dst > 1 || size_seq_len > 1 || rewrite) {
+					/* the headers are in the first slot */
+					pkt_hdr(b, ps, &flow_src[flow_idx % num_flow_src], &flow_dst[flow_idx / num_flow_src]);
+					if (++flow_idx == num_flow_src * num_flow_dst)
+						flow_idx = 0;
+					if (++size_idx == size_seq_len)
+						size_idx = 0;
+				}
+				if (latency) {
+					struct pkt_stamp *st = (struct pkt_stamp *)(b + PKT_STAMP_OFF);
+					if (!now)
+						now = now_ns(); /* a timestamp for the batch */
+					st->seq = PKT_STAMP(qid, f, seq[f]++);
+					st->ts = now;
+				}
+				pkt_byte += len;
 				pkt_cnt++;
-				if (++t == vif->queue[qid].ring[1].num) t = 0;
 			}
-			asm volatile ("" ::: "memory");
-			vif->queue[qid].ring[1].tail = t;
+			if (k)
+				rvif_ring_commit(&rg, k);
+			if (pkt_cnt) {
+				rate_cnt += pkt_cnt;
+				ring_kick(&RING(qid, 1, event));
+			} else if (replay && rep_loop && rep_loop_cnt >= rep_loop) {
+				rep_done++;
+				break;
+			}
 		}
 		{
 			volatile unsigned char counter_id = global_counter_id;
@@ -155,13 +832,17 @@ static void *pktgen_fn(void *data)
 
 int main(int argc, char *const *argv)
 {
-	unsigned long mem_size = 0;
+	struct rvif_mem vif_mem;
+	struct rvif_layout layout;
+	const char *vif_path = NULL;
+	unsigned short pool_idx = 0, pool_cnt = 0;
 	unsigned int num_thread = 1;
 	unsigned short num_slot = 1024;
 
 	char mac_src[6] = { 0 }, mac_dst[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, };
 	short udp_src_port = 12345, udp_dst_port = 23456;
 	int src_ip4, dst_ip4;
+	const char *rep_path = NULL, *cap_path = NULL;
 
 	{
 		inet_pton(AF_INET, "192.168.123.2", &src_ip4);
@@ -170,8 +851,38 @@ int main(int argc, char *const *argv)
 
 	{
 		int ch;
-		while ((ch = getopt(argc, argv, "d:D:f:l:m:s:S:t:")) != -1) {
+		while ((ch = getopt(argc, argv, "B:c:C:d:D:f:gi:l:Lm:n:p:P:r:s:S:t:Tv:w:")) != -1) {
 			switch (ch) {
+			case 'B':
+				assert(sscanf(optarg, "%u", &buf_size) == 1);
+				assert(buf_size && !(buf_size % 64) && buf_size <= 0xffff);
+				break;
+			case 'c':
+				assert(sscanf(optarg, "%lu", &rep_loop) == 1);
+				break;
+			case 'C':
+				{
+					char *c;
+					for (c = strtok(optarg, ","); c; c = strtok(NULL, ",")) {
+						int from, to;
+						switch (sscanf(c, "%d-%d", &from, &to)) {
+						case 1:
+							to = from;
+							break;
+						case 2:
+							break;
+						default:
+							assert(0);
+							break;
+						}
+						assert(0 <= from && from <= to);
+						for (; from <= to; from++) {
+							assert(num_core < sizeof(core) / sizeof(core[0]));
+							core[num_core++] = from;
+						}
+					}
+				}
+				break;
 			case 'd':
 				inet_pton(AF_INET, optarg, &dst_ip4);
 				break;
@@ -187,25 +898,39 @@ int main(int argc, char *const *argv)
 			case 'f':
 				if (strlen(optarg) == 2 && !strncmp("tx", optarg, 2))
 					mode_rx = 0;
+				else if (!strcmp("replay", optarg))
+					mode_rx = 0, replay = 1;
+				break;
+			case 'g':
+				rewrite = 1;
+				break;
+			case 'i':
+				assert(sscanf(optarg, "%lu", &idle_us) == 1);
 				break;
 			case 'l':
-				assert(sscanf(optarg, "%hu", &pkt_len) == 1);
+				pkt_len = 0;
+				size_parse(optarg);
+				break;
+			case 'L':
+				latency = 1;
 				break;
 			case 'm':
-				{
-					{
-						struct stat st;
-						assert(!stat(optarg, &st));
-						mem_size = st.st_size;
-					}
-					{
-						int fd;
-						assert((fd = open(optarg, O_RDWR)) != -1);
-						assert((void *)(vif = (struct rvif *) mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED);
-						printf("%s is mapped at %p (%lu bytes)\n", optarg, vif, mem_size);
-
-					}
-				}
+				vif_path = optarg;
+				break;
+			case 'n':
+				if (sscanf(optarg, "%u:%u", &num_flow_src, &num_flow_dst) != 2)
+					assert(sscanf(optarg, "%u", &num_flow_src) == 1);
+				assert(num_flow_src && num_flow_dst && num_flow_src <= 0x10000 && num_flow_dst <= 0x10000);
+				break;
+			case 'p':
+				assert(sscanf(optarg, "%hu:%hu", &pool_idx, &pool_cnt) == 2);
+				assert(pool_idx < pool_cnt);
+				break;
+			case 'P':
+				rep_path = optarg;
+				break;
+			case 'r':
+				assert(sscanf(optarg, "%lu", &rate) == 1);
 				break;
 			case 's':
 				inet_pton(AF_INET, optarg, &src_ip4);
@@ -222,20 +947,99 @@ int main(int argc, char *const *argv)
 			case 't':
 				assert(sscanf(optarg, "%u", &num_thread) == 1);
 				break;
+			case 'T':
+				rep_timing = 1;
+				break;
+			case 'v':
+				assert(sscanf(optarg, "%u", &vif_ver) == 1);
+				assert(vif_ver == RVIF_VERSION_1 || vif_ver == RVIF_VERSION_2 || vif_ver == RVIF_VERSION_3);
+				break;
+			case 'w':
+				cap_path = optarg;
+				break;
 			}
 		}
 	}
 
-	assert(vif);
-
-	vif->num = num_thread;
+	assert(vif_path);
 
+	/* only version 3 has a configurable buffer size */
+	if (vif_ver != RVIF_VERSION_3)
+		buf_size = 2048;
+	assert(0 < pkt_len && pkt_len <= PKT_LEN_MAX);
 	{
-		unsigned long mem_used = ((((sizeof(struct rvif) + sizeof(vif->queue[0]) * vif->num) / 0x1000) + 1) * 0x1000) + num_thread * 2 * num_slot * 2048;
-		printf("rvif uses %lu bytes\n", mem_used);
-		assert(mem_used < mem_size);
+		unsigned int i;
+		for (i = 0; i < num_size; i++) {
+			assert(vif_ver == RVIF_VERSION_3 || pkt_size[i].len <= buf_size);
+			assert(!latency || PKT_STAMP_OFF + sizeof(struct pkt_stamp) <= pkt_size[i].len);
+		}
 	}
 
+	if (latency) {
+		unsigned int i;
+		assert((lat_stat = calloc(num_thread, sizeof(lat_stat[0]))) != NULL);
+		for (i = 0; mode_rx && i < num_thread; i++)
+			assert((lat_stat[i].next = calloc(RVIF_MAX_QUEUE, sizeof(lat_stat[i].next[0]))) != NULL);
+	}
+
+	if (replay) {
+		/* the stamps of the latency mode would overwrite the frames */
+		assert(rep_path && !latency);
+		rep_open(rep_path);
+		assert(num_thread <= rep_cnt);
+	}
+
+	if (cap_path) {
+		assert(mode_rx);
+		cap_open(cap_path, num_thread);
+	}
+
+	layout.ver = vif_ver;
+	layout.num_queue = num_thread;
+	layout.num_slot = num_slot;
+	layout.buf_size = buf_size;
+	if (pool_cnt) {
+		/* the pool file exists, and the buffer area following the rvifs is split equally among the rvifs in the pool */
+		unsigned long share;
+		assert(!rvif_mem_open(&vif_mem, vif_path, 0, RVIF_MEM_PREFAULT));
+		printf("%s is mapped at %p (%lu bytes)\n", vif_path, vif_mem.mem, vif_mem.size);
+		assert(RVIF_POOL_VIF_SIZE * pool_cnt < vif_mem.size);
+		share = (((vif_mem.size - RVIF_POOL_VIF_SIZE * pool_cnt) / pool_cnt) / buf_size) * buf_size;
+		vif = (struct rvif *)((unsigned long) vif_mem.mem + RVIF_POOL_VIF_SIZE * pool_idx);
+		layout.buf_off = RVIF_POOL_VIF_SIZE * (pool_cnt - pool_idx) + share * pool_idx;
+		layout.queue_size = 2UL * num_slot * buf_size;
+		layout.size = layout.buf_off + layout.queue_size * num_thread;
+		assert(layout.size <= layout.buf_off + share);
+		printf("rvif[%u] of the pool is at %p\n", pool_idx, vif);
+	} else {
+		/* with -C, the buffers of each queue start at a page boundary to have their own NUMA node */
+		rvif_layout(&layout, num_core ? rvif_mem_page_size(vif_path) : 0);
+		assert(!rvif_mem_open(&vif_mem, vif_path, layout.size, RVIF_MEM_CREATE));
+		vif = (struct rvif *) vif_mem.mem;
+		printf("%s is mapped at %p (%lu bytes, %lu-byte pages)\n", vif_path, vif, vif_mem.size, vif_mem.page_size);
+		if (num_core) {
+			unsigned int i;
+			for (i = 0; i < num_thread; i++) {
+				int node = rvif_cpu_node(core[i % num_core]);
+				if (node >= 0 && !rvif_mem_bind(&vif_mem, layout.buf_off + layout.queue_size * i, layout.queue_size, node))
+					printf("queue[%u]: core %d, node %d\n", i, core[i % num_core], node);
+			}
+		}
+		/* after the binding, the pages are allocated on the nodes */
+		rvif_mem_prefault(&vif_mem, 0, layout.size);
+	}
+	printf("rvif uses %lu bytes\n", layout.size);
+
+	if (rate) {
+		/* the rate is given for the rvif, and shared by the threads */
+		rate /= num_thread;
+		assert(rate);
+	}
+
+	if (pool_cnt)
+		assert((pool_pkt = calloc(num_thread, sizeof(pool_pkt[0]))) != NULL);
+	assert((pkt_tmpl = calloc(num_thread, sizeof(pkt_tmpl[0]))) != NULL);
+
 
 	{
 		char s[2][4 * 4];
@@ -248,33 +1052,19 @@ int main(int argc, char *const *argv)
 				mac_dst[3], mac_dst[4], mac_dst[5], s[1]);
 	}
 
-	{
-		unsigned short i;
-		for (i = 0; i < vif->num; i++) {
-			vif->queue[i].ring[0].num = vif->queue[i].ring[1].num = num_slot;
-			vif->queue[i].ring[0].head = vif->queue[i].ring[1].head = 0;
-			vif->queue[i].ring[0].tail = vif->queue[i].ring[1].tail = 0;
-		}
-	}
+	/* rvs regards an rvif whose num is zero as not initialized yet, thus, we set num at last */
+	rvif_format(vif, &layout);
+	if (vif_ver == RVIF_VERSION_3)
+		printf("rvif version %u (%u-byte buffers)\n", vif_ver, buf_size);
+	else
+		printf("rvif version %u\n", vif_ver);
 
 	{
-		unsigned long off = (((sizeof(struct rvif) + sizeof(vif->queue[0]) * vif->num) / 0x1000) + 1) * 0x1000;
 		{
 			unsigned int i;
-			for (i = 0; i < vif->num; i++) {
+			for (i = 0; i < num_thread; i++) {
 				{
-					unsigned char j;
-					for (j = 0; j < 2; j++) {
-						unsigned short k;
-						for (k = 0; k < vif->queue[i].ring[j].num; k++) {
-							vif->queue[i].ring[j].slot[k].off = off;
-							vif->queue[i].ring[j].slot[k].len = 0;
-							off += 2048;
-						}
-					}
-				}
-				{
-					char pkt[2048];
+					char pkt[PKT_LEN_MAX];
 					memset(pkt, 'A', sizeof(pkt));
 					{
 						struct udpkt p = {
@@ -343,11 +1133,19 @@ int main(int argc, char *const *argv)
 						}
 						memcpy(pkt, &p, sizeof(p));
 					}
+					if (latency) {
+						/* the stamp changes the payload, thus, we leave the optional UDP checksum empty */
+						((struct udpkt *) pkt)->udp.csum_be = 0;
+						memset(&pkt[PKT_STAMP_OFF], 0, sizeof(struct pkt_stamp));
+					}
+					if (pool_pkt)
+						memcpy(pool_pkt[i], pkt, sizeof(pkt));
+					memcpy(pkt_tmpl[i], pkt, sizeof(pkt));
 					{
 						unsigned short j;
-						for (j = 0; j < vif->queue[i].ring[1].num; j++) {
-							memcpy((char *)((unsigned long) vif + vif->queue[i].ring[1].slot[j].off), pkt, pkt_len);
-							vif->queue[i].ring[1].slot[j].len = pkt_len;
+						for (j = 0; j < RING(i, 1, num); j++) {
+							memcpy((char *)((unsigned long) vif + SLOT(i, 1, j, off)), pkt, ((unsigned int) pkt_len < buf_size ? (unsigned int) pkt_len : buf_size));
+							SLOT(i, 1, j, len) = pkt_len;
 						}
 					}
 				}
@@ -355,6 +1153,21 @@ int main(int argc, char *const *argv)
 		}
 	}
 
+	{ /* the packet template is the same for all threads */
+		unsigned int i;
+		for (i = 0; i < num_size; i++)
+			pkt_size_init(&pkt_size[i], pkt_tmpl[0]);
+		size_seq_build();
+		assert((flow_src = calloc(num_flow_src, sizeof(flow_src[0]))) != NULL);
+		assert((flow_dst = calloc(num_flow_dst, sizeof(flow_dst[0]))) != NULL);
+		for (i = 0; i < num_flow_src; i++)
+			flow_ep_init(&flow_src[i], mac_src, src_ip4, udp_src_port, i);
+		for (i = 0; i < num_flow_dst; i++)
+			flow_ep_init(&flow_dst[i], mac_dst, dst_ip4, udp_dst_port, i);
+	}
+
+	__atomic_store_n(&vif->num, num_thread, __ATOMIC_RELEASE);
+
 	if (mode_rx)
 		printf("-- RX --\n");
 	else
@@ -368,6 +1181,10 @@ int main(int argc, char *const *argv)
 			for (i = 0; i < vif->num; i++)
 				assert(!pthread_create(&th[i], NULL, pktgen_fn, (void *)((unsigned long) i)));
 		}
+		if (cap_file) {
+			pthread_t wth;
+			assert(!pthread_create(&wth, NULL, cap_writer_fn, (void *)((unsigned long) vif->num)));
+		}
 		while (1) {
 			sleep(1);
 			global_counter_id = (global_counter_id ? 0 : 1);
@@ -375,6 +1192,20 @@ int main(int argc, char *const *argv)
 					global_pkt_cnt[(global_counter_id ? 0 : 1)] / 1000000UL, (global_pkt_cnt[(global_counter_id ? 0 : 1)] % 1000000UL) / 1000UL,
 					(8 * global_pkt_byte[(global_counter_id ? 0 : 1)]) / 1000000000UL, ((8 * global_pkt_byte[(global_counter_id ? 0 : 1)]) % 1000000000UL / 1000000UL));
 			global_pkt_cnt[(global_counter_id ? 0 : 1)] = global_pkt_byte[(global_counter_id ? 0 : 1)] = 0;
+			if (latency && mode_rx)
+				lat_report(vif->num, (global_counter_id ? 0 : 1));
+			if (cap_file) {
+				unsigned long drop = 0;
+				unsigned int i;
+				for (i = 0; i < vif->num; i++)
+					drop += cap_buf[i].drop;
+				if (drop)
+					printf("   %lu frames are not captured in total, as the writer is behind\n", drop);
+			}
+			if (replay && rep_done == vif->num) {
+				printf("replay done\n");
+				break;
+			}
 		}
 		{
 			unsigned int i;
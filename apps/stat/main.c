@@ -0,0 +1,199 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static struct rvs_stat_hdr *hdr = NULL;
+static const char *wstat = NULL; /* counters of the workers, each of RVS_STAT_SIZE(max_port, max_queue) bytes */
+
+/* sum of the counters of all the workers */
+static void stat_sum(struct rvs_stat *sum, unsigned short num_port)
+{
+	unsigned long size = RVS_STAT_SIZE(hdr->max_port, hdr->max_queue);
+	unsigned int i;
+	memset(sum, 0, size);
+	for (i = 0; i < hdr->num; i++) {
+		struct rvs_stat *w = (struct rvs_stat *)(wstat + size * i);
+		unsigned short j;
+		for (j = 0; j < num_port; j++) {
+			unsigned short k;
+			sum[j].flood += __atomic_load_n(&w[j].flood, __ATOMIC_RELAXED);
+			sum[j].unknown += __atomic_load_n(&w[j].unknown, __ATOMIC_RELAXED);
+			sum[j].learn += __atomic_load_n(&w[j].learn, __ATOMIC_RELAXED);
+			sum[j].move += __atomic_load_n(&w[j].move, __ATOMIC_RELAXED);
+			for (k = 0; k < hdr->max_queue; k++) {
+				struct rvs_stat_queue *s = RVS_STAT_QUEUE(sum, hdr->max_port, hdr->max_queue, j, k);
+				struct rvs_stat_queue *q = RVS_STAT_QUEUE(w, hdr->max_port, hdr->max_queue, j, k);
+				s->rx_pkt += __atomic_load_n(&q->rx_pkt, __ATOMIC_RELAXED);
+				s->rx_byte += __atomic_load_n(&q->rx_byte, __ATOMIC_RELAXED);
+				s->tx_pkt += __atomic_load_n(&q->tx_pkt, __ATOMIC_RELAXED);
+				s->tx_byte += __atomic_load_n(&q->tx_byte, __ATOMIC_RELAXED);
+				s->drop += __atomic_load_n(&q->drop, __ATOMIC_RELAXED);
+				s->hold += __atomic_load_n(&q->hold, __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+static void print_rate(const char *name, unsigned long rx_pkt, unsigned long rx_byte,
+		unsigned long tx_pkt, unsigned long tx_byte, unsigned long drop, unsigned int interval)
+{
+	printf("%-10s rx %4lu.%06lu Mpps %6lu.%03lu Mbps  tx %4lu.%06lu Mpps %6lu.%03lu Mbps  drop %lu",
+			name,
+			rx_pkt / interval / 1000000UL, rx_pkt / interval % 1000000UL,
+			rx_byte * 8 / interval / 1000000UL, (rx_byte * 8 / interval % 1000000UL) / 1000UL,
+			tx_pkt / interval / 1000000UL, tx_pkt / interval % 1000000UL,
+			tx_byte * 8 / interval / 1000000UL, (tx_byte * 8 / interval % 1000000UL) / 1000UL,
+			drop / interval);
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned int interval = 1, per_queue = 0, once = 0;
+	const char *path = NULL;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "1i:qs:")) != -1) {
+			switch (ch) {
+				case '1':
+					once = 1;
+					break;
+				case 'i':
+					assert(sscanf(optarg, "%u", &interval) == 1);
+					assert(interval);
+					break;
+				case 'q':
+					per_queue = 1;
+					break;
+				case 's':
+					path = optarg;
+					break;
+				default:
+					assert(0);
+					break;
+			}
+		}
+	}
+
+	assert(path);
+
+	{
+		struct stat st;
+		assert(!stat(path, &st));
+		assert(sizeof(struct rvs_stat_hdr) <= (unsigned long) st.st_size);
+		{
+			int fd;
+			assert((fd = open(path, O_RDONLY)) != -1);
+			{
+				void *mem;
+				assert((mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED);
+				hdr = (struct rvs_stat_hdr *) mem;
+				assert(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == RVS_STAT_MAGIC);
+				assert(hdr->max_port <= RVS_MAX_PORT && hdr->max_queue <= RVIF_MAX_QUEUE);
+				assert(sizeof(struct rvs_stat_hdr) + RVS_STAT_SIZE(hdr->max_port, hdr->max_queue) * hdr->num <= (unsigned long) st.st_size);
+				assert(hdr->num_port <= hdr->max_port);
+				wstat = (const char *) mem + sizeof(struct rvs_stat_hdr);
+			}
+			close(fd);
+		}
+	}
+
+	printf("%s: %u worker(s), %u port(s)\n", path, hdr->num, hdr->num_port);
+
+	{
+		struct rvs_stat *prev, *cur;
+		assert((prev = malloc(RVS_STAT_SIZE(hdr->max_port, hdr->max_queue))) != NULL);
+		assert((cur = malloc(RVS_STAT_SIZE(hdr->max_port, hdr->max_queue))) != NULL);
+		stat_sum(prev, hdr->num_port);
+		while (1) {
+			sleep(interval);
+			stat_sum(cur, hdr->num_port);
+			{
+				unsigned short i;
+				for (i = 0; i < hdr->num_port; i++) {
+					unsigned long rx_pkt = 0, rx_byte = 0, tx_pkt = 0, tx_byte = 0, drop = 0, hold = 0;
+					{
+						unsigned short j;
+						for (j = 0; j < hdr->max_queue; j++) {
+							struct rvs_stat_queue *c = RVS_STAT_QUEUE(cur, hdr->max_port, hdr->max_queue, i, j);
+							struct rvs_stat_queue *p = RVS_STAT_QUEUE(prev, hdr->max_port, hdr->max_queue, i, j);
+							rx_pkt += c->rx_pkt - p->rx_pkt;
+							rx_byte += c->rx_byte - p->rx_byte;
+							tx_pkt += c->tx_pkt - p->tx_pkt;
+							tx_byte += c->tx_byte - p->tx_byte;
+							drop += c->drop - p->drop;
+							hold += c->hold - p->hold;
+						}
+					}
+					if (!rx_pkt && !tx_pkt && !drop && !hold)
+						continue;
+					{
+						char name[16];
+						snprintf(name, sizeof(name), "port[%u]", i);
+						print_rate(name, rx_pkt, rx_byte, tx_pkt, tx_byte, drop, interval);
+					}
+					printf("  flood %lu unknown %lu learn %lu move %lu hold %lu\n",
+							(cur[i].flood - prev[i].flood) / interval,
+							(cur[i].unknown - prev[i].unknown) / interval,
+							cur[i].learn - prev[i].learn,
+							cur[i].move - prev[i].move,
+							hold / interval);
+					if (per_queue) {
+						unsigned short j;
+						for (j = 0; j < hdr->max_queue; j++) {
+							struct rvs_stat_queue *c = RVS_STAT_QUEUE(cur, hdr->max_port, hdr->max_queue, i, j);
+							struct rvs_stat_queue *p = RVS_STAT_QUEUE(prev, hdr->max_port, hdr->max_queue, i, j);
+							if (c->rx_pkt - p->rx_pkt || c->tx_pkt - p->tx_pkt || c->drop - p->drop) {
+								char name[16];
+								snprintf(name, sizeof(name), " queue[%u]", j);
+								print_rate(name, c->rx_pkt - p->rx_pkt, c->rx_byte - p->rx_byte,
+										c->tx_pkt - p->tx_pkt, c->tx_byte - p->tx_byte,
+										c->drop - p->drop, interval);
+								printf("\n");
+							}
+						}
+					}
+				}
+			}
+			printf("--\n");
+			fflush(stdout);
+			if (once)
+				break;
+			{
+				struct rvs_stat *tmp = prev;
+				prev = cur;
+				cur = tmp;
+			}
+		}
+		free(cur);
+		free(prev);
+	}
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <x86intrin.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+static const char *copy_name[RVS_COPY_NUM] = {
+	[RVS_COPY_SCALAR] = "scalar",
+	[RVS_COPY_SSE2] = "sse2",
+	[RVS_COPY_AVX2] = "avx2",
+	[RVS_COPY_AVX512] = "avx512",
+};
+
+int main(int argc, char *const *argv)
+{
+	unsigned long num_buf = 4096, num_iter = 64, batch = 32;
+	unsigned short len[] = { 64, 128, 256, 512, 1024, 1500, 2048, };
+	char *src, *dst;
+	struct rvs *vs;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "b:i:n:")) != -1) {
+			switch (ch) {
+			case 'b':
+				assert(sscanf(optarg, "%lu", &batch) == 1);
+				break;
+			case 'i':
+				assert(sscanf(optarg, "%lu", &num_iter) == 1);
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num_buf) == 1);
+				break;
+			}
+		}
+	}
+
+	assert((vs = malloc(rvs_size(1, 1))) != NULL);
+	assert(!rvs_init(vs, 1, 1));
+
+	assert((src = mmap(NULL, num_buf * RVS_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	assert((dst = mmap(NULL, num_buf * RVS_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	memset(src, 'A', num_buf * RVS_BUF_SIZE);
+	memset(dst, 'B', num_buf * RVS_BUF_SIZE);
+
+	printf("# %lu buffers (%lu KB per side), %lu iterations, sync every %lu copies\n", num_buf, num_buf * RVS_BUF_SIZE / 1024, num_iter, batch);
+	printf("copy,nt,len,cycles_per_pkt,bytes_per_cycle\n");
+	{
+		unsigned short kind;
+		for (kind = 0; kind < RVS_COPY_NUM; kind++) {
+			if (rvs_copy_select(vs, kind))
+				continue;
+			{
+				int nt;
+				for (nt = 0; nt < 2; nt++) {
+					unsigned long i;
+					for (i = 0; i < sizeof(len) / sizeof(len[0]); i++) {
+						unsigned long j, k, t;
+						for (k = 0; k < num_buf; k++) /* warm up */
+							rvs_copy(vs, &dst[k * RVS_BUF_SIZE], &src[k * RVS_BUF_SIZE], len[i], nt);
+						rvs_copy_sync(vs);
+						t = __rdtsc();
+						for (j = 0; j < num_iter; j++) {
+							for (k = 0; k < num_buf; k++) {
+								rvs_copy(vs, &dst[k * RVS_BUF_SIZE], &src[k * RVS_BUF_SIZE], len[i], nt);
+								if (nt && (k + 1) % batch == 0)
+									rvs_copy_sync(vs);
+							}
+						}
+						t = __rdtsc() - t;
+						assert(!memcmp(&dst[(num_buf - 1) * RVS_BUF_SIZE], &src[(num_buf - 1) * RVS_BUF_SIZE], len[i]));
+						printf("%s,%d,%u,%.1f,%.2f\n", copy_name[kind], nt, len[i],
+								(double) t / (num_iter * num_buf),
+								(double) len[i] * num_iter * num_buf / t);
+					}
+				}
+			}
+		}
+	}
+
+	munmap(src, num_buf * RVS_BUF_SIZE);
+	munmap(dst, num_buf * RVS_BUF_SIZE);
+
+	assert(!rvs_exit(vs));
+
+	free(vs);
+
+	return 0;
+}
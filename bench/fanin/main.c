@@ -0,0 +1,241 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <rvs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+#define NUM_SLOT (1024)
+
+static struct rvs *vs = NULL;
+static unsigned short pkt_len = 64, batch_size = 32;
+static _Atomic int running = 0;
+
+struct th_arg {
+	pthread_t th;
+	unsigned short vid;
+	unsigned long cnt;
+} __attribute__((aligned(64)));
+
+static struct rvif *vif_alloc(unsigned char mac_src, unsigned char mac_dst)
+{
+	unsigned long off = (((sizeof(struct rvif)) / 0x1000) + 1) * 0x1000;
+	struct rvif *vif;
+	assert((vif = mmap(NULL, off + 2 * NUM_SLOT * RVS_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	vif->num = 1;
+	{
+		unsigned char j;
+		for (j = 0; j < 2; j++) {
+			unsigned short k;
+			vif->queue[0].ring[j].num = NUM_SLOT;
+			for (k = 0; k < NUM_SLOT; k++) {
+				char *p = (char *)((unsigned long) vif + off);
+				vif->queue[0].ring[j].slot[k].off = off;
+				vif->queue[0].ring[j].slot[k].len = pkt_len;
+				memset(p, 0, pkt_len);
+				p[0] = p[6] = 0x02; /* 02:00:00:00:00:<port + 1> */
+				p[5] = mac_dst;
+				p[11] = mac_src;
+				off += RVS_BUF_SIZE;
+			}
+		}
+	}
+	return vif;
+}
+
+static void *sender_fn(void *data)
+{
+	struct th_arg *a = (struct th_arg *) data;
+	struct rvif *vif = vs->port[a->vid].vif;
+	while (!running) ;
+	while (running) {
+		/* keep the TX ring full; the packets in the buffers are reused */
+		volatile unsigned short h = vif->queue[0].ring[1].head;
+		vif->queue[0].ring[1].tail = (h == 0 ? NUM_SLOT - 1 : h - 1);
+		a->cnt += rvs_fwd(vs, a->vid, 0, batch_size);
+	}
+	return NULL;
+}
+
+static void *receiver_fn(void *data)
+{
+	struct th_arg *a = (struct th_arg *) data;
+	struct rvif *vif = vs->port[a->vid].vif;
+	while (!running) ;
+	while (running) {
+		volatile unsigned short h = vif->queue[0].ring[0].head, t = vif->queue[0].ring[0].tail;
+		atomic_thread_fence(memory_order_acquire);
+		a->cnt += (h < t ? h + NUM_SLOT - t : h - t);
+		atomic_thread_fence(memory_order_release);
+		vif->queue[0].ring[0].tail = h;
+	}
+	return NULL;
+}
+
+static void pin(pthread_t th, unsigned int i)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	CPU_SET(i % ncpu, &cs);
+	assert(!pthread_setaffinity_np(th, sizeof(cs), &cs));
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned short num_sender[] = { 1, 2, 4, 8, 16, }, max_sender = 0, duration = 2;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "b:d:l:s:")) != -1) {
+			switch (ch) {
+			case 'b':
+				assert(sscanf(optarg, "%hu", &batch_size) == 1);
+				break;
+			case 'd':
+				assert(sscanf(optarg, "%hu", &duration) == 1);
+				break;
+			case 'l':
+				assert(sscanf(optarg, "%hu", &pkt_len) == 1);
+				break;
+			case 's':
+				assert(sscanf(optarg, "%hu", &max_sender) == 1);
+				break;
+			}
+		}
+	}
+
+	assert(14 <= pkt_len && pkt_len <= RVS_BUF_SIZE);
+
+	printf("senders,batch,len,tx_mpps,rx_mpps\n");
+	{
+		unsigned short x;
+		for (x = 0; x < sizeof(num_sender) / sizeof(num_sender[0]); x++) {
+			unsigned short n = (max_sender ? max_sender : num_sender[x]);
+			struct th_arg *a;
+			assert((vs = aligned_alloc(64, ((rvs_size(n + 1, 1) + 63) / 64) * 64)) != NULL);
+			assert(!rvs_init(vs, n + 1, 1));
+			assert((a = aligned_alloc(64, sizeof(struct th_arg) * (n + 1))) != NULL);
+			memset(a, 0, sizeof(struct th_arg) * (n + 1));
+			{
+				unsigned short i;
+				for (i = 0; i < n + 1; i++) {
+					a[i].vid = i;
+					assert(!rvs_vif_attach(vs, i, vif_alloc(i + 1, 1)));
+				}
+			}
+			{ /* port 0, the receiver, sends a packet so that rvs learns its address */
+				vs->port[0].vif->queue[0].ring[1].tail = 1;
+				assert(rvs_fwd(vs, 0, 0, 1) == 1);
+			}
+			{
+				unsigned short i;
+				assert(!pthread_create(&a[0].th, NULL, receiver_fn, &a[0]));
+				pin(a[0].th, 0);
+				for (i = 1; i < n + 1; i++) {
+					assert(!pthread_create(&a[i].th, NULL, sender_fn, &a[i]));
+					pin(a[i].th, i);
+				}
+			}
+			running = 1;
+			sleep(duration);
+			running = 0;
+			{
+				unsigned long tx = 0;
+				unsigned short i;
+				for (i = 0; i < n + 1; i++) {
+					pthread_join(a[i].th, NULL);
+					if (i)
+						tx += a[i].cnt;
+				}
+				printf("%u,%u,%u,%.3f,%.3f\n", n, batch_size, pkt_len,
+						(double) tx / duration / 1000000.,
+						(double) a[0].cnt / duration / 1000000.);
+			}
+			{
+				unsigned short i;
+				for (i = 0; i < n + 1; i++) {
+					struct rvif *vif = vs->port[i].vif;
+					assert(!rvs_vif_detach(vs, i, vif));
+					munmap(vif, (((sizeof(struct rvif)) / 0x1000) + 1) * 0x1000 + 2 * NUM_SLOT * RVS_BUF_SIZE);
+				}
+			}
+			free(a);
+			assert(!rvs_exit(vs));
+			free(vs);
+			if (max_sender)
+				break;
+		}
+	}
+
+	return 0;
+}
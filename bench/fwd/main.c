@@ -0,0 +1,451 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <x86intrin.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+#define BUF_SIZE (2048)
+#define LIST_MAX (16)
+
+/* a configuration of a measurement */
+struct conf {
+	unsigned short batch;
+	unsigned short num_port;
+	unsigned short num_queue;
+	unsigned short len;
+	unsigned int num_flow;
+	unsigned short flood; /* percentage of the frames to the broadcast address */
+};
+
+static unsigned int ver = RVIF_VERSION_2;
+static unsigned short ring_size = 256;
+static const char *vif_dir = NULL; /* the rvifs are files in it, e.g., on hugetlbfs, rather than anonymous memory */
+
+/* an rvif in m, whose TX slots have frames of len bytes from mac */
+static struct rvif *vif_alloc(struct rvif_mem *m, unsigned short num_queue, unsigned short len, const unsigned char *mac)
+{
+	struct rvif_layout l = {
+		.ver = ver,
+		.num_queue = num_queue,
+		.num_slot = ring_size,
+		.buf_size = BUF_SIZE,
+	};
+	struct rvif *vif;
+	rvif_layout(&l, 0);
+	if (vif_dir) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/rvs_bench_fwd.%d", vif_dir, getpid());
+		assert(!rvif_mem_open(m, path, l.size, RVIF_MEM_CREATE | RVIF_MEM_PREFAULT));
+		/* the mapping keeps the memory */
+		assert(!unlink(path));
+	} else {
+		m->page_size = 0x1000;
+		m->size = l.size;
+		assert((m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	}
+	vif = (struct rvif *) m->mem;
+	rvif_format(vif, &l);
+	{
+		unsigned short q;
+		for (q = 0; q < num_queue; q++) {
+			unsigned short k;
+			for (k = 0; k < ring_size; k++) {
+				unsigned char *p = (unsigned char *)((unsigned long) vif + RVIF_SLOT(vif, ver, q, 1, k, off));
+				RVIF_SLOT(vif, ver, q, 1, k, len) = len;
+				memset(p, 0, len);
+				memcpy(&p[6], mac, 6);
+				p[12] = 0x08; /* IPv4 */
+				p[14] = 0x45;
+				p[22] = 64;
+				p[23] = 17;
+			}
+		}
+	}
+	vif->num = num_queue;
+	return vif;
+}
+
+/* the destination address of flow f, which is learned on port 1 + f % (num_port - 1) */
+static void flow_mac(unsigned char *mac, unsigned int f)
+{
+	mac[0] = 0x02;
+	mac[1] = 0x00;
+	mac[2] = 0x01;
+	mac[3] = (unsigned char)(f >> 16);
+	mac[4] = (unsigned char)(f >> 8);
+	mac[5] = (unsigned char) f;
+}
+
+/* the consumers take all the received frames of the num RX rings, and the number of them is returned */
+static unsigned long drain(struct rvif_ring *rx, unsigned int num)
+{
+	unsigned long cnt = 0;
+	unsigned int i;
+	for (i = 0; i < num; i++) {
+		unsigned short a = rvif_ring_peek(&rx[i], 1);
+		if (a)
+			rvif_ring_release(&rx[i], a);
+		cnt += a;
+	}
+	return cnt;
+}
+
+/* the hardware counters of the perf events, which are optional; one the CPU lacks is reported as - */
+#define NUM_PERF (4)
+
+static const struct {
+	const char *name;
+	unsigned int type;
+	unsigned long config;
+} perf_ev[NUM_PERF] = {
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, },
+	{ "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, },
+	{ "dtlb_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), },
+};
+
+static int perf_fd[NUM_PERF] = { -1, -1, -1, -1, };
+
+static int perf_open(void)
+{
+	unsigned short i, num = 0;
+	for (i = 0; i < NUM_PERF; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = perf_ev[i].type;
+		attr.size = sizeof(attr);
+		attr.config = perf_ev[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		if ((perf_fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0)) != -1)
+			num++;
+	}
+	return (num ? 0 : -1);
+}
+
+static void perf_start(void)
+{
+	unsigned short i;
+	for (i = 0; i < NUM_PERF; i++) {
+		if (perf_fd[i] == -1)
+			continue;
+		assert(!ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0));
+		assert(!ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0));
+	}
+}
+
+static void perf_stop(unsigned long *val)
+{
+	unsigned short i;
+	for (i = 0; i < NUM_PERF; i++) {
+		if (perf_fd[i] == -1)
+			continue;
+		assert(!ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0));
+		assert(read(perf_fd[i], &val[i], sizeof(val[i])) == sizeof(val[i]));
+	}
+}
+
+static void run(const struct conf *c, unsigned long num_pkt, int perf)
+{
+	struct rvs *vs;
+	struct rvif_mem *vif_mem;
+	struct rvif_ring *rx, *tx; /* the RX rings of all the ports, and the TX rings of port 0 */
+	unsigned long flow_idx = 0, sent = 0, recv = 0, cycles = 0, val[NUM_PERF] = { 0 };
+
+	assert((vs = aligned_alloc(64, ((rvs_size(c->num_port, c->num_queue) + 63) / 64) * 64)) != NULL);
+	assert(!rvs_init(vs, c->num_port, c->num_queue));
+	{
+		/* large enough for the flows */
+		unsigned long size = ((c->num_flow * 4 + RVS_FT_WAY - 1) / RVS_FT_WAY) * sizeof(struct rvs_ft_bucket);
+		void *mem;
+		assert((mem = aligned_alloc(64, size)) != NULL);
+		assert(!rvs_ft_setup(vs, mem, size, RVS_FT_AGE));
+	}
+	assert((vif_mem = calloc(c->num_port, sizeof(vif_mem[0]))) != NULL);
+	{
+		unsigned short i;
+		for (i = 0; i < c->num_port; i++) {
+			unsigned char mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, (unsigned char) i, };
+			assert(!rvs_vif_attach(vs, i, vif_alloc(&vif_mem[i], c->num_queue, c->len, mac)));
+		}
+	}
+	assert((rx = calloc((unsigned long) c->num_port * c->num_queue, sizeof(rx[0]))) != NULL);
+	assert((tx = calloc(c->num_queue, sizeof(tx[0]))) != NULL);
+	{
+		unsigned short i;
+		for (i = 0; i < c->num_port; i++) {
+			unsigned short q;
+			for (q = 0; q < c->num_queue; q++)
+				rvif_ring_init(&rx[i * c->num_queue + q], vs->port[i].vif, ver, q, 0);
+		}
+	}
+	{
+		/* each destination port sends a frame from the addresses of its flows */
+		unsigned int f;
+		for (f = 0; f < c->num_flow; f++) {
+			unsigned short i = 1 + f % (c->num_port - 1);
+			struct rvif_ring t;
+			rvif_ring_init(&t, vs->port[i].vif, ver, 0, 1);
+			assert(rvif_ring_reserve(&t, 1));
+			flow_mac((unsigned char *) &rvif_ring_buf(&t, rvif_ring_slot(&t, 0))[6], f);
+			rvif_ring_commit(&t, 1);
+			assert(rvs_fwd(vs, i, 0, 1) == 1);
+			drain(rx, (unsigned int) c->num_port * c->num_queue);
+		}
+	}
+	{
+		unsigned short q;
+		for (q = 0; q < c->num_queue; q++)
+			rvif_ring_init(&tx[q], vs->port[0].vif, ver, q, 1);
+	}
+	{
+		int warm;
+		for (warm = 1; warm >= 0; warm--) {
+			unsigned long n = 0;
+			unsigned short q = 0;
+			if (!warm && perf)
+				perf_start();
+			while (n < (warm ? num_pkt / 8 : num_pkt)) {
+				/* the sender fills the TX ring, writing the destination of the next flow to each slot */
+				unsigned short f = rvif_ring_reserve(&tx[q], ring_size - 1), i;
+				for (i = 0; i < f; i++) {
+					unsigned char *p = (unsigned char *) rvif_ring_buf(&tx[q], rvif_ring_slot(&tx[q], i));
+					if ((flow_idx * 37) % 100 < c->flood)
+						memset(p, 0xff, 6);
+					else
+						flow_mac(p, (unsigned int)(flow_idx % c->num_flow));
+					flow_idx++;
+				}
+				if (f)
+					rvif_ring_commit(&tx[q], f);
+				{
+					unsigned long t0 = __rdtsc();
+					unsigned short cnt = rvs_fwd(vs, 0, q, c->batch);
+					unsigned long t1 = __rdtsc();
+					if (!warm) {
+						cycles += t1 - t0;
+						sent += cnt;
+					}
+					n += cnt;
+				}
+				{
+					unsigned long r = drain(rx, (unsigned int) c->num_port * c->num_queue);
+					if (!warm)
+						recv += r;
+				}
+				if (++q == c->num_queue)
+					q = 0;
+			}
+			if (!warm && perf)
+				perf_stop(val);
+		}
+	}
+	printf("%u,%u,%u,%u,%u,%u,%u,%lu,%.1f,%.3f", ver, c->batch, c->num_port, c->num_queue, c->len, c->num_flow, c->flood,
+			sent, (double) cycles / sent, (double) recv / sent);
+	if (perf) {
+		unsigned short i;
+		for (i = 0; i < NUM_PERF; i++)
+			if (perf_fd[i] == -1)
+				printf(",-");
+			else
+				printf(",%.2f", (double) val[i] / sent);
+	}
+	printf("\n");
+	fflush(stdout);
+	{
+		unsigned short i;
+		for (i = 0; i < c->num_port; i++) {
+			struct rvif *vif = vs->port[i].vif;
+			assert(!rvs_vif_detach(vs, i, vif));
+			rvif_mem_close(&vif_mem[i]);
+		}
+	}
+	free(vif_mem);
+	free(rx);
+	free(tx);
+	free(vs->ft.tbl[vs->cur_ft].bucket);
+	assert(!rvs_exit(vs));
+	free(vs);
+}
+
+/* parses a comma-separated list of numbers */
+static unsigned short list_parse(const char *arg, unsigned int *list)
+{
+	unsigned short num = 0;
+	while (1) {
+		int n;
+		assert(num < LIST_MAX);
+		assert(sscanf(arg, "%u%n", &list[num++], &n) == 1);
+		if (arg[n] != ',')
+			break;
+		arg += n + 1;
+	}
+	return num;
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned int batch[LIST_MAX] = { 1, 32, 256, }, port[LIST_MAX] = { 2, 4, 16, }, queue[LIST_MAX] = { 1, 4, },
+		     len[LIST_MAX] = { 64, 1514, }, flow[LIST_MAX] = { 1, 1024, }, flood[LIST_MAX] = { 0, 10, };
+	unsigned short num_batch = 3, num_port = 3, num_queue = 2, num_len = 2, num_flow = 2, num_flood = 2;
+	unsigned long num_pkt = 1000000;
+	int perf = 0;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "b:ef:F:H:l:n:p:q:r:v:")) != -1) {
+			switch (ch) {
+			case 'b':
+				num_batch = list_parse(optarg, batch);
+				break;
+			case 'e':
+				perf = 1;
+				break;
+			case 'f':
+				num_flow = list_parse(optarg, flow);
+				break;
+			case 'F':
+				num_flood = list_parse(optarg, flood);
+				break;
+			case 'H':
+				vif_dir = optarg;
+				break;
+			case 'l':
+				num_len = list_parse(optarg, len);
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num_pkt) == 1);
+				break;
+			case 'p':
+				num_port = list_parse(optarg, port);
+				break;
+			case 'q':
+				num_queue = list_parse(optarg, queue);
+				break;
+			case 'r':
+				assert(sscanf(optarg, "%hu", &ring_size) == 1);
+				assert(2 <= ring_size && ring_size <= RVIF_MAX_SLOT);
+				break;
+			case 'v':
+				assert(sscanf(optarg, "%u", &ver) == 1);
+				assert(ver == RVIF_VERSION_1 || ver == RVIF_VERSION_2 || ver == RVIF_VERSION_3);
+				break;
+			}
+		}
+	}
+
+	if (perf && perf_open()) {
+		fprintf(stderr, "the perf events are not available, and the counters are not reported\n");
+		perf = 0;
+	}
+
+	printf("# %lu packets for each, %u-slot rings, rvifs in %s\n", num_pkt, ring_size, vif_dir ? vif_dir : "anonymous memory");
+	printf("version,batch,ports,queues,len,flows,flood,pkts,cycles_per_pkt,rx_per_tx");
+	if (perf) {
+		unsigned short i;
+		for (i = 0; i < NUM_PERF; i++)
+			printf(",%s_per_pkt", perf_ev[i].name);
+	}
+	printf("\n");
+	{
+		unsigned short a, b, d, e, f, g;
+		for (a = 0; a < num_batch; a++)
+			for (b = 0; b < num_port; b++)
+				for (d = 0; d < num_queue; d++)
+					for (e = 0; e < num_len; e++)
+						for (f = 0; f < num_flow; f++)
+							for (g = 0; g < num_flood; g++) {
+								struct conf c = {
+									.batch = batch[a],
+									.num_port = port[b],
+									.num_queue = queue[d],
+									.len = len[e],
+									.num_flow = flow[f],
+									.flood = flood[g],
+								};
+								assert(c.batch && c.batch <= RVIF_MAX_SLOT);
+								assert(2 <= c.num_port && c.num_port <= RVS_MAX_PORT);
+								assert(c.num_queue && c.num_queue <= RVIF_MAX_QUEUE);
+								assert(34 <= c.len && c.len <= BUF_SIZE);
+								assert(c.num_flow && c.flood <= 100);
+								run(&c, num_pkt, perf);
+							}
+	}
+
+	return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+#define RING_SIZE (256)
+#define LIST_MAX (16)
+#define ROUND_MAX (6) /* frames sent to port 1 in a round */
+#define EXTRA_MAX (2) /* frames added to a round with the monitor port, to its address and to the broadcast one */
+#define MAC_BCAST (3)
+
+/* the layout of the rvif of a port */
+struct port_conf {
+	unsigned int ver;
+	unsigned int buf_size;
+};
+
+static struct port_conf mon_conf = { 0, 0, }; /* of the monitor port, port 2, version 0 if none */
+static unsigned short mon_dir = RVS_MIRROR_INGRESS; /* of port 0, or the egress of port 1 */
+
+static const unsigned char mac[4][6] = {
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x01, },
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x02, },
+	{ 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, },
+};
+
+static unsigned char frame_buf[2][RVS_FRAME_MAX];
+
+static struct rvif *vif_alloc(struct rvif_mem *m, const struct port_conf *c)
+{
+	struct rvif_layout l = {
+		.ver = c->ver,
+		.num_queue = 1,
+		.num_slot = RING_SIZE,
+		.buf_size = c->buf_size,
+	};
+	struct rvif *vif;
+	rvif_layout(&l, 0);
+	m->page_size = 0x1000;
+	m->size = l.size;
+	assert((m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	vif = (struct rvif *) m->mem;
+	rvif_format(vif, &l);
+	vif->num = 1;
+	return vif;
+}
+
+/* whether a frame of len bytes fits in a port */
+static int frame_fit(const struct port_conf *c, unsigned short len)
+{
+	return (c->ver == RVIF_VERSION_3 || len <= c->buf_size);
+}
+
+/* the byte at k of frame seed, after the MAC addresses */
+static unsigned char frame_byte(unsigned long seed, unsigned short k)
+{
+	return (unsigned char)(seed * 31 + k * 7);
+}
+
+/* puts a frame of len bytes from port src to port dst on the TX ring, splitting it by the buffer size */
+static void frame_send(struct rvif_ring *tx, unsigned int buf_size, unsigned short src, unsigned short dst,
+		       unsigned short len, unsigned long seed)
+{
+	unsigned short n = (unsigned short)((len + buf_size - 1) / buf_size), k;
+	assert(rvif_ring_reserve(tx, n) >= n);
+	for (k = 0; k < len; k++)
+		frame_buf[0][k] = frame_byte(seed, k);
+	memcpy(frame_buf[0], mac[dst], 6);
+	memcpy(frame_buf[0] + 6, mac[src], 6);
+	for (k = 0; k < n; k++) {
+		unsigned short s = rvif_ring_slot(tx, k), l = (unsigned short)(k + 1 < n ? buf_size : len - k * buf_size);
+		memcpy(rvif_ring_buf(tx, s), frame_buf[0] + k * buf_size, l);
+		RVIF_SLOT(tx->vif, tx->ver, 0, 1, s, len) = l;
+		if (tx->ver == RVIF_VERSION_3)
+			((struct rvif3 *) tx->vif)->queue[0].ring[1].slot[s].flags = (k + 1 < n ? RVIF_SLOT_F_MORE : 0);
+	}
+	rvif_ring_commit(tx, n);
+}
+
+/* gathers the i-th and later slots of a frame of the RX ring to buf, and returns its length */
+static unsigned short frame_recv(struct rvif_ring *rx, unsigned short *i, unsigned short a, unsigned char *buf)
+{
+	unsigned short len = 0;
+	while (1) {
+		unsigned short s = rvif_ring_slot(rx, *i), l = RVIF_SLOT(rx->vif, rx->ver, 0, 0, s, len);
+		assert(len + l <= RVS_FRAME_MAX);
+		memcpy(buf + len, rvif_ring_buf(rx, s), l);
+		len += l;
+		(*i)++;
+		if (!RVIF_SLOT_MORE(rx->vif, rx->ver, 0, 0, s))
+			break;
+		assert(*i < a);
+	}
+	return len;
+}
+
+/* checks that frame f of round r, to port dst, has been received in buf */
+static void frame_check(const unsigned char *buf, unsigned short l, unsigned short len, unsigned short dst, unsigned long r, unsigned short f)
+{
+	unsigned short k;
+	assert(l == len && !memcmp(buf, mac[dst], 6) && !memcmp(buf + 6, mac[0], 6));
+	for (k = 12; k < l; k++)
+		assert(buf[k] == frame_byte(r * (ROUND_MAX + EXTRA_MAX) + f, k));
+}
+
+/*
+ * sends random frames of up to RVS_FRAME_MAX bytes from port 0 to port 1 in
+ * num rounds, each of which is forwarded by batches of random sizes, and
+ * checks that port 1 receives every byte of the frames fitting in it, in
+ * order, and nothing else; with the monitor port, it also checks that the
+ * monitor port receives the mirrored frames fitting in it, and that the
+ * others are counted in mirror_drop, and some rounds have a frame to the
+ * address learned on the monitor port, which is dropped, and a broadcast
+ * frame, which goes to port 1, so that the batches have both or either
+ */
+static void run(const struct port_conf *src, const struct port_conf *dst, unsigned long num)
+{
+	struct rvs *vs;
+	struct rvif_mem m[3];
+	struct rvif_ring tx, rx, mx;
+	unsigned long sent = 0, recv = 0, drop = 0, mir = 0, mir_drop = 0, r;
+	unsigned short num_port = (mon_conf.ver ? 3 : 2);
+
+	assert((vs = aligned_alloc(64, ((rvs_size(num_port, 1) + 63) / 64) * 64)) != NULL);
+	assert(!rvs_init(vs, num_port, 1));
+	assert(!rvs_vif_attach(vs, 0, vif_alloc(&m[0], src)));
+	assert(!rvs_vif_attach(vs, 1, vif_alloc(&m[1], dst)));
+	rvif_ring_init(&tx, vs->port[0].vif, src->ver, 0, 1);
+	rvif_ring_init(&rx, vs->port[1].vif, dst->ver, 0, 0);
+	if (mon_conf.ver) {
+		assert(!rvs_vif_attach(vs, 2, vif_alloc(&m[2], &mon_conf)));
+		rvif_ring_init(&mx, vs->port[2].vif, mon_conf.ver, 0, 0);
+		assert(!rvs_mirror_set(vs, 2));
+		assert(!rvs_port_mirror(vs, (mon_dir == RVS_MIRROR_INGRESS ? 0 : 1), mon_dir));
+	}
+	{
+		/* port 1 sends a frame so that its address is learned */
+		struct rvif_ring t, x;
+		rvif_ring_init(&t, vs->port[1].vif, dst->ver, 0, 1);
+		rvif_ring_init(&x, vs->port[0].vif, src->ver, 0, 0);
+		frame_send(&t, dst->buf_size, 1, 0, 60, 0);
+		assert(rvs_fwd(vs, 1, 0, 1) == 1);
+		assert(rvif_ring_peek(&x, 1) == 1);
+		rvif_ring_release(&x, 1);
+		/* the frame is neither from port 0 nor to port 1 */
+		if (mon_conf.ver) {
+			assert(!rvif_ring_peek(&mx, 1));
+			/* the monitor port sends a frame so that its address is learned */
+			rvif_ring_init(&t, vs->port[2].vif, mon_conf.ver, 0, 1);
+			frame_send(&t, mon_conf.buf_size, 2, 0, 60, 0);
+			assert(rvs_fwd(vs, 2, 0, 1) == 1);
+			assert(rvif_ring_peek(&x, 1) == 1);
+			rvif_ring_release(&x, 1);
+			/* and flooded, as port 0 has not sent any */
+			assert(rvif_ring_peek(&rx, 1) == 1);
+			rvif_ring_release(&rx, 1);
+			assert(!rvif_ring_peek(&mx, 1));
+		}
+	}
+	srand(1);
+	for (r = 0; r < num; r++) {
+		unsigned short len[ROUND_MAX + EXTRA_MAX], to[ROUND_MAX + EXTRA_MAX], nf = (unsigned short)(1 + rand() % ROUND_MAX), f;
+		unsigned char got[ROUND_MAX + EXTRA_MAX]; /* port 1 has received the frame */
+		/* a source other than version 3 has single-slot frames */
+		unsigned short max = (src->ver == RVIF_VERSION_3 ? RVS_FRAME_MAX : src->buf_size);
+		for (f = 0; f < nf; f++) {
+			len[f] = (unsigned short)(rand() % 4 ? 60 + rand() % (max - 59) : 60 + rand() % 200);
+			to[f] = 1;
+		}
+		if (mon_conf.ver && !(r % 3)) {
+			/* the frames to the monitor port and to all, at random places */
+			unsigned short e;
+			for (e = 0; e < EXTRA_MAX; e++) {
+				unsigned short at = (unsigned short)(rand() % (nf + 1));
+				for (f = nf; f > at; f--) {
+					len[f] = len[f - 1];
+					to[f] = to[f - 1];
+				}
+				len[at] = (unsigned short)(60 + rand() % 200);
+				to[at] = (e ? MAC_BCAST : 2);
+				nf++;
+			}
+		}
+		for (f = 0; f < nf; f++)
+			frame_send(&tx, src->buf_size, 0, to[f], len[f], r * (ROUND_MAX + EXTRA_MAX) + f);
+		if (r % 7) {
+			while (rvs_fwd(vs, 0, 0, RING_SIZE))
+				;
+		} else {
+			/* batches ending in the middle of the frames */
+			while (rvs_fwd(vs, 0, 0, (unsigned short)(1 + rand() % 5)))
+				;
+		}
+		/* the TX ring is drained */
+		assert(rvif_idx_load(&RVIF_RING(tx.vif, tx.ver, 0, 1, head)) == tx.tail);
+		{
+			/* the unicast frames are in order, and the frames flooded in a batch follow them */
+			unsigned short a = rvif_ring_peek(&rx, RING_SIZE), i = 0, u = 0;
+			for (f = 0; f < nf; f++)
+				got[f] = 0;
+			while (i < a) {
+				unsigned short l = frame_recv(&rx, &i, a, frame_buf[1]);
+				if (!memcmp(frame_buf[1], mac[MAC_BCAST], 6)) {
+					for (f = 0; f < nf && to[f] != MAC_BCAST; f++)
+						;
+					assert(f < nf && !got[f]);
+				} else {
+					while (u < nf && (to[u] != 1 || !frame_fit(dst, len[u])))
+						u++;
+					assert(u < nf);
+					f = u++;
+				}
+				frame_check(frame_buf[1], l, len[f], to[f], r, f);
+				got[f] = 1;
+				recv++;
+			}
+			for (f = 0; f < nf; f++) {
+				if (to[f] == 2)
+					assert(!got[f]); /* the monitor port only gets the mirrored frames */
+				else if (!got[f]) {
+					/* a frame not fitting in a single slot of the destination is dropped */
+					assert(!frame_fit(dst, len[f]));
+					drop++;
+				}
+			}
+			if (a)
+				rvif_ring_release(&rx, a);
+		}
+		if (mon_conf.ver) {
+			/* the ingress frames of port 0, or the egress ones of port 1, in the order of port 0 */
+			unsigned short a = rvif_ring_peek(&mx, RING_SIZE), i = 0;
+			for (f = 0; f < nf; f++) {
+				unsigned short l;
+				if (mon_dir == RVS_MIRROR_EGRESS && !got[f])
+					continue;
+				if (!frame_fit(&mon_conf, len[f])) {
+					mir_drop++;
+					continue;
+				}
+				assert(i < a);
+				l = frame_recv(&mx, &i, a, frame_buf[1]);
+				frame_check(frame_buf[1], l, len[f], to[f], r, f);
+				mir++;
+			}
+			assert(i == a);
+			if (a)
+				rvif_ring_release(&mx, a);
+			assert(vs->mirror_drop == mir_drop);
+		}
+		sent += nf;
+	}
+	printf("%u,%u,%u,%u,%lu,%lu,%lu,%lu,%lu\n", src->ver, src->buf_size, dst->ver, dst->buf_size, sent, recv, drop, mir, mir_drop);
+	fflush(stdout);
+	{
+		unsigned short i;
+		for (i = 0; i < num_port; i++) {
+			assert(!rvs_vif_detach(vs, i, vs->port[i].vif));
+			rvif_mem_close(&m[i]);
+		}
+	}
+	assert(!rvs_exit(vs));
+	free(vs);
+}
+
+/* parses a comma-separated list of version:buf_size */
+static unsigned short conf_parse(const char *arg, struct port_conf *list)
+{
+	unsigned short num = 0;
+	while (1) {
+		int n;
+		assert(num < LIST_MAX);
+		assert(sscanf(arg, "%u:%u%n", &list[num].ver, &list[num].buf_size, &n) == 2);
+		assert(list[num].ver == RVIF_VERSION_1 || list[num].ver == RVIF_VERSION_2 || list[num].ver == RVIF_VERSION_3);
+		/* the buffers of version 1 and 2 are RVS_BUF_SIZE bytes */
+		assert(list[num].ver == RVIF_VERSION_3 ? (list[num].buf_size && list[num].buf_size % 64 == 0 && list[num].buf_size <= 0xffc0)
+		       : list[num].buf_size == RVS_BUF_SIZE);
+		num++;
+		if (arg[n] != ',')
+			break;
+		arg += n + 1;
+	}
+	return num;
+}
+
+int main(int argc, char *const *argv)
+{
+	struct port_conf conf[LIST_MAX] = { { 1, 2048, }, { 2, 2048, }, { 3, 2048, }, { 3, 1024, }, { 3, 9216, }, };
+	unsigned short num_conf = 5;
+	unsigned long num = 3000;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "M:n:v:X:")) != -1) {
+			switch (ch) {
+			case 'M':
+				assert(conf_parse(optarg, &mon_conf) == 1);
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num) == 1);
+				break;
+			case 'v':
+				num_conf = conf_parse(optarg, conf);
+				break;
+			case 'X':
+				if (!strcmp(optarg, "i"))
+					mon_dir = RVS_MIRROR_INGRESS;
+				else if (!strcmp(optarg, "e"))
+					mon_dir = RVS_MIRROR_EGRESS;
+				else
+					assert(0);
+				break;
+			}
+		}
+	}
+
+	printf("# %lu rounds of up to %u frames for each\n", num, ROUND_MAX);
+	if (mon_conf.ver)
+		printf("# mirroring the %s of port %u to port 2 (version %u, %u-byte buffers)\n",
+				(mon_dir == RVS_MIRROR_INGRESS ? "ingress" : "egress"), (mon_dir == RVS_MIRROR_INGRESS ? 0 : 1), mon_conf.ver, mon_conf.buf_size);
+	printf("src_version,src_buf,dst_version,dst_buf,sent,received,dropped,mirrored,mirror_dropped\n");
+	{
+		unsigned short a, b;
+		for (a = 0; a < num_conf; a++)
+			for (b = 0; b < num_conf; b++)
+				run(&conf[a], &conf[b], num);
+	}
+
+	return 0;
+}
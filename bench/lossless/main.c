@@ -0,0 +1,349 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+static unsigned long now_us = 1; /* the clock, which only the test advances */
+
+unsigned long rvs_time_us(void)
+{
+	return now_us;
+}
+
+#define RING_SIZE (256)
+#define SRC_BUF_SIZE (2048)
+#define BIG_SLOTS (5) /* the slots of a frame over RVS_FRAME_MAX, which is dropped at the source */
+#define STAT_Q(st, vid) RVS_STAT_QUEUE(st, 3, 1, vid, 0) /* the counters of the only queue of a port */
+
+static const unsigned char mac[3][6] = {
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, },
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x01, },
+	{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x02, },
+};
+
+static unsigned char frame_buf[BIG_SLOTS * SRC_BUF_SIZE];
+
+/* the frames on the TX ring of port 0, which rvs_fwd() has not taken */
+static struct {
+	unsigned short slot; /* the first one */
+	unsigned short len;
+} tx_log[RING_SIZE];
+static unsigned short log_head = 0, log_tail = 0;
+
+/* the frames and the bytes that rvs_fwd() has taken from the TX ring of port 0 */
+static unsigned long taken_pkt = 0, taken_byte = 0;
+
+/* the next sequence numbers sent to and received by port 1 and 2 */
+static unsigned long sent_seq[3] = { 0 }, recv_seq[3] = { 0 };
+static unsigned long sent_big = 0;
+
+static struct rvif *vif_alloc(struct rvif_mem *m, unsigned int ver, unsigned int buf_size)
+{
+	struct rvif_layout l = {
+		.ver = ver,
+		.num_queue = 1,
+		.num_slot = RING_SIZE,
+		.buf_size = buf_size,
+	};
+	struct rvif *vif;
+	rvif_layout(&l, 0);
+	m->page_size = 0x1000;
+	m->size = l.size;
+	assert((m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	vif = (struct rvif *) m->mem;
+	rvif_format(vif, &l);
+	vif->num = 1;
+	return vif;
+}
+
+/*
+ * puts a frame of len bytes from port 0 to port dst on the TX ring of
+ * version 3, splitting it by the buffer size, and returns 0 if it does not
+ * fit; the bytes after the MAC addresses have the sequence number
+ */
+static int frame_send(struct rvif_ring *tx, unsigned short dst, unsigned short len, unsigned long seq)
+{
+	unsigned short n = (unsigned short)((len + SRC_BUF_SIZE - 1) / SRC_BUF_SIZE), k;
+	if (rvif_ring_reserve(tx, n) < n)
+		return 0;
+	memset(frame_buf, 0, len);
+	memcpy(frame_buf, mac[dst], 6);
+	memcpy(frame_buf + 6, mac[0], 6);
+	memcpy(frame_buf + 12, &seq, sizeof(seq));
+	for (k = 0; k < n; k++) {
+		unsigned short s = rvif_ring_slot(tx, k), l = (unsigned short)(k + 1 < n ? SRC_BUF_SIZE : len - k * SRC_BUF_SIZE);
+		memcpy(rvif_ring_buf(tx, s), frame_buf + k * SRC_BUF_SIZE, l);
+		RVIF_SLOT(tx->vif, tx->ver, 0, 1, s, len) = l;
+		((struct rvif3 *) tx->vif)->queue[0].ring[1].slot[s].flags = (k + 1 < n ? RVIF_SLOT_F_MORE : 0);
+	}
+	tx_log[log_tail].slot = rvif_ring_slot(tx, 0);
+	tx_log[log_tail].len = len;
+	log_tail = (unsigned short)((log_tail + 1) % RING_SIZE);
+	rvif_ring_commit(tx, n);
+	return 1;
+}
+
+/* puts random frames on the TX ring until it is full, or max frames */
+static void frame_fill(struct rvif_ring *tx, unsigned short max, int big)
+{
+	unsigned short i;
+	for (i = 0; i < max; i++) {
+		unsigned short dst = (unsigned short)(1 + rand() % 2);
+		if (big && !(rand() % 8)) {
+			if (!frame_send(tx, 1, BIG_SLOTS * SRC_BUF_SIZE, 0))
+				break;
+			sent_big++;
+		} else {
+			if (!frame_send(tx, dst, (unsigned short)(60 + rand() % (RVS_BUF_SIZE - 59)), sent_seq[dst]))
+				break;
+			sent_seq[dst]++;
+		}
+	}
+}
+
+/* counts the frames that rvs_fwd() has taken, which are those before the head of the TX ring */
+static void frame_taken(const struct rvif_ring *tx)
+{
+	unsigned short h = rvif_idx_load(&RVIF_RING(tx->vif, tx->ver, 0, 1, head));
+	while (log_head != log_tail && tx_log[log_head].slot != h) {
+		taken_pkt++;
+		taken_byte += tx_log[log_head].len;
+		log_head = (unsigned short)((log_head + 1) % RING_SIZE);
+	}
+}
+
+/* receives up to max frames of port vid, checking that they are in order, and returns the number of them */
+static unsigned short frame_recv(struct rvif_ring *rx, unsigned short vid, unsigned short max)
+{
+	unsigned short a = rvif_ring_peek(rx, max), i;
+	if (a > max)
+		a = max;
+	for (i = 0; i < a; i++) {
+		unsigned short s = rvif_ring_slot(rx, i);
+		const unsigned char *b = (const unsigned char *) rvif_ring_buf(rx, s);
+		unsigned long seq;
+		memcpy(&seq, b + 12, sizeof(seq));
+		assert(RVIF_SLOT(rx->vif, rx->ver, 0, 0, s, len) >= 60);
+		assert(!memcmp(b, mac[vid], 6) && !memcmp(b + 6, mac[0], 6));
+		assert(seq == recv_seq[vid]);
+		recv_seq[vid]++;
+	}
+	if (a)
+		rvif_ring_release(rx, a);
+	return a;
+}
+
+/* forwards the frames of port 0 until rvs_fwd() takes none */
+static void fwd_all(struct rvs *vs, struct rvs_stat *st, const struct rvif_ring *tx)
+{
+	while (rvs_fwd_stat(vs, 0, 0, (unsigned short)(1 + rand() % 64), st))
+		;
+	frame_taken(tx);
+}
+
+static void stat_print(const char *phase, const struct rvs_stat *st)
+{
+	printf("%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", phase,
+			STAT_Q(st, 0)->rx_pkt, STAT_Q(st, 0)->rx_byte,
+			STAT_Q(st, 1)->tx_pkt, STAT_Q(st, 2)->tx_pkt,
+			sent_big, STAT_Q(st, 1)->drop, STAT_Q(st, 0)->hold);
+	fflush(stdout);
+}
+
+/*
+ * port 0 sends random frames to port 1, which is lossless, and port 2; in
+ * num steps, the consumer of port 1 takes a few frames and the clock
+ * advances by less than the timeout for each, thus, port 1 receives every
+ * frame in order and nothing is dropped; then, the consumer of port 1 stops,
+ * and the frames are held back until the timeout, after which the frames
+ * not fitting in port 1 are dropped and the TX ring drains
+ */
+int main(int argc, char *const *argv)
+{
+	struct rvs *vs;
+	struct rvs_stat *st;
+	struct rvif_mem m[3];
+	struct rvif_ring tx, rx[3];
+	unsigned long num = 10000, timeout = 1000, r;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "n:t:")) != -1) {
+			switch (ch) {
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num) == 1);
+				break;
+			case 't':
+				assert(sscanf(optarg, "%lu", &timeout) == 1);
+				assert(timeout >= 2);
+				break;
+			}
+		}
+	}
+
+	assert((vs = aligned_alloc(64, ((rvs_size(3, 1) + 63) / 64) * 64)) != NULL);
+	assert((st = calloc(1, RVS_STAT_SIZE(3, 1))) != NULL);
+	assert(!rvs_init(vs, 3, 1));
+	assert(!rvs_vif_attach(vs, 0, vif_alloc(&m[0], RVIF_VERSION_3, SRC_BUF_SIZE)));
+	assert(!rvs_vif_attach(vs, 1, vif_alloc(&m[1], RVIF_VERSION_1, RVS_BUF_SIZE)));
+	assert(!rvs_vif_attach(vs, 2, vif_alloc(&m[2], RVIF_VERSION_1, RVS_BUF_SIZE)));
+	assert(!rvs_port_lossless(vs, 1, timeout));
+	rvif_ring_init(&tx, vs->port[0].vif, RVIF_VERSION_3, 0, 1);
+	rvif_ring_init(&rx[0], vs->port[0].vif, RVIF_VERSION_3, 0, 0);
+	rvif_ring_init(&rx[1], vs->port[1].vif, RVIF_VERSION_1, 0, 0);
+	rvif_ring_init(&rx[2], vs->port[2].vif, RVIF_VERSION_1, 0, 0);
+	{
+		/* port 1 and 2 send a frame so that their addresses are learned */
+		unsigned short i;
+		for (i = 1; i < 3; i++) {
+			struct rvif_ring t;
+			unsigned short k;
+			rvif_ring_init(&t, vs->port[i].vif, RVIF_VERSION_1, 0, 1);
+			assert(rvif_ring_reserve(&t, 1) >= 1);
+			memset(rvif_ring_buf(&t, t.tail), 0, 60);
+			memcpy(rvif_ring_buf(&t, t.tail), mac[0], 6);
+			memcpy(rvif_ring_buf(&t, t.tail) + 6, mac[i], 6);
+			RVIF_SLOT(t.vif, t.ver, 0, 1, t.tail, len) = 60;
+			rvif_ring_commit(&t, 1);
+			assert(rvs_fwd(vs, i, 0, 1) == 1);
+			for (k = 0; k < 3; k++) {
+				unsigned short a = rvif_ring_peek(&rx[k], 1);
+				if (a)
+					rvif_ring_release(&rx[k], a);
+			}
+		}
+	}
+
+	printf("# %lu steps, the timeout is %lu us\n", num, timeout);
+	printf("phase,rx_pkt,rx_byte,tx_pkt_1,tx_pkt_2,big,drop_1,hold\n");
+
+	srand(1);
+	for (r = 0; r < num; r++) {
+		frame_fill(&tx, (unsigned short)(rand() % 48), 1);
+		fwd_all(vs, st, &tx);
+		frame_recv(&rx[1], 1, (unsigned short)(1 + rand() % 3));
+		frame_recv(&rx[2], 2, RING_SIZE);
+		now_us += (unsigned long) rand() % (timeout / 2);
+		/* no drop before the timeout */
+		assert(!STAT_Q(st, 1)->drop && !STAT_Q(st, 2)->drop);
+		assert(STAT_Q(st, 0)->rx_pkt == taken_pkt && STAT_Q(st, 0)->rx_byte == taken_byte);
+	}
+	/* the consumer of port 1 drains its ring until the TX ring is empty */
+	while (log_head != log_tail) {
+		fwd_all(vs, st, &tx);
+		frame_recv(&rx[1], 1, RING_SIZE);
+		frame_recv(&rx[2], 2, RING_SIZE);
+	}
+	frame_recv(&rx[1], 1, RING_SIZE);
+	frame_recv(&rx[2], 2, RING_SIZE);
+	assert(recv_seq[1] == sent_seq[1] && recv_seq[2] == sent_seq[2]);
+	assert(STAT_Q(st, 0)->rx_pkt == STAT_Q(st, 1)->tx_pkt + STAT_Q(st, 2)->tx_pkt + sent_big);
+	assert(STAT_Q(st, 0)->rx_pkt == taken_pkt && STAT_Q(st, 0)->rx_byte == taken_byte);
+	assert(!STAT_Q(st, 1)->drop);
+	stat_print("slow", st);
+
+	{
+		/* the consumer of port 1 stops, and the frames to it fill its ring and then the TX ring */
+		unsigned long hold, since = now_us, sent_2;
+		do {
+			frame_fill(&tx, RING_SIZE, 0);
+			fwd_all(vs, st, &tx);
+			frame_recv(&rx[2], 2, RING_SIZE);
+		} while (rvif_ring_reserve(&tx, 1));
+		assert(rvif_ring_peek(&rx[1], RING_SIZE) == RING_SIZE - 1);
+		assert(log_head != log_tail);
+		/* held back until the timeout */
+		hold = STAT_Q(st, 0)->hold;
+		now_us = since + timeout - 1;
+		fwd_all(vs, st, &tx);
+		assert(STAT_Q(st, 0)->hold > hold && !STAT_Q(st, 1)->drop && log_head != log_tail);
+		/* after the timeout, the frames not fitting in port 1 are dropped */
+		now_us = since + timeout;
+		fwd_all(vs, st, &tx);
+		frame_recv(&rx[2], 2, RING_SIZE);
+		assert(log_head == log_tail);
+		sent_2 = sent_seq[2];
+		assert(recv_seq[2] == sent_2);
+		assert(STAT_Q(st, 1)->drop == sent_seq[1] - recv_seq[1] - (RING_SIZE - 1));
+		assert(STAT_Q(st, 0)->rx_pkt == STAT_Q(st, 1)->tx_pkt + STAT_Q(st, 1)->drop
+		       + STAT_Q(st, 2)->tx_pkt + sent_big);
+		assert(STAT_Q(st, 0)->rx_pkt == taken_pkt && STAT_Q(st, 0)->rx_byte == taken_byte);
+		stat_print("timeout", st);
+	}
+
+	{
+		unsigned short i;
+		for (i = 0; i < 3; i++) {
+			assert(!rvs_vif_detach(vs, i, vs->port[i].vif));
+			rvif_mem_close(&m[i]);
+		}
+	}
+	assert(!rvs_exit(vs));
+	free(st);
+	free(vs);
+
+	return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <x86intrin.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+#define NUM_PKT (1U << 16) /* frames looked up in turn */
+#define PKT_SIZE (64)
+#define NUM_NH (64)
+
+static struct rvs *vs = NULL;
+static struct rvs_lpm *lpm = NULL;
+static unsigned int *route_addr = NULL;
+static unsigned char *route_depth = NULL;
+static unsigned long num_route = 1000000;
+static _Atomic int running = 0;
+
+static unsigned long xorshift(unsigned long *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* a prefix length of a table like the Internet one: mostly /24, and a few longer ones */
+static unsigned char route_len(unsigned long r)
+{
+	r %= 1000;
+	if (r < 10)
+		return 8 + r % 8;
+	else if (r < 380)
+		return 16 + r % 8;
+	else if (r < 980)
+		return 24;
+	else
+		return 25 + r % 8;
+}
+
+/* deletes and adds back random routes until running is cleared */
+static void *updater_fn(void *data)
+{
+	unsigned long s = 0x5eed, *cnt = (unsigned long *) data;
+	while (!running) ;
+	while (running) {
+		unsigned long i = xorshift(&s) % num_route;
+		if (!rvs_lpm_del(lpm, route_addr[i], route_depth[i])) {
+			assert(!rvs_lpm_add(lpm, route_addr[i], route_depth[i], (unsigned short)(i % NUM_NH)));
+			(*cnt) += 2;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned short batch[] = { 1, 4, 16, 32, 64, 256, }, one_batch = 0;
+	unsigned long num_iter = 64, mem_size;
+	unsigned int num_tbl8 = 1U << 16;
+	int update = 0;
+	char *buf;
+	void *mem;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "b:i:n:t:u")) != -1) {
+			switch (ch) {
+			case 'b':
+				assert(sscanf(optarg, "%hu", &one_batch) == 1);
+				assert(one_batch && one_batch <= RVIF_MAX_SLOT);
+				break;
+			case 'i':
+				assert(sscanf(optarg, "%lu", &num_iter) == 1);
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num_route) == 1);
+				break;
+			case 't':
+				assert(sscanf(optarg, "%u", &num_tbl8) == 1);
+				break;
+			case 'u':
+				update = 1;
+				break;
+			}
+		}
+	}
+
+	assert((vs = aligned_alloc(64, ((rvs_size(1, 1) + 63) / 64) * 64)) != NULL);
+	assert(!rvs_init(vs, 1, 1));
+	assert((lpm = aligned_alloc(64, ((sizeof(struct rvs_lpm) + 63) / 64) * 64)) != NULL);
+	mem_size = rvs_lpm_size(num_tbl8, num_route);
+	assert((mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	assert(!rvs_lpm_setup(lpm, vs, mem, mem_size, num_tbl8));
+	{
+		unsigned short i;
+		for (i = 0; i < NUM_NH; i++) {
+			unsigned char dst[6] = { 0x02, 0, 0, 0, 0x01, (unsigned char) i, }, src[6] = { 0x02, 0, 0, 0, 0x02, (unsigned char) i, };
+			assert(!rvs_lpm_nh_set(lpm, i, i, dst, src));
+		}
+	}
+
+	assert((route_addr = malloc(sizeof(unsigned int) * num_route)) != NULL);
+	assert((route_depth = malloc(num_route)) != NULL);
+	{
+		unsigned long s = 1, i, t, cnt[4] = { 0 };
+		for (i = 0; i < num_route; i++) {
+			route_depth[i] = route_len(xorshift(&s));
+			route_addr[i] = (unsigned int) xorshift(&s) & (0xffffffffU << (32 - route_depth[i]));
+			cnt[route_depth[i] < 16 ? 0 : (route_depth[i] < 24 ? 1 : (route_depth[i] == 24 ? 2 : 3))]++;
+		}
+		t = now_ns();
+		for (i = 0; i < num_route; i++) {
+			if (rvs_lpm_add(lpm, route_addr[i], route_depth[i], (unsigned short)(i % NUM_NH))) {
+				fprintf(stderr, "route %lu: no tbl8 group is left, try larger -t\n", i);
+				exit(1);
+			}
+		}
+		t = now_ns() - t;
+		printf("# %lu routes (%lu /8-/15, %lu /16-/23, %lu /24, %lu /25-/32), %lu unique, %u tbl8 groups, %lu MB\n",
+				num_route, cnt[0], cnt[1], cnt[2], cnt[3], lpm->num_rule, num_tbl8, mem_size >> 20);
+		printf("# insertion: %.3f Mroutes/s\n", (double) num_route * 1000. / t);
+	}
+
+	assert((buf = mmap(NULL, (unsigned long) NUM_PKT * PKT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	{
+		/* IPv4 packets to random addresses */
+		unsigned long s = 2;
+		unsigned int i;
+		for (i = 0; i < NUM_PKT; i++) {
+			unsigned char *p = (unsigned char *) &buf[(unsigned long) i * PKT_SIZE];
+			unsigned int a = (unsigned int) xorshift(&s);
+			p[12] = 0x08;
+			p[14] = 0x45;
+			p[22] = 64;
+			p[23] = 17;
+			p[30] = (unsigned char)(a >> 24);
+			p[31] = (unsigned char)(a >> 16);
+			p[32] = (unsigned char)(a >> 8);
+			p[33] = (unsigned char) a;
+		}
+	}
+
+	printf("batch,update,cycles_per_lookup,mlookups_per_sec,routed,updates_per_sec\n");
+	{
+		int u;
+		for (u = 0; u < (update ? 2 : 1); u++) {
+			unsigned short x;
+			for (x = 0; x < sizeof(batch) / sizeof(batch[0]); x++) {
+				unsigned short b = (one_batch ? one_batch : batch[x]), len[RVIF_MAX_SLOT], dst[RVIF_MAX_SLOT];
+				unsigned long j, k, c = 0, t, routed = 0, num_update = 0;
+				char *pkt[RVIF_MAX_SLOT];
+				pthread_t th;
+				for (k = 0; k < b; k++)
+					len[k] = PKT_SIZE;
+				if (u) {
+					assert(!pthread_create(&th, NULL, updater_fn, &num_update));
+					running = 1;
+				}
+				t = now_ns();
+				for (j = 0; j < num_iter; j++) {
+					for (k = 0; k + b <= NUM_PKT; k += b) {
+						unsigned long c0;
+						unsigned short n;
+						for (n = 0; n < b; n++) {
+							pkt[n] = &buf[(k + n) * PKT_SIZE];
+							pkt[n][22] = 64; /* TTL */
+						}
+						c0 = __rdtsc();
+						rvs_read_begin(vs, 0, 0);
+						rvs_lookup_lpm(vs, RVS_MAX_PORT, 0, pkt, len, b, dst, lpm);
+						rvs_read_end(vs, 0, 0);
+						c += __rdtsc() - c0;
+						for (n = 0; n < b; n++) {
+							if (dst[n] != RVS_PORT_DROP)
+								routed++;
+						}
+					}
+				}
+				t = now_ns() - t;
+				if (u) {
+					running = 0;
+					pthread_join(th, NULL);
+				}
+				{
+					unsigned long num = num_iter * (NUM_PKT / b) * b;
+					printf("%u,%d,%.1f,%.3f,%.3f,%.0f\n", b, u, (double) c / num, (double) num * 1000. / t,
+							(double) routed / num, (double) num_update * 1000000000. / t);
+				}
+				if (one_batch)
+					break;
+			}
+		}
+	}
+
+	munmap(buf, (unsigned long) NUM_PKT * PKT_SIZE);
+	assert(!rvs_lpm_exit(lpm));
+	munmap(mem, mem_size);
+	free(route_depth);
+	free(route_addr);
+	free(lpm);
+	assert(!rvs_exit(vs));
+	free(vs);
+
+	return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvs.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <x86intrin.h>
+
+#include <pthread.h>
+
+int rvs_lock_init(char *lock)
+{
+	return pthread_rwlock_init((pthread_rwlock_t *) lock, NULL);
+}
+
+int rvs_lock_destroy(char *lock)
+{
+	return pthread_rwlock_destroy((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrlock(char *lock)
+{
+	return pthread_rwlock_wrlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_wrunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdlock(char *lock)
+{
+	return pthread_rwlock_rdlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_rdunlock(char *lock)
+{
+	return pthread_rwlock_unlock((pthread_rwlock_t *) lock);
+}
+
+int rvs_notify(struct rvs *vs __attribute__((unused)),
+	       unsigned short vid __attribute__((unused)),
+	       unsigned short qid __attribute__((unused)))
+{
+	return 0;
+}
+
+unsigned long rvs_time_us(void)
+{
+	return 0;
+}
+
+#define BUF_SIZE (2048)
+#define RING_SIZE (1024)
+#define LIST_MAX (16)
+#define SEQ0 (1000) /* the sequence number of the first byte of a frame of the sender */
+#define IP_ID (0x1234)
+
+/* how the TCP payload crosses rvs */
+#define MODE_MTU (0) /* the sender segments and checksums it, as without the offloads */
+#define MODE_GSO (1) /* super-frames to the receiver taking them */
+#define MODE_CSUM (2) /* super-frames segmented by rvs for the receiver taking only the checksum offload */
+#define MODE_SW (3) /* super-frames segmented and checksummed by rvs for the receiver taking no offload */
+#define NUM_MODE (4)
+
+static const char *mode_name[NUM_MODE] = { "mtu", "gso", "csum", "sw", };
+
+static int ip6 = 0;
+static const unsigned char mac_tx[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, };
+static const unsigned char mac_rx[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01, };
+static unsigned char frame_buf[65536];
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)(v >> 8);
+	p[1] = (unsigned char) v;
+}
+
+static unsigned int get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return (get16(p) << 16) | get16(p + 2);
+}
+
+/* the one's complement sum of big-endian 16-bit words, not folded */
+static unsigned int sum16(unsigned int sum, const unsigned char *p, unsigned long len)
+{
+	unsigned long i;
+	for (i = 0; i + 1 < len; i += 2)
+		sum += get16(p + i);
+	if (len % 2)
+		sum += p[len - 1] << 8;
+	return sum;
+}
+
+static unsigned short fold(unsigned int sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (unsigned short) sum;
+}
+
+static unsigned short l3_len(void)
+{
+	return (ip6 ? 40 : 20);
+}
+
+static unsigned short hdr_len(void)
+{
+	return 14 + l3_len() + 20;
+}
+
+/* the sum of the pseudo header of the frame p, whose TCP segment is of len bytes */
+static unsigned int pseudo(const unsigned char *p, unsigned short len)
+{
+	return (ip6 ? sum16(0, p + 22, 32) : sum16(0, p + 26, 8)) + 6 + len;
+}
+
+/*
+ * writes a TCP frame of len bytes, whose payload is the bytes of the sequence
+ * numbers from SEQ0, to p; the TCP checksum is complete, or the sum of the
+ * pseudo header if partial is set
+ */
+static void frame_build(unsigned char *p, unsigned short len, int partial)
+{
+	unsigned char *t = p + 14 + l3_len();
+	unsigned short i;
+	memset(p, 0, hdr_len());
+	memcpy(p, mac_rx, 6);
+	memcpy(p + 6, mac_tx, 6);
+	if (ip6) {
+		put16(p + 12, 0x86dd);
+		p[14] = 0x60;
+		put16(p + 18, len - 54);
+		p[20] = 6;
+		p[21] = 64;
+		p[22] = p[38] = 0xfd; /* fd00::1 to fd00::2 */
+		p[37] = 1;
+		p[53] = 2;
+	} else {
+		put16(p + 12, 0x0800);
+		p[14] = 0x45;
+		put16(p + 16, len - 14);
+		put16(p + 18, IP_ID);
+		p[22] = 64;
+		p[23] = 6;
+		p[26] = p[30] = 10; /* 10.0.0.1 to 10.0.0.2 */
+		p[29] = 1;
+		p[33] = 2;
+		put16(p + 24, ~fold(sum16(0, p + 14, 20)) & 0xffff);
+	}
+	put16(t, 12345);
+	put16(t + 2, 80);
+	put16(t + 4, SEQ0 >> 16);
+	put16(t + 6, SEQ0 & 0xffff);
+	t[11] = 1;
+	t[12] = 5 << 4;
+	t[13] = 0x18; /* PSH and ACK */
+	put16(t + 14, 0xffff);
+	for (i = hdr_len(); i < len; i++)
+		p[i] = (unsigned char)(SEQ0 + (i - hdr_len()));
+	{
+		unsigned short tl = len - 14 - l3_len();
+		unsigned int s = pseudo(p, tl);
+		put16(t + 16, (partial ? fold(s) : ~fold(sum16(s, t, tl)) & 0xffff));
+	}
+}
+
+/*
+ * checks a received frame of len bytes, whose first slot has the flags and
+ * the offload word o, for the mode and the frames of sent bytes of the
+ * sender, and returns the size of its payload
+ */
+static unsigned short frame_check(const unsigned char *p, unsigned short len, unsigned short flags, unsigned int o,
+				  int mode, unsigned short mss, unsigned short sent)
+{
+	const unsigned char *t = p + 14 + l3_len();
+	unsigned short h = hdr_len(), tl = len - 14 - l3_len(), i;
+	unsigned int off = get32(t + 4) - SEQ0; /* of the payload in the frame of the sender */
+	if (mode == MODE_GSO)
+		assert(len == sent && flags == (RVIF_SLOT_F_CSUM | (ip6 ? RVIF_SLOT_F_GSO_TCP6 : RVIF_SLOT_F_GSO_TCP4))
+		       && o == RVIF_OFFLOAD(14 + l3_len(), 16, mss));
+	else if (mode == MODE_CSUM)
+		assert(len <= h + mss && flags == RVIF_SLOT_F_CSUM && o == RVIF_OFFLOAD(14 + l3_len(), 16, 0));
+	else
+		assert(len <= h + mss && !(flags & (RVIF_SLOT_F_CSUM | RVIF_SLOT_F_GSO_TCP4 | RVIF_SLOT_F_GSO_TCP6)));
+	if (flags & RVIF_SLOT_F_CSUM)
+		assert(get16(t + 16) == fold(pseudo(p, tl)));
+	else
+		assert(fold(sum16(pseudo(p, tl), t, tl)) == 0xffff);
+	if (ip6)
+		assert(get16(p + 18) == (unsigned int) len - 54);
+	else
+		assert(get16(p + 16) == (unsigned int) len - 14 && fold(sum16(0, p + 14, 20)) == 0xffff);
+	if (mode == MODE_CSUM || mode == MODE_SW) {
+		/* a segment of the super-frame */
+		assert(off % mss == 0 && off + (len - h) <= (unsigned int) sent - h);
+		assert((t[13] & 0x08) == (off + (len - h) == (unsigned int) sent - h ? 0x08 : 0));
+		if (!ip6)
+			assert(get16(p + 18) == IP_ID + off / mss);
+	}
+	for (i = h; i < len; i++)
+		assert(p[i] == (unsigned char)(SEQ0 + off + (i - h)));
+	return len - h;
+}
+
+static struct rvif *vif_alloc(struct rvif_mem *m, unsigned short num_slot, unsigned int flags)
+{
+	struct rvif_layout l = {
+		.ver = RVIF_VERSION_3,
+		.num_queue = 1,
+		.num_slot = num_slot,
+		.buf_size = BUF_SIZE,
+	};
+	struct rvif *vif;
+	rvif_layout(&l, 0);
+	m->page_size = 0x1000;
+	m->size = l.size;
+	assert((m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	vif = (struct rvif *) m->mem;
+	rvif_format(vif, &l);
+	((struct rvif3 *) vif)->flags = flags;
+	vif->num = 1;
+	return vif;
+}
+
+/*
+ * takes the frames of the RX ring, checks them if check is set, and returns
+ * the bytes of the payload received
+ */
+static unsigned long drain(struct rvif_ring *rx, int check, int mode, unsigned short mss, unsigned short sent)
+{
+	unsigned long payload = 0;
+	unsigned short a = rvif_ring_peek(rx, 1), i = 0;
+	while (i < a) {
+		unsigned short s = rvif_ring_slot(rx, i), len = 0;
+		unsigned short flags = RVIF_SLOT_FLAGS(rx->vif, rx->ver, 0, 0, s) & ~RVIF_SLOT_F_MORE;
+		unsigned int o = RVIF_SLOT_OFFLOAD(rx->vif, rx->ver, 0, 0, s);
+		while (1) {
+			unsigned short l = RVIF_SLOT(rx->vif, rx->ver, 0, 0, s, len);
+			if (check)
+				memcpy(frame_buf + len, rvif_ring_buf(rx, s), l);
+			len += l;
+			i++;
+			if (!RVIF_SLOT_MORE(rx->vif, rx->ver, 0, 0, s))
+				break;
+			assert(i < a);
+			s = rvif_ring_slot(rx, i);
+		}
+		payload += (check ? frame_check(frame_buf, len, flags, o, mode, mss, sent) : (unsigned long)(len - hdr_len()));
+	}
+	if (a)
+		rvif_ring_release(rx, a);
+	return payload;
+}
+
+static void run(int mode, unsigned short len, unsigned short mss, unsigned long num)
+{
+	struct rvs *vs;
+	struct rvif_mem m[2];
+	struct rvif_ring tx, rx;
+	unsigned short h = hdr_len(), f_len = (mode == MODE_MTU ? h + mss : len); /* of a frame of the sender */
+	unsigned short f_slot = (f_len + BUF_SIZE - 1) / BUF_SIZE, num_slot = (RING_SIZE / f_slot) * f_slot, win;
+	unsigned long payload = 0, frames = 0, cycles = 0;
+
+	assert((vs = aligned_alloc(64, ((rvs_size(2, 1) + 63) / 64) * 64)) != NULL);
+	assert(!rvs_init(vs, 2, 1));
+	assert(!rvs_vif_attach(vs, 0, vif_alloc(&m[0], num_slot, (mode == MODE_MTU ? 0 : RVIF_F_CSUM | RVIF_F_GSO))));
+	assert(!rvs_vif_attach(vs, 1, vif_alloc(&m[1], RING_SIZE, (mode == MODE_GSO ? RVIF_F_CSUM | RVIF_F_GSO
+									    : (mode == MODE_CSUM ? RVIF_F_CSUM : 0)))));
+	rvif_ring_init(&tx, vs->port[0].vif, RVIF_VERSION_3, 0, 1);
+	rvif_ring_init(&rx, vs->port[1].vif, RVIF_VERSION_3, 0, 0);
+	{
+		/* the receiver sends a frame so that its address is learned */
+		struct rvif_ring t, r;
+		unsigned char *p;
+		rvif_ring_init(&t, vs->port[1].vif, RVIF_VERSION_3, 0, 1);
+		rvif_ring_init(&r, vs->port[0].vif, RVIF_VERSION_3, 0, 0);
+		assert(rvif_ring_reserve(&t, 1));
+		p = (unsigned char *) rvif_ring_buf(&t, rvif_ring_slot(&t, 0));
+		memset(p, 0xff, 6);
+		memcpy(p + 6, mac_rx, 6);
+		RVIF_SLOT(t.vif, t.ver, 0, 1, rvif_ring_slot(&t, 0), len) = 64;
+		rvif_ring_commit(&t, 1);
+		assert(rvs_fwd(vs, 1, 0, 1) == 1);
+		assert(rvif_ring_peek(&r, 1) == 1);
+		rvif_ring_release(&r, 1);
+	}
+	{
+		/* the TX slots have the frames, which are sent again and again */
+		unsigned short s;
+		frame_build(frame_buf, f_len, mode != MODE_MTU);
+		for (s = 0; s < num_slot; s += f_slot) {
+			unsigned short k;
+			for (k = 0; k < f_slot; k++) {
+				unsigned short l = (k + 1 < f_slot ? BUF_SIZE : f_len - k * BUF_SIZE);
+				memcpy(rvif_ring_buf(&tx, s + k), frame_buf + k * BUF_SIZE, l);
+				RVIF_SLOT(tx.vif, tx.ver, 0, 1, s + k, len) = l;
+				((struct rvif3 *) tx.vif)->queue[0].ring[1].slot[s + k].flags = (k + 1 < f_slot ? RVIF_SLOT_F_MORE : 0);
+			}
+			if (mode != MODE_MTU)
+				rvif_ring_offload(&tx, s, RVIF_SLOT_F_CSUM | (ip6 ? RVIF_SLOT_F_GSO_TCP6 : RVIF_SLOT_F_GSO_TCP4),
+						  RVIF_OFFLOAD(14 + l3_len(), 16, mss));
+		}
+	}
+	{
+		/* the frames of a call fit in the RX ring */
+		unsigned short out = f_slot;
+		if (mode == MODE_CSUM || mode == MODE_SW)
+			out = ((len - h + mss - 1) / mss) * ((h + mss + BUF_SIZE - 1) / BUF_SIZE);
+		win = num_slot / f_slot - 1;
+		if (win > (RING_SIZE - 1) / out)
+			win = (RING_SIZE - 1) / out;
+		assert(win);
+	}
+	{
+		int pass;
+		for (pass = 0; pass < 3; pass++) { /* the check, the warm-up, and the measurement */
+			unsigned long p = 0, n = (pass == 0 ? 1 : (pass == 1 ? num / 8 : num)) * (len - h);
+			while (p < n) {
+				unsigned short c = rvif_ring_reserve(&tx, num_slot) / f_slot, r;
+				if (c > win)
+					c = win;
+				if (c)
+					rvif_ring_commit(&tx, c * f_slot);
+				{
+					unsigned long t0 = __rdtsc();
+					r = rvs_fwd(vs, 0, 0, win);
+					cycles += (pass == 2 ? __rdtsc() - t0 : 0);
+				}
+				p += drain(&rx, !pass, mode, mss, f_len);
+				if (pass == 2)
+					frames += r;
+			}
+			if (pass == 2)
+				payload = p;
+		}
+	}
+	printf("%s,%u,%u,%u,%lu,%.1f,%.1f\n", mode_name[mode], (ip6 ? 6 : 4), len, mss, frames,
+			(double) cycles / frames, (double) cycles / ((double) payload / 1024));
+	fflush(stdout);
+	assert(!rvs_vif_detach(vs, 0, vs->port[0].vif));
+	assert(!rvs_vif_detach(vs, 1, vs->port[1].vif));
+	rvif_mem_close(&m[0]);
+	rvif_mem_close(&m[1]);
+	assert(!rvs_exit(vs));
+	free(vs);
+}
+
+/* parses a comma-separated list of numbers */
+static unsigned short list_parse(const char *arg, unsigned int *list)
+{
+	unsigned short num = 0;
+	while (1) {
+		int n;
+		assert(num < LIST_MAX);
+		assert(sscanf(arg, "%u%n", &list[num++], &n) == 1);
+		if (arg[n] != ',')
+			break;
+		arg += n + 1;
+	}
+	return num;
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned int len[LIST_MAX] = { 16384, 65534, }, mss[LIST_MAX] = { 1448, 8948, };
+	unsigned short num_len = 2, num_mss = 2, modes = (1U << NUM_MODE) - 1;
+	unsigned long num = 100000;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "6l:m:n:s:")) != -1) {
+			switch (ch) {
+			case '6':
+				ip6 = 1;
+				break;
+			case 'l':
+				num_len = list_parse(optarg, len);
+				break;
+			case 'm':
+				{
+					char *a = strdup(optarg), *t;
+					assert(a);
+					modes = 0;
+					for (t = strtok(a, ","); t; t = strtok(NULL, ",")) {
+						unsigned short i;
+						for (i = 0; i < NUM_MODE && strcmp(t, mode_name[i]); i++)
+							;
+						assert(i < NUM_MODE);
+						modes |= 1U << i;
+					}
+					free(a);
+				}
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num) == 1);
+				break;
+			case 's':
+				num_mss = list_parse(optarg, mss);
+				break;
+			}
+		}
+	}
+
+	printf("# the payload of %lu super-frames for each, IPv%u\n", num, (ip6 ? 6 : 4));
+	printf("mode,ip,len,mss,frames,cycles_per_frame,cycles_per_kb\n");
+	{
+		unsigned short a, b;
+		int mode;
+		for (a = 0; a < num_len; a++)
+			for (b = 0; b < num_mss; b++)
+				for (mode = 0; mode < NUM_MODE; mode++) {
+					if (!(modes & (1U << mode)))
+						continue;
+					assert(mss[b] && hdr_len() < len[a] && len[a] <= RVS_GSO_FRAME_MAX);
+					run(mode, (unsigned short) len[a], (unsigned short) mss[b], num);
+				}
+	}
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <rvif.h>
+#include <rvif_ring.h>
+#include <rvif_mem.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <x86intrin.h>
+
+#define BUF_SIZE (2048)
+#define LIST_MAX (16)
+
+static unsigned int ver = RVIF_VERSION_2;
+
+/*
+ * enqueues bursts to the TX ring and dequeues them from the RX ring of an
+ * rvif in anonymous memory; rvs is emulated by advancing head of the TX ring
+ * to its tail, and head of the RX ring by the slots enqueued
+ */
+static void run(unsigned short num_slot, unsigned short burst, unsigned short len, unsigned long num)
+{
+	struct rvif_layout l = {
+		.ver = ver,
+		.num_queue = 1,
+		.num_slot = num_slot,
+		.buf_size = BUF_SIZE,
+	};
+	struct rvif *vif;
+	struct rvif_ring tx, rx;
+	char *src, *dst;
+	const void *pkt[RVIF_MAX_SLOT];
+	void *buf[RVIF_MAX_SLOT];
+	unsigned short pkt_len[RVIF_MAX_SLOT], buf_len[RVIF_MAX_SLOT];
+	unsigned long enq = 0, deq = 0, cnt = 0;
+
+	rvif_layout(&l, 0);
+	assert((vif = mmap(NULL, l.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+	rvif_format(vif, &l);
+	{
+		unsigned short k;
+		for (k = 0; k < num_slot; k++)
+			RVIF_SLOT(vif, ver, 0, 0, k, len) = len;
+	}
+	vif->num = 1;
+	assert((src = aligned_alloc(64, BUF_SIZE)) != NULL && (dst = aligned_alloc(64, (unsigned long) BUF_SIZE * burst)) != NULL);
+	memset(src, 'A', BUF_SIZE);
+	{
+		unsigned short i;
+		for (i = 0; i < burst; i++) {
+			pkt[i] = src;
+			pkt_len[i] = len;
+			buf[i] = dst + (unsigned long) BUF_SIZE * i;
+		}
+	}
+	rvif_ring_init(&tx, vif, ver, 0, 1);
+	rvif_ring_init(&rx, vif, ver, 0, 0);
+	{
+		int warm;
+		for (warm = 1; warm >= 0; warm--) {
+			unsigned long n = 0;
+			while (n < (warm ? num / 8 : num)) {
+				unsigned short e, d;
+				unsigned long t0, t1, t2, t3;
+				t0 = __rdtsc();
+				e = rvif_ring_enqueue_burst(&tx, pkt, pkt_len, burst);
+				t1 = __rdtsc();
+				rvif_idx_store(&RVIF_RING(vif, ver, 0, 1, head), RVIF_RING(vif, ver, 0, 1, tail));
+				rvif_idx_store(&RVIF_RING(vif, ver, 0, 0, head), rvif_ring_next(&rx, RVIF_RING(vif, ver, 0, 0, head), e));
+				t2 = __rdtsc();
+				d = rvif_ring_dequeue_burst(&rx, buf, buf_len, burst);
+				t3 = __rdtsc();
+				assert(e == d && e);
+				if (!warm) {
+					enq += t1 - t0;
+					deq += t3 - t2;
+					cnt += e;
+				}
+				n += e;
+			}
+		}
+	}
+	printf("%u,%u,%u,%u,%lu,%.1f,%.1f\n", ver, num_slot, burst, len, cnt, (double) enq / cnt, (double) deq / cnt);
+	fflush(stdout);
+	free(dst);
+	free(src);
+	munmap(vif, l.size);
+}
+
+/* parses a comma-separated list of numbers */
+static unsigned short list_parse(const char *arg, unsigned int *list)
+{
+	unsigned short num = 0;
+	while (1) {
+		int n;
+		assert(num < LIST_MAX);
+		assert(sscanf(arg, "%u%n", &list[num++], &n) == 1);
+		if (arg[n] != ',')
+			break;
+		arg += n + 1;
+	}
+	return num;
+}
+
+int main(int argc, char *const *argv)
+{
+	unsigned int ring[LIST_MAX] = { 256, 255, 1024, 1000, }, burst[LIST_MAX] = { 1, 32, 128, }, len[LIST_MAX] = { 64, 1514, };
+	unsigned short num_ring = 4, num_burst = 3, num_len = 2;
+	unsigned long num = 10000000;
+
+	{
+		int ch;
+		while ((ch = getopt(argc, argv, "b:l:n:r:v:")) != -1) {
+			switch (ch) {
+			case 'b':
+				num_burst = list_parse(optarg, burst);
+				break;
+			case 'l':
+				num_len = list_parse(optarg, len);
+				break;
+			case 'n':
+				assert(sscanf(optarg, "%lu", &num) == 1);
+				break;
+			case 'r':
+				num_ring = list_parse(optarg, ring);
+				break;
+			case 'v':
+				assert(sscanf(optarg, "%u", &ver) == 1);
+				assert(ver == RVIF_VERSION_1 || ver == RVIF_VERSION_2 || ver == RVIF_VERSION_3);
+				break;
+			}
+		}
+	}
+
+	printf("# %lu slots for each\n", num);
+	printf("version,slots,burst,len,measured,enqueue_cycles_per_slot,dequeue_cycles_per_slot\n");
+	{
+		unsigned short a, b, c;
+		for (a = 0; a < num_ring; a++)
+			for (b = 0; b < num_burst; b++)
+				for (c = 0; c < num_len; c++) {
+					assert(2 <= ring[a] && ring[a] <= RVIF_MAX_SLOT);
+					assert(burst[b] && burst[b] < ring[a]);
+					assert(len[c] && len[c] <= BUF_SIZE);
+					run((unsigned short) ring[a], (unsigned short) burst[b], (unsigned short) len[c], num);
+				}
+	}
+
+	return 0;
+}
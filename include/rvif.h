@@ -22,23 +22,218 @@
 #define RVIF_MAX_QUEUE (128)
 #define RVIF_MAX_SLOT (1024)
 
+#define RVIF_MAGIC (0x66697672) /* "rvif" in little endian */
+#define RVIF_VERSION_1 (1)
+#define RVIF_VERSION_2 (2)
+#define RVIF_VERSION_3 (3)
+
+#define RVIF_CACHE_LINE (64)
+
+/*
+ * the first 8 bytes of an rvif; rvifs made before the versioning have
+ * zero there, and they are regarded as version 1
+ */
+struct rvif_hdr {
+	unsigned int magic;
+	unsigned int version;
+};
+
+struct rvif_slot {
+	unsigned long flags;
+	unsigned long off;
+	unsigned short len;
+};
+
+/* version 1 */
 struct rvif {
 	unsigned long flags;
 	unsigned int num;
 	struct {
 		unsigned long flags;
 		struct {
-			unsigned long flags;
+			unsigned int flags;
+			unsigned int event;
 			unsigned short num;
 			unsigned short head;
 			unsigned short tail;
-			struct {
-				unsigned long flags;
-				unsigned long off;
-				unsigned short len;
-			} slot[RVIF_MAX_SLOT];
+			struct rvif_slot slot[RVIF_MAX_SLOT];
 		} ring[2];
 	} queue[RVIF_MAX_QUEUE];
 };
 
+/*
+ * version 2 puts head, which is written by rvs, and tail, which is
+ * written by the process/system, on different cache lines; num is
+ * at the same offset as version 1
+ */
+struct rvif2_ring {
+	unsigned int flags;
+	unsigned int event;
+	unsigned short num;
+	char pad0[RVIF_CACHE_LINE - 10];
+	unsigned short head;
+	char pad1[RVIF_CACHE_LINE - 2];
+	unsigned short tail;
+	char pad2[RVIF_CACHE_LINE - 2];
+	struct rvif_slot slot[RVIF_MAX_SLOT];
+};
+
+struct rvif2 {
+	struct rvif_hdr hdr;
+	unsigned int num;
+	unsigned int flags;
+	char pad[RVIF_CACHE_LINE - 16];
+	struct {
+		struct rvif2_ring ring[2];
+	} queue[RVIF_MAX_QUEUE];
+};
+
+/*
+ * version 3 has the same ring layout as version 2 with 16-byte slots,
+ * and the size of the buffer of a slot is specified by buf_size, which
+ * is a multiple of 64; a frame larger than a buffer is put on successive
+ * slots, each of which, except the last one, has RVIF_SLOT_F_MORE
+ */
+#define RVIF_SLOT_F_MORE (1U << 0)
+
+/*
+ * an RX slot has RVIF_SLOT_F_HASH in flags when rvs has put the flow hash of
+ * the frame, with which it has selected the RX queue, in hash of the slot of
+ * version 3, or in the upper 32 bits of flags of version 1 and 2
+ */
+#define RVIF_SLOT_F_HASH (1U << 1)
+
+/*
+ * the offloads of virtio-net in the first slot of a frame; RVIF_SLOT_F_CSUM
+ * means the checksum over the frame from csum_start to the end is to be put
+ * at csum_start + csum_off, where the sum of the pseudo header has been put,
+ * and RVIF_SLOT_F_GSO_TCP4 or RVIF_SLOT_F_GSO_TCP6, which comes with
+ * RVIF_SLOT_F_CSUM, means the TCP super-frame is to be split into segments
+ * of mss bytes of payload; the parameters are in the offload word, which
+ * takes the place of the flow hash, thus, a slot having RVIF_SLOT_F_CSUM
+ * does not have RVIF_SLOT_F_HASH
+ */
+#define RVIF_SLOT_F_CSUM (1U << 2)
+#define RVIF_SLOT_F_GSO_TCP4 (1U << 3)
+#define RVIF_SLOT_F_GSO_TCP6 (1U << 4)
+
+#define RVIF_OFFLOAD(_csum_start, _csum_off, _mss) \
+	(((unsigned int)(_csum_start) & 0x3ff) | (((unsigned int)(_csum_off) & 0x3f) << 10) | ((unsigned int)(_mss) << 16))
+#define RVIF_OFFLOAD_CSUM_START(_o) ((_o) & 0x3ff)
+#define RVIF_OFFLOAD_CSUM_OFF(_o) (((_o) >> 10) & 0x3f)
+#define RVIF_OFFLOAD_MSS(_o) ((_o) >> 16)
+
+/*
+ * flags of an rvif of version 2 and 3; with RVIF_F_CSUM, the process/system
+ * puts RVIF_SLOT_F_CSUM in the TX slots, and takes it in the RX slots, and
+ * RVIF_F_GSO, which needs RVIF_F_CSUM and version 3, does the same for the
+ * TCP super-frames; rvs ignores the offload flags of the TX slots of an rvif
+ * not having them, and does the offloads for an rvif not having them
+ */
+#define RVIF_F_CSUM (1U << 0)
+#define RVIF_F_GSO (1U << 1)
+
+struct rvif3_slot {
+	unsigned long off;
+	unsigned short len;
+	unsigned short flags;
+	unsigned int hash;
+};
+
+struct rvif3_ring {
+	unsigned int flags;
+	unsigned int event;
+	unsigned short num;
+	char pad0[RVIF_CACHE_LINE - 10];
+	unsigned short head;
+	char pad1[RVIF_CACHE_LINE - 2];
+	unsigned short tail;
+	char pad2[RVIF_CACHE_LINE - 2];
+	struct rvif3_slot slot[RVIF_MAX_SLOT];
+};
+
+struct rvif3 {
+	struct rvif_hdr hdr;
+	unsigned int num;
+	unsigned int flags;
+	unsigned int buf_size;
+	char pad[RVIF_CACHE_LINE - 20];
+	struct {
+		struct rvif3_ring ring[2];
+	} queue[RVIF_MAX_QUEUE];
+};
+
+#define RVIF_VERSION(_vif) \
+	(((struct rvif_hdr *)(_vif))->magic == RVIF_MAGIC ? ((struct rvif_hdr *)(_vif))->version : RVIF_VERSION_1)
+
+/* a field of a ring of the rvif of the version, except the slots, as an lvalue */
+#define RVIF_RING(_vif, _ver, _qid, _r, _field) \
+	(*((_ver) == RVIF_VERSION_3 \
+	   ? &((struct rvif3 *)(_vif))->queue[_qid].ring[_r]._field \
+	   : ((_ver) == RVIF_VERSION_2 \
+	      ? &((struct rvif2 *)(_vif))->queue[_qid].ring[_r]._field \
+	      : &((struct rvif *)(_vif))->queue[_qid].ring[_r]._field)))
+
+/* off or len of a slot, as an lvalue */
+#define RVIF_SLOT(_vif, _ver, _qid, _r, _s, _field) \
+	(*((_ver) == RVIF_VERSION_3 \
+	   ? &((struct rvif3 *)(_vif))->queue[_qid].ring[_r].slot[_s]._field \
+	   : ((_ver) == RVIF_VERSION_2 \
+	      ? &((struct rvif2 *)(_vif))->queue[_qid].ring[_r].slot[_s]._field \
+	      : &((struct rvif *)(_vif))->queue[_qid].ring[_r].slot[_s]._field)))
+
+/* whether the frame continues to the next slot; only version 3 has multi-slot frames */
+#define RVIF_SLOT_MORE(_vif, _ver, _qid, _r, _s) \
+	((_ver) == RVIF_VERSION_3 && (((struct rvif3 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & RVIF_SLOT_F_MORE))
+
+/* whether the slot has the flow hash of the frame, and the flow hash */
+#define RVIF_SLOT_HAS_HASH(_vif, _ver, _qid, _r, _s) \
+	((_ver) == RVIF_VERSION_3 \
+	 ? (((struct rvif3 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & RVIF_SLOT_F_HASH) \
+	 : ((_ver) == RVIF_VERSION_2 \
+	    ? (((struct rvif2 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & RVIF_SLOT_F_HASH) \
+	    : (((struct rvif *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & RVIF_SLOT_F_HASH)))
+
+#define RVIF_SLOT_HASH(_vif, _ver, _qid, _r, _s) \
+	((_ver) == RVIF_VERSION_3 \
+	 ? ((struct rvif3 *)(_vif))->queue[_qid].ring[_r].slot[_s].hash \
+	 : ((_ver) == RVIF_VERSION_2 \
+	    ? (unsigned int)(((struct rvif2 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags >> 32) \
+	    : (unsigned int)(((struct rvif *)(_vif))->queue[_qid].ring[_r].slot[_s].flags >> 32)))
+
+/* the flags of a slot, without the upper 32 bits of version 1 and 2 */
+#define RVIF_SLOT_FLAGS(_vif, _ver, _qid, _r, _s) \
+	((_ver) == RVIF_VERSION_3 \
+	 ? ((struct rvif3 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags \
+	 : ((_ver) == RVIF_VERSION_2 \
+	    ? (unsigned short)(((struct rvif2 *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & 0xffff) \
+	    : (unsigned short)(((struct rvif *)(_vif))->queue[_qid].ring[_r].slot[_s].flags & 0xffff)))
+
+/* the offload word of a slot having RVIF_SLOT_F_CSUM, at the place of the flow hash */
+#define RVIF_SLOT_OFFLOAD(_vif, _ver, _qid, _r, _s) RVIF_SLOT_HASH(_vif, _ver, _qid, _r, _s)
+
+#define RVIF_SIZE(_ver) \
+	((_ver) == RVIF_VERSION_3 ? sizeof(struct rvif3) : ((_ver) == RVIF_VERSION_2 ? sizeof(struct rvif2) : sizeof(struct rvif)))
+
+/* version 3 is smaller than version 2 */
+#define RVIF_SIZE_MAX \
+	(sizeof(struct rvif2) > sizeof(struct rvif) ? sizeof(struct rvif2) : sizeof(struct rvif))
+
+/*
+ * ring.event is the wakeup request of the consumer of the ring;
+ * the consumer sets it to RVIF_EVENT_WAIT before it sleeps on the
+ * word (e.g., by FUTEX_WAIT), and the producer, after updating the
+ * index, resets it to RVIF_EVENT_NONE and wakes the consumer up
+ */
+#define RVIF_EVENT_NONE (0)
+#define RVIF_EVENT_WAIT (1)
+
+/*
+ * a pool file hosts multiple rvifs, each of which occupies
+ * RVIF_POOL_VIF_SIZE bytes, enough for any version, from
+ * the top of the file, and the rest of the file is the buffer
+ * area shared among them
+ */
+#define RVIF_POOL_VIF_SIZE (((RVIF_SIZE_MAX / 0x1000) + 1) * 0x1000)
+
 #endif
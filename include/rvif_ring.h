@@ -0,0 +1,209 @@
+/*
+ *
+ * Copyright 2023 Kenichi Yasukata
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef _RVIF_RING_H
+#define _RVIF_RING_H
+
+#include <rvif.h>
+
+/*
+ * the rings of an rvif for the process/system side, which produces the
+ * slots of the TX ring and consumes those of the RX ring by tail, while
+ * rvs does the opposite by head
+ */
+
+/*
+ * the index of the other side is loaded with acquire, and ours is stored
+ * with release, so that the slots are visible before the index on any CPU;
+ * RVIF_RING_NO_ATOMIC replaces them with volatile accesses and compiler
+ * barriers for a compiler without the __atomic builtins, which is correct
+ * only on a CPU with total store ordering such as x86
+ */
+static __inline__ unsigned short rvif_idx_load(const unsigned short *p)
+{
+#if !defined(RVIF_RING_NO_ATOMIC)
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+	unsigned short v = *((const volatile unsigned short *) p);
+	__asm__ volatile ("" ::: "memory");
+	return v;
+#endif
+}
+
+static __inline__ void rvif_idx_store(unsigned short *p, unsigned short v)
+{
+#if !defined(RVIF_RING_NO_ATOMIC)
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+	__asm__ volatile ("" ::: "memory");
+	*((volatile unsigned short *) p) = v;
+#endif
+}
+
+/* a ring of a queue of an rvif, used by a single thread */
+struct rvif_ring {
+	void *vif;
+	unsigned int ver;
+	unsigned short qid;
+	unsigned short r; /* 0 for RX, 1 for TX */
+	unsigned short num;
+	unsigned short mask; /* num - 1 if num is a power of two, otherwise 0 */
+	unsigned short tail; /* ours, the slots before it are committed or released */
+	unsigned short head; /* the cached one of rvs */
+};
+
+static __inline__ void rvif_ring_init(struct rvif_ring *rg, void *vif, unsigned int ver, unsigned short qid, unsigned short r)
+{
+	rg->vif = vif;
+	rg->ver = ver;
+	rg->qid = qid;
+	rg->r = r;
+	rg->num = RVIF_RING(vif, ver, qid, r, num);
+	rg->mask = (rg->num & (rg->num - 1) ? 0 : (unsigned short)(rg->num - 1));
+	rg->tail = RVIF_RING(vif, ver, qid, r, tail);
+	rg->head = rvif_idx_load(&RVIF_RING(vif, ver, qid, r, head));
+}
+
+/* the slot n slots after slot s, n < num */
+static __inline__ unsigned short rvif_ring_next(const struct rvif_ring *rg, unsigned short s, unsigned short n)
+{
+	if (rg->mask)
+		return (unsigned short)((s + n) & rg->mask);
+	return (unsigned short)(s + n < rg->num ? s + n : s + n - rg->num);
+}
+
+/* the slots from a to b */
+static __inline__ unsigned short rvif_ring_dist(const struct rvif_ring *rg, unsigned short a, unsigned short b)
+{
+	if (rg->mask)
+		return (unsigned short)((b - a) & rg->mask);
+	return (unsigned short)(a <= b ? b - a : b + rg->num - a);
+}
+
+/* the i-th slot from tail, which a reserve or a peek has returned */
+static __inline__ unsigned short rvif_ring_slot(const struct rvif_ring *rg, unsigned short i)
+{
+	return rvif_ring_next(rg, rg->tail, i);
+}
+
+static __inline__ char *rvif_ring_buf(const struct rvif_ring *rg, unsigned short s)
+{
+	return (char *)((unsigned long) rg->vif + RVIF_SLOT(rg->vif, rg->ver, rg->qid, rg->r, s, off));
+}
+
+/*
+ * the producer of the TX ring; returns the free slots from tail, and head
+ * of rvs is read again only when the cached one leaves fewer than n
+ */
+static __inline__ unsigned short rvif_ring_reserve(struct rvif_ring *rg, unsigned short n)
+{
+	unsigned short f = (unsigned short)(rg->num - 1 - rvif_ring_dist(rg, rg->head, rg->tail));
+	if (f < n) {
+		rg->head = rvif_idx_load(&RVIF_RING(rg->vif, rg->ver, rg->qid, rg->r, head));
+		f = (unsigned short)(rg->num - 1 - rvif_ring_dist(rg, rg->head, rg->tail));
+	}
+	return f;
+}
+
+/* passes the n slots from tail, which have been written, to rvs */
+static __inline__ void rvif_ring_commit(struct rvif_ring *rg, unsigned short n)
+{
+	rg->tail = rvif_ring_next(rg, rg->tail, n);
+	rvif_idx_store(&RVIF_RING(rg->vif, rg->ver, rg->qid, rg->r, tail), rg->tail);
+}
+
+/*
+ * the consumer of the RX ring; returns the filled slots from tail, and head
+ * of rvs is read again only when the cached one leaves fewer than n
+ */
+static __inline__ unsigned short rvif_ring_peek(struct rvif_ring *rg, unsigned short n)
+{
+	unsigned short a = rvif_ring_dist(rg, rg->tail, rg->head);
+	if (a < n) {
+		rg->head = rvif_idx_load(&RVIF_RING(rg->vif, rg->ver, rg->qid, rg->r, head));
+		a = rvif_ring_dist(rg, rg->tail, rg->head);
+	}
+	return a;
+}
+
+/* returns the n slots from tail, which have been read, to rvs */
+static __inline__ void rvif_ring_release(struct rvif_ring *rg, unsigned short n)
+{
+	rvif_ring_commit(rg, n);
+}
+
+/*
+ * puts the offload flags and the offload word in TX slot s, the first one of
+ * a frame, for an rvif having RVIF_F_CSUM; RVIF_SLOT_F_MORE is kept
+ */
+static __inline__ void rvif_ring_offload(struct rvif_ring *rg, unsigned short s, unsigned short flags, unsigned int o)
+{
+	if (rg->ver == RVIF_VERSION_3) {
+		struct rvif3_slot *x = &((struct rvif3 *) rg->vif)->queue[rg->qid].ring[rg->r].slot[s];
+		x->flags = (unsigned short)((x->flags & RVIF_SLOT_F_MORE) | flags);
+		x->hash = o;
+	} else if (rg->ver == RVIF_VERSION_2)
+		((struct rvif2 *) rg->vif)->queue[rg->qid].ring[rg->r].slot[s].flags = ((unsigned long) o << 32) | flags;
+}
+
+/*
+ * copies up to n frames, each of which fits in the buffer of a slot, to the
+ * TX ring, and commits them; returns the number of the frames copied
+ */
+static __inline__ unsigned short rvif_ring_enqueue_burst(struct rvif_ring *rg, const void *const *pkt,
+							 const unsigned short *len, unsigned short n)
+{
+	unsigned short i, s = rg->tail, f = rvif_ring_reserve(rg, n);
+	if (n > f)
+		n = f;
+	for (i = 0; i < n; i++) {
+		__builtin_memcpy(rvif_ring_buf(rg, s), pkt[i], len[i]);
+		RVIF_SLOT(rg->vif, rg->ver, rg->qid, rg->r, s, len) = len[i];
+		if (rg->ver == RVIF_VERSION_3)
+			((struct rvif3 *) rg->vif)->queue[rg->qid].ring[rg->r].slot[s].flags = 0;
+		else if (rg->ver == RVIF_VERSION_2) /* a slot may have had the offload flags */
+			((struct rvif2 *) rg->vif)->queue[rg->qid].ring[rg->r].slot[s].flags = 0;
+		s = rvif_ring_next(rg, s, 1);
+	}
+	if (n)
+		rvif_ring_commit(rg, n);
+	return n;
+}
+
+/*
+ * copies up to n slots of the RX ring to buf, whose lengths are put in len,
+ * and releases them; returns the number of the slots copied, and a frame of
+ * multiple slots of version 3 is counted for each slot
+ */
+static __inline__ unsigned short rvif_ring_dequeue_burst(struct rvif_ring *rg, void *const *buf,
+							 unsigned short *len, unsigned short n)
+{
+	unsigned short i, s = rg->tail, a = rvif_ring_peek(rg, n);
+	if (n > a)
+		n = a;
+	for (i = 0; i < n; i++) {
+		len[i] = RVIF_SLOT(rg->vif, rg->ver, rg->qid, rg->r, s, len);
+		__builtin_memcpy(buf[i], rvif_ring_buf(rg, s), len[i]);
+		s = rvif_ring_next(rg, s, 1);
+	}
+	if (n)
+		rvif_ring_release(rg, n);
+	return n;
+}
+
+#endif
@@ -21,31 +21,250 @@
 
 #include <rvif.h>
 
-#define RVS_NUM_HASH_ENT (1024)
 #define RVS_MAX_PORT (256)
 #define RVS_LOCK_BUF_SIZE (256)
+#define RVS_BUF_SIZE (2048) /* of rvif version 1 and 2 */
+#define RVS_FRAME_MAX (9216)
+#define RVS_GSO_FRAME_MAX (65534) /* of a TCP super-frame; the stage 1 gives 65535 to a frame to be dropped */
+#define RVS_PREFETCH_DIST (8)
+#define RVS_BATCH_MAX (256) /* the frames rvs_fwd() takes at once, which sizes its state on the stack */
 
+#define RVS_COPY_SCALAR (0)
+#define RVS_COPY_SSE2 (1)
+#define RVS_COPY_AVX2 (2)
+#define RVS_COPY_AVX512 (3)
+#define RVS_COPY_NUM (4)
+
+#define RVS_MIRROR_INGRESS (1U << 0) /* frames received from the port */
+#define RVS_MIRROR_EGRESS (1U << 1) /* frames sent to the port */
+
+#define RVS_PORT_FLOOD (RVS_MAX_PORT) /* a lookup result, the frame goes to all the ports */
+#define RVS_PORT_DROP (RVS_MAX_PORT + 1) /* a lookup result, the frame is dropped */
+
+#define RVS_RSS_NONE (0) /* the RX queue of the index of the TX queue modulo the number of the RX queues */
+#define RVS_RSS_TOEPLITZ (1)
+#define RVS_RSS_CRC32 (2) /* CRC32C, by the crc32 instruction of SSE4.2 if available */
+#define RVS_RSS_KEY_LEN (40)
+#define RVS_RSS_IN_LEN (36) /* the longest input of the flow hash, the addresses and the ports of IPv6 */
+
+#define RVS_LPM_NUM_NH (1024)
+#define RVS_LPM_TBL24_SIZE ((1UL << 24) * sizeof(unsigned int))
+
+#define RVS_FT_WAY (6)
+#define RVS_FT_NUM_BUCKET (1024)
+#define RVS_FT_AGE (300)
+
+struct rvs_ft_bucket {
+	unsigned short epoch[RVS_FT_WAY];
+	unsigned int pad;
+	unsigned long ent[RVS_FT_WAY];
+};
+
+/*
+ * the counters of a caller of rvs_fwd_stat(); rx is for the frames
+ * received from a port, and tx is for the frames sent to a port
+ *
+ * the counters of an rvs instance made by rvs_init(vs, max_port,
+ * max_queue) take RVS_STAT_SIZE(max_port, max_queue) bytes, which are
+ * max_port struct rvs_stat, one for each port, followed by
+ * max_port * max_queue struct rvs_stat_queue, those of the queues of
+ * port 0 first
+ */
+struct rvs_stat {
+	unsigned long flood; /* frames to a group address */
+	unsigned long unknown; /* frames to an unknown unicast address, which are flooded */
+	unsigned long learn; /* new addresses learned on the port */
+	unsigned long move; /* addresses moved from another port */
+};
+
+struct rvs_stat_queue {
+	unsigned long rx_pkt;
+	unsigned long rx_byte;
+	unsigned long tx_pkt;
+	unsigned long tx_byte;
+	unsigned long drop; /* frames not sent to the port as the RX ring is full, or the frame does not fit in a slot */
+	unsigned long hold; /* times the TX ring is held back by a lossless port */
+};
+
+#define RVS_STAT_SIZE(max_port, max_queue) \
+	((unsigned long)(max_port) * (sizeof(struct rvs_stat) + (unsigned long)(max_queue) * sizeof(struct rvs_stat_queue)))
+#define RVS_STAT_QUEUE(st, max_port, max_queue, vid, qid) \
+	((struct rvs_stat_queue *)((st) + (max_port)) + (unsigned long)(vid) * (max_queue) + (qid))
+
+/*
+ * a stats file, which apps/fwd exports and apps/stat reads, has the
+ * header followed by num blocks of RVS_STAT_SIZE(max_port, max_queue)
+ * bytes, one for each worker
+ */
+#define RVS_STAT_MAGIC (0x74617473) /* "stat" */
+
+struct rvs_stat_hdr {
+	unsigned int magic;
+	unsigned int num;
+	unsigned int num_port;
+	unsigned int max_port;
+	unsigned int max_queue;
+	char pad[64 - 20];
+};
+
+struct rvs;
+
+/* a next hop of the IPv4 routing table */
+struct rvs_lpm_nh {
+	unsigned char dst[6]; /* the MAC address of the next hop */
+	unsigned char src[6]; /* the MAC address put as the source of the routed frames */
+	unsigned short port; /* RVS_MAX_PORT if unset */
+	unsigned short pad;
+};
+
+/* a route, in the rule table to find the one covering a deleted route */
+struct rvs_lpm_rule {
+	unsigned int addr;
+	unsigned short nh;
+	unsigned char depth;
+	unsigned char used;
+};
+
+/*
+ * the IPv4 routing table, a DIR-24-8 table looked up by rvs_lookup_lpm();
+ * an entry of tbl24 or tbl8 has the valid bit, the extended bit, the
+ * prefix length, and the next hop or the tbl8 group
+ */
+struct rvs_lpm {
+	char lock[RVS_LOCK_BUF_SIZE]; /* serializes the updates */
+	struct rvs *vs;
+	unsigned int *tbl24;
+	unsigned int *tbl8; /* 256 entries for each group */
+	unsigned int *tbl8_next; /* links the free and the retired groups */
+	unsigned int num_tbl8;
+	unsigned int tbl8_free; /* num_tbl8 if none */
+	unsigned int tbl8_retired; /* freed groups the rvs_fwd() callers may still read */
+	struct rvs_lpm_rule *rule;
+	unsigned long rule_mask;
+	unsigned long num_rule;
+	struct rvs_lpm_nh nh[RVS_LPM_NUM_NH];
+};
+
+/*
+ * a lookup function sets dst[n] to the destination port of pkt[n], the first
+ * slot buffer of the n-th frame of a batch from queue qid of port vid, whose
+ * length is len[n], or to RVS_PORT_FLOOD or RVS_PORT_DROP; arg is the one
+ * given to rvs_lookup_set(), and the function may rewrite the frames; when
+ * rvs.c is built with -DRVS_LOOKUP=name, name is always called, and
+ * rvs_lookup_set() only takes its arg
+ */
+typedef void (*rvs_lookup_t)(struct rvs *, unsigned short, unsigned short,
+			     char *const *, const unsigned short *, unsigned short, unsigned short *, void *);
+
+/* a TX queue of a port, a cache line */
+struct rvs_queue {
+	unsigned long resv;
+	unsigned short tx_head; /* head of the TX ring we wrote last */
+	unsigned short tx_tail; /* tail of the TX ring we read last */
+	unsigned int pad0;
+	unsigned long seq; /* odd while an rvs_fwd() caller works on the TX ring */
+	unsigned long hol_since; /* when a lossless port started to hold back the TX ring, 0 if it does not */
+	char *lock; /* RVS_LOCK_BUF_SIZE bytes, used only with RVS_NO_ATOMIC */
+	char pad[64 - 40];
+};
+
+/* a port, a cache line */
+struct rvs_port {
+	struct rvif *vif;
+	struct rvs_queue *queue; /* max_queue entries */
+	void *pool;
+	unsigned long pool_size;
+	unsigned long lossless; /* head-of-line timeout in microseconds, 0 if the port is not lossless */
+	unsigned int ver;
+	unsigned int buf_size;
+	unsigned short up; /* the rvs_fwd() callers may use vif */
+	unsigned short nt;
+	unsigned short mirror; /* RVS_MIRROR_* */
+	unsigned short lock_init; /* the locks of the queues are initialized */
+	unsigned short offload; /* RVIF_F_* of the rvif */
+	char pad[64 - 58];
+};
+
+/*
+ * an rvs instance; rvs_init() takes rvs_size(max_port, max_queue) bytes,
+ * and puts the port and queue tables after struct rvs
+ */
 struct rvs {
 	struct {
 		char lock[RVS_LOCK_BUF_SIZE];
 		struct {
-			unsigned short port;
-			unsigned long mac;
-		} ent[RVS_NUM_HASH_ENT];
+			struct rvs_ft_bucket *bucket;
+			unsigned long mask;
+		} tbl[2]; /* the rvs_fwd() callers use tbl[cur_ft] */
+		unsigned short epoch;
+		unsigned short age;
+		struct rvs_ft_bucket builtin[RVS_FT_NUM_BUCKET];
 	} ft;
+	unsigned short cur_ft;
 
-	char lock[RVS_LOCK_BUF_SIZE];
+	char lock[RVS_LOCK_BUF_SIZE]; /* serializes the updates; the rvs_fwd() callers take it only with RVS_NO_ATOMIC */
 
 	struct {
-		char lock[RVIF_MAX_QUEUE][RVS_LOCK_BUF_SIZE];
-		struct rvif *vif;
-	} port[RVS_MAX_PORT];
+		rvs_lookup_t fn; /* NULL for the built-in learning bridge */
+		void *arg;
+	} lookup[2]; /* the rvs_fwd() callers use lookup[cur_lookup] */
+	unsigned short cur_lookup;
+
+	struct {
+		unsigned short func; /* RVS_RSS_* */
+		unsigned short hw; /* the crc32 instruction is available */
+		unsigned char key[RVS_RSS_KEY_LEN];
+		unsigned int tbl[RVS_RSS_IN_LEN][256]; /* of RVS_RSS_TOEPLITZ, the hash of each value of each input byte */
+	} rss[2]; /* the rvs_fwd() callers use rss[cur_rss] */
+	unsigned short cur_rss;
+
+	unsigned short copy;
+
+	struct {
+		unsigned short num;
+		unsigned short vid[RVS_MAX_PORT];
+	} active[2]; /* attached ports; the rvs_fwd() callers use active[cur_active] */
+	unsigned short cur_active;
+
+	unsigned short mirror; /* the monitor port, RVS_MAX_PORT if none */
+	unsigned long mirror_drop; /* mirrored frames not fitting in the monitor port */
+
+	unsigned short num_lossless; /* ports in the lossless mode */
+
+	unsigned short max_port;
+	unsigned short max_queue;
+	struct rvs_port *port; /* max_port entries, which follow struct rvs */
 };
 
 unsigned short rvs_fwd(struct rvs *, unsigned short, unsigned short, unsigned short);
+unsigned short rvs_fwd_stat(struct rvs *, unsigned short, unsigned short, unsigned short, struct rvs_stat *);
 int rvs_vif_attach(struct rvs *, unsigned short, struct rvif *);
+int rvs_vif_attach_pool(struct rvs *, unsigned short, struct rvif *, void *, unsigned long);
 int rvs_vif_detach(struct rvs *, unsigned short, struct rvif *);
-int rvs_init(struct rvs *);
+void rvs_read_begin(struct rvs *, unsigned short, unsigned short);
+void rvs_read_end(struct rvs *, unsigned short, unsigned short);
+void rvs_sync(struct rvs *);
+void rvs_copy(struct rvs *, void *, const void *, unsigned short, int);
+void rvs_copy_sync(struct rvs *);
+int rvs_copy_select(struct rvs *, unsigned short);
+int rvs_port_copy_nt(struct rvs *, unsigned short, unsigned short);
+int rvs_mirror_set(struct rvs *, unsigned short);
+int rvs_port_mirror(struct rvs *, unsigned short, unsigned short);
+int rvs_port_lossless(struct rvs *, unsigned short, unsigned long);
+int rvs_lookup_set(struct rvs *, rvs_lookup_t, void *);
+void rvs_lookup_l2(struct rvs *, unsigned short, unsigned short, char *const *, const unsigned short *, unsigned short, unsigned short *, void *);
+int rvs_rss_set(struct rvs *, unsigned short, const unsigned char *);
+unsigned long rvs_lpm_size(unsigned int, unsigned long);
+int rvs_lpm_setup(struct rvs_lpm *, struct rvs *, void *, unsigned long, unsigned int);
+int rvs_lpm_exit(struct rvs_lpm *);
+int rvs_lpm_nh_set(struct rvs_lpm *, unsigned short, unsigned short, const unsigned char *, const unsigned char *);
+int rvs_lpm_add(struct rvs_lpm *, unsigned int, unsigned char, unsigned short);
+int rvs_lpm_del(struct rvs_lpm *, unsigned int, unsigned char);
+void rvs_lookup_lpm(struct rvs *, unsigned short, unsigned short, char *const *, const unsigned short *, unsigned short, unsigned short *, void *);
+int rvs_ft_setup(struct rvs *, void *, unsigned long, unsigned short);
+void rvs_ft_tick(struct rvs *);
+unsigned long rvs_size(unsigned short, unsigned short);
+int rvs_init(struct rvs *, unsigned short, unsigned short);
 int rvs_exit(struct rvs *);
 
 #endif
@@ -18,6 +18,11 @@
 
 #include <rvs.h>
 
+#if defined(RVS_NO_ATOMIC)
+#define RVIF_RING_NO_ATOMIC
+#endif
+#include <rvif_ring.h>
+
 extern int rvs_lock_init(char *);
 extern int rvs_lock_destroy(char *);
 extern int rvs_wrlock(char *);
@@ -25,129 +30,2243 @@ extern int rvs_wrunlock(char *);
 extern int rvs_rdlock(char *);
 extern int rvs_rdunlock(char *);
 
-extern int rvs_notify(struct rvs *, unsigned short, unsigned short);
+extern int rvs_notify(struct rvs *, unsigned short, unsigned short);
+
+/* a monotonic clock in microseconds, which is read only when a lossless port holds back a ring */
+extern unsigned long rvs_time_us(void);
+
+#if defined(RVS_LOOKUP)
+/* the lookup function fixed at build time, which is called directly rather than vs->lookup */
+extern void RVS_LOOKUP(struct rvs *, unsigned short, unsigned short,
+		       char *const *, const unsigned short *, unsigned short, unsigned short *, void *);
+#endif
+
+#define RVS_RING(_vs, _vid, _qid, _r, _field) \
+	RVIF_RING((_vs)->port[_vid].vif, (_vs)->port[_vid].ver, _qid, _r, _field)
+
+#define RVS_SLOT(_vs, _vid, _qid, _r, _s, _field) \
+	RVIF_SLOT((_vs)->port[_vid].vif, (_vs)->port[_vid].ver, _qid, _r, _s, _field)
+
+#define RVS_SLOT_MORE(_vs, _vid, _qid, _r, _s) \
+	RVIF_SLOT_MORE((_vs)->port[_vid].vif, (_vs)->port[_vid].ver, _qid, _r, _s)
+
+/* a slot of an rvif of version 3 */
+#define RVS_SLOT3(_vs, _vid, _qid, _r, _s) \
+	(((struct rvif3 *)(_vs)->port[_vid].vif)->queue[_qid].ring[_r].slot[_s])
+
+/* a slot of an rvif of version 2 */
+#define RVS_SLOT2(_vs, _vid, _qid, _r, _s) \
+	(((struct rvif2 *)(_vs)->port[_vid].vif)->queue[_qid].ring[_r].slot[_s])
+
+#define RVS_SLOT_FLAGS(_vs, _vid, _qid, _r, _s) \
+	RVIF_SLOT_FLAGS((_vs)->port[_vid].vif, (_vs)->port[_vid].ver, _qid, _r, _s)
+
+#define RVS_SLOT_OFFLOAD(_vs, _vid, _qid, _r, _s) \
+	RVIF_SLOT_OFFLOAD((_vs)->port[_vid].vif, (_vs)->port[_vid].ver, _qid, _r, _s)
+
+#define RVS_SLOT_F_GSO (RVIF_SLOT_F_GSO_TCP4 | RVIF_SLOT_F_GSO_TCP6)
+
+/* the offload flags of the slots for RVIF_F_* of an rvif */
+#define RVS_OFL_FLAGS(_f) \
+	(((_f) & RVIF_F_CSUM ? RVIF_SLOT_F_CSUM : 0) | ((_f) & RVIF_F_GSO ? RVS_SLOT_F_GSO : 0))
+
+/* whether a frame having the offload flags is segmented for port i, which does not take the super-frames */
+#define RVS_OFL_SEG(_vs, _i, _ofl) (((_ofl) & RVS_SLOT_F_GSO) && !((_vs)->port[_i].offload & RVIF_F_GSO))
+
+#define RVS_POOL_HAS(_vs, _vid, _addr) \
+	(((unsigned long) (_vs)->port[_vid].pool <= (_addr)) \
+	 && ((_addr) + (_vs)->port[_vid].buf_size <= (unsigned long) (_vs)->port[_vid].pool + (_vs)->port[_vid].pool_size))
+
+/*
+ * the rvs_fwd() callers read the port table without taking any lock. a
+ * caller makes seq of the TX ring it works on odd while it runs, and an
+ * update, which holds vs->lock, waits until every odd seq has changed, that
+ * is, until the callers that may have seen the old state have returned
+ * (a grace period); a detached port is first hidden by up and removed from
+ * the active list, and its vif is cleared after the grace period. the
+ * lookup function, the active list, the forwarding table, and the flow
+ * hash have two copies, and an update rewrites the one not in use and flips the index
+ * to it.
+ * RVS_NO_ATOMIC makes the callers hold vs->lock for reading instead.
+ */
+#if !defined(RVS_NO_ATOMIC)
+#define RVS_PORT_UP(_vs, _vid) __atomic_load_n(&(_vs)->port[_vid].up, __ATOMIC_ACQUIRE)
+#define RVS_CUR(_vs, _name) __atomic_load_n(&(_vs)->cur_##_name, __ATOMIC_ACQUIRE) /* the copy in use */
+#else
+#define RVS_PORT_UP(_vs, _vid) ((_vs)->port[_vid].up)
+#define RVS_CUR(_vs, _name) ((_vs)->cur_##_name)
+#endif
+
+void rvs_read_begin(struct rvs *vs, unsigned short vid, unsigned short qid)
+{
+#if !defined(RVS_NO_ATOMIC)
+	unsigned long *seq = &vs->port[vid].queue[qid].seq;
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	/* the odd seq has to be visible before we read the port table */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+	(void) vid;
+	(void) qid;
+	rvs_rdlock(vs->lock);
+#endif
+}
+
+void rvs_read_end(struct rvs *vs, unsigned short vid, unsigned short qid)
+{
+#if !defined(RVS_NO_ATOMIC)
+	unsigned long *seq = &vs->port[vid].queue[qid].seq;
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+#else
+	(void) vid;
+	(void) qid;
+	rvs_rdunlock(vs->lock);
+#endif
+}
+
+/* the caller holds vs->lock for writing, which excludes the readers with RVS_NO_ATOMIC */
+static void rvs_wait_readers(struct rvs *vs)
+{
+#if !defined(RVS_NO_ATOMIC)
+	unsigned short i;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < vs->max_port; i++) {
+		unsigned short j;
+		for (j = 0; j < vs->max_queue; j++) {
+			unsigned long seq = __atomic_load_n(&vs->port[i].queue[j].seq, __ATOMIC_ACQUIRE);
+			if (seq & 1) {
+				while (__atomic_load_n(&vs->port[i].queue[j].seq, __ATOMIC_ACQUIRE) == seq) {
+#if defined(__x86_64__)
+					__asm__ volatile ("pause" ::: "memory");
+#endif
+				}
+			}
+		}
+	}
+#else
+	(void) vs;
+#endif
+}
+
+/* publishes the copy at !*cur, and waits until the other one is not in use */
+static void rvs_flip(struct rvs *vs, unsigned short *cur)
+{
+#if !defined(RVS_NO_ATOMIC)
+	__atomic_store_n(cur, (unsigned short) !*cur, __ATOMIC_RELEASE);
+#else
+	*cur = (unsigned short) !*cur;
+#endif
+	rvs_wait_readers(vs);
+}
+
+/* waits until the rvs_fwd() callers running at the call have returned */
+void rvs_sync(struct rvs *vs)
+{
+	rvs_wrlock(vs->lock);
+	rvs_wait_readers(vs);
+	rvs_wrunlock(vs->lock);
+}
+
+static void rvs_copy_scalar(char *dst, const char *src, unsigned long n, int nt)
+{
+	unsigned long k;
+	(void) nt;
+	for (k = 0; k < (n + 7) / 8; k++)
+		((unsigned long *) dst)[k] = ((const unsigned long *) src)[k];
+}
+
+#if defined(__x86_64__)
+/*
+ * the SIMD kernels copy 64 bytes per iteration; the size of a packet
+ * buffer is a multiple of 64 bytes, and a copy starts at a 64-byte
+ * boundary of a buffer, thus, rounding up the length to 64 bytes never
+ * goes beyond the buffer.
+ * they are written in inline assembly as -nostdinc excludes the
+ * intrinsics headers.
+ * non-temporal stores are weakly ordered; rvs_copy_sync() has to be
+ * called before publishing the copied packets.
+ */
+static void rvs_copy_sse2(char *dst, const char *src, unsigned long n, int nt)
+{
+	unsigned long k;
+	if (nt && !((unsigned long) dst % 16)) {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"movdqu 0(%1), %%xmm0 \n\t"
+					"movdqu 16(%1), %%xmm1 \n\t"
+					"movdqu 32(%1), %%xmm2 \n\t"
+					"movdqu 48(%1), %%xmm3 \n\t"
+					"movntdq %%xmm0, 0(%0) \n\t"
+					"movntdq %%xmm1, 16(%0) \n\t"
+					"movntdq %%xmm2, 32(%0) \n\t"
+					"movntdq %%xmm3, 48(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+	} else {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"movdqu 0(%1), %%xmm0 \n\t"
+					"movdqu 16(%1), %%xmm1 \n\t"
+					"movdqu 32(%1), %%xmm2 \n\t"
+					"movdqu 48(%1), %%xmm3 \n\t"
+					"movdqu %%xmm0, 0(%0) \n\t"
+					"movdqu %%xmm1, 16(%0) \n\t"
+					"movdqu %%xmm2, 32(%0) \n\t"
+					"movdqu %%xmm3, 48(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "xmm1", "xmm2", "xmm3", "memory");
+	}
+}
+
+static void rvs_copy_avx2(char *dst, const char *src, unsigned long n, int nt)
+{
+	unsigned long k;
+	if (nt && !((unsigned long) dst % 32)) {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"vmovdqu 0(%1), %%ymm0 \n\t"
+					"vmovdqu 32(%1), %%ymm1 \n\t"
+					"vmovntdq %%ymm0, 0(%0) \n\t"
+					"vmovntdq %%ymm1, 32(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "xmm1", "memory");
+	} else {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"vmovdqu 0(%1), %%ymm0 \n\t"
+					"vmovdqu 32(%1), %%ymm1 \n\t"
+					"vmovdqu %%ymm0, 0(%0) \n\t"
+					"vmovdqu %%ymm1, 32(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "xmm1", "memory");
+	}
+	__asm__ volatile ("vzeroupper" ::: "memory");
+}
+
+static void rvs_copy_avx512(char *dst, const char *src, unsigned long n, int nt)
+{
+	unsigned long k;
+	if (nt && !((unsigned long) dst % 64)) {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"vmovdqu64 0(%1), %%zmm0 \n\t"
+					"vmovntdq %%zmm0, 0(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "memory");
+	} else {
+		for (k = 0; k < n; k += 64)
+			__asm__ volatile (
+					"vmovdqu64 0(%1), %%zmm0 \n\t"
+					"vmovdqu64 %%zmm0, 0(%0) \n\t"
+					: : "r" (dst + k), "r" (src + k)
+					: "xmm0", "memory");
+	}
+	__asm__ volatile ("vzeroupper" ::: "memory");
+}
+#endif
+
+static void (*const rvs_copy_fn[RVS_COPY_NUM])(char *, const char *, unsigned long, int) = {
+	rvs_copy_scalar,
+#if defined(__x86_64__)
+	rvs_copy_sse2,
+	rvs_copy_avx2,
+	rvs_copy_avx512,
+#endif
+};
+
+static int rvs_copy_supported(unsigned short kind)
+{
+	if (kind == RVS_COPY_SCALAR)
+		return 1;
+#if defined(__x86_64__)
+	{
+		unsigned int a, b, c, d;
+		__asm__ volatile ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1), "c" (0));
+		if (kind == RVS_COPY_SSE2)
+			return (d >> 26) & 1;
+		if (!((c >> 27) & 1) || !((c >> 28) & 1)) /* OSXSAVE and AVX */
+			return 0;
+		{
+			unsigned int xcr0, xcr0_hi;
+			__asm__ volatile ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+			(void) xcr0_hi;
+			if ((xcr0 & 0x6) != 0x6) /* the OS saves XMM and YMM states */
+				return 0;
+			__asm__ volatile ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (7), "c" (0));
+			if (kind == RVS_COPY_AVX2)
+				return (b >> 5) & 1;
+			if (kind == RVS_COPY_AVX512) /* AVX512F, and the OS saves opmask and ZMM states */
+				return ((b >> 16) & 1) && ((xcr0 & 0xe0) == 0xe0);
+		}
+	}
+#endif
+	return 0;
+}
+
+void rvs_copy(struct rvs *vs, void *dst, const void *src, unsigned short len, int nt)
+{
+	unsigned long n = len;
+	if (vs->copy != RVS_COPY_SCALAR)
+		n = (n + 63) & ~63UL;
+	rvs_copy_fn[vs->copy]((char *) dst, (const char *) src, n, nt);
+}
+
+void rvs_copy_sync(struct rvs *vs)
+{
+	(void) vs;
+#if defined(__x86_64__)
+	__asm__ volatile ("sfence" ::: "memory");
+#endif
+}
+
+int rvs_copy_select(struct rvs *vs, unsigned short kind)
+{
+	if (kind >= RVS_COPY_NUM || !rvs_copy_supported(kind))
+		return -1;
+	vs->copy = kind;
+	return 0;
+}
+
+int rvs_port_copy_nt(struct rvs *vs, unsigned short vid, unsigned short thresh)
+{
+	if (vid >= vs->max_port)
+		return -1;
+	vs->port[vid].nt = thresh;
+	return 0;
+}
+
+/* vid is the monitor port, and RVS_MAX_PORT stops mirroring */
+int rvs_mirror_set(struct rvs *vs, unsigned short vid)
+{
+	if (vid >= vs->max_port && vid != RVS_MAX_PORT)
+		return -1;
+	rvs_wrlock(vs->lock);
+	vs->mirror = vid;
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+/* dir is the combination of RVS_MIRROR_INGRESS and RVS_MIRROR_EGRESS, or zero */
+int rvs_port_mirror(struct rvs *vs, unsigned short vid, unsigned short dir)
+{
+	if (vid >= vs->max_port || (dir & ~(RVS_MIRROR_INGRESS | RVS_MIRROR_EGRESS)))
+		return -1;
+	rvs_wrlock(vs->lock);
+	vs->port[vid].mirror = dir;
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+/*
+ * the frames to port vid are not dropped because of its full RX ring, and
+ * the source waits for it; when the port has not taken any frame for timeout
+ * microseconds, the frames to it are dropped until it takes a frame again,
+ * so that a stuck port does not block the others forever; 0 disables it
+ */
+int rvs_port_lossless(struct rvs *vs, unsigned short vid, unsigned long timeout)
+{
+	if (vid >= vs->max_port)
+		return -1;
+	rvs_wrlock(vs->lock);
+	if (!vs->port[vid].lossless && timeout)
+		vs->num_lossless++;
+	else if (vs->port[vid].lossless && !timeout)
+		vs->num_lossless--;
+	vs->port[vid].lossless = timeout;
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+/* the default key of the Toeplitz hash, which is commonly used by NICs */
+static const unsigned char rvs_rss_key_default[RVS_RSS_KEY_LEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * builds the table of the Toeplitz hash; a set bit of input byte i, at bit
+ * j from the top, XORs the 32 key bits from bit 8 * i + j, thus, tbl[i][v]
+ * is the XOR of those of the set bits of v, and the hash of an input is
+ * the XOR of tbl[i][in[i]], a load for each byte rather than a branch for
+ * each bit
+ */
+static void rvs_toeplitz_tbl(unsigned int (*tbl)[256], const unsigned char *key)
+{
+	unsigned short i;
+	for (i = 0; i < RVS_RSS_IN_LEN; i++) {
+		unsigned long k = 0; /* key bytes i to i + 4, which cover the 32 bits from each bit of input byte i */
+		unsigned int bit[8];
+		unsigned short j, v;
+		for (j = 0; j < 5; j++)
+			k = (k << 8) | key[i + j];
+		for (j = 0; j < 8; j++)
+			bit[j] = (unsigned int)(k >> (8 - j));
+		tbl[i][0] = 0;
+		for (v = 1; v < 256; v++) {
+			/* v without its lowest set bit, which is bit j from the top */
+			for (j = 7; !((v >> (7 - j)) & 1); j--)
+				;
+			tbl[i][v] = tbl[i][v & (v - 1)] ^ bit[j];
+		}
+	}
+}
+
+/*
+ * func is RVS_RSS_*, and key, of RVS_RSS_KEY_LEN bytes, is the key of
+ * the Toeplitz hash, or its first 4 bytes are the seed of CRC32C; NULL
+ * selects the default key
+ */
+int rvs_rss_set(struct rvs *vs, unsigned short func, const unsigned char *key)
+{
+	if (func > RVS_RSS_CRC32)
+		return -1;
+	rvs_wrlock(vs->lock);
+	{
+		unsigned short r = !vs->cur_rss, i;
+		for (i = 0; i < RVS_RSS_KEY_LEN; i++)
+			vs->rss[r].key[i] = (key ? key[i] : rvs_rss_key_default[i]);
+		vs->rss[r].hw = 0;
+#if defined(__x86_64__)
+		{
+			unsigned int a, b, c, d;
+			__asm__ volatile ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1), "c" (0));
+			vs->rss[r].hw = (c >> 20) & 1; /* SSE4.2 */
+		}
+#endif
+		if (func == RVS_RSS_TOEPLITZ)
+			rvs_toeplitz_tbl(vs->rss[r].tbl, vs->rss[r].key);
+		vs->rss[r].func = func;
+	}
+	/* the old key is not read after we return */
+	rvs_flip(vs, &vs->cur_rss);
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+static unsigned int rvs_toeplitz(unsigned int (*tbl)[256], const unsigned char *in, unsigned short len)
+{
+	unsigned int h = 0;
+	unsigned short i;
+	for (i = 0; i < len; i++)
+		h ^= tbl[i][in[i]];
+	return h;
+}
+
+/* CRC32C of len bytes, a multiple of 4 */
+static unsigned int rvs_crc32c(int hw, unsigned int crc, const unsigned char *in, unsigned short len)
+{
+	unsigned short i;
+#if defined(__x86_64__)
+	if (hw) {
+		for (i = 0; i < len; i += 4)
+			__asm__ ("crc32l %1, %0" : "+r" (crc) : "rm" (*((const unsigned int *)(in + i))));
+		return crc;
+	}
+#else
+	(void) hw;
+#endif
+	for (i = 0; i < len; i++) {
+		int b;
+		crc ^= in[i];
+		for (b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0x82f63b78 & (0U - (crc & 1)));
+	}
+	return crc;
+}
+
+/*
+ * the flow hash of a frame by copy c of vs->rss; the input is the addresses and the ports of
+ * TCP and UDP over IPv4 and IPv6, the addresses of the other IP packets,
+ * or the MAC addresses of the other frames, in the order of the headers
+ */
+static unsigned int rvs_rss_hash(struct rvs *vs, unsigned short c, const unsigned char *p, unsigned short len)
+{
+	unsigned char in[RVS_RSS_IN_LEN];
+	unsigned short n = 0, o = 12, type;
+	if (len < 14)
+		return 0;
+	type = (unsigned short)((p[o] << 8) | p[o + 1]);
+	if (type == 0x8100 && len >= 18) { /* VLAN */
+		o = 16;
+		type = (unsigned short)((p[o] << 8) | p[o + 1]);
+	}
+	o += 2;
+	if (type == 0x0800 && len >= o + 20) {
+		unsigned short ihl = (p[o] & 0xf) * 4, i;
+		for (i = 0; i < 8; i++)
+			in[n++] = p[o + 12 + i];
+		if ((p[o + 9] == 6 || p[o + 9] == 17) && !(((p[o + 6] << 8) | p[o + 7]) & 0x3fff) /* not a fragment */
+				&& len >= o + ihl + 4) {
+			for (i = 0; i < 4; i++)
+				in[n++] = p[o + ihl + i];
+		}
+	} else if (type == 0x86dd && len >= o + 40) {
+		unsigned short i;
+		for (i = 0; i < 32; i++)
+			in[n++] = p[o + 8 + i];
+		if ((p[o + 6] == 6 || p[o + 6] == 17) && len >= o + 44) {
+			for (i = 0; i < 4; i++)
+				in[n++] = p[o + 40 + i];
+		}
+	} else {
+		unsigned short i;
+		for (i = 0; i < 12; i++)
+			in[n++] = p[i];
+	}
+	if (vs->rss[c].func == RVS_RSS_TOEPLITZ)
+		return rvs_toeplitz(vs->rss[c].tbl, in, n);
+	else
+		return rvs_crc32c(vs->rss[c].hw, ((unsigned int) vs->rss[c].key[0] << 24) | ((unsigned int) vs->rss[c].key[1] << 16)
+				  | ((unsigned int) vs->rss[c].key[2] << 8) | vs->rss[c].key[3], in, n);
+}
+
+static unsigned long rvs_ft_hash(unsigned long mac)
+{
+	/* the finalizer of MurmurHash3, every bit of mac affects every bit of the result */
+	mac ^= mac >> 33;
+	mac *= 0xff51afd7ed558ccdUL;
+	mac ^= mac >> 33;
+	mac *= 0xc4ceb9fe1a85ec53UL;
+	mac ^= mac >> 33;
+	return mac;
+}
+
+/*
+ * an entry is a single word holding the mac address in the upper 48 bits
+ * and the port in the lower 16 bits; lookups read it without taking any
+ * lock, and ft.lock serializes the updates.
+ */
+static unsigned short rvs_ft_lookup(struct rvs *vs, unsigned long mac)
+{
+	unsigned short c = RVS_CUR(vs, ft);
+	struct rvs_ft_bucket *b = &vs->ft.tbl[c].bucket[rvs_ft_hash(mac) & vs->ft.tbl[c].mask];
+	unsigned short i;
+	for (i = 0; i < RVS_FT_WAY; i++) {
+		unsigned long e = ((volatile unsigned long *) b->ent)[i];
+		if (e && (e >> 16) == mac)
+			return (unsigned short)(e & 0xffff);
+	}
+	return RVS_MAX_PORT;
+}
+
+#define RVS_FT_LEARN (1) /* a new address */
+#define RVS_FT_MOVE (2) /* an address moved from another port */
+
+static int rvs_ft_update(struct rvs *vs, struct rvs_ft_bucket *b, unsigned long mac, unsigned short vid)
+{
+	int ret = RVS_FT_LEARN;
+	rvs_wrlock(vs->ft.lock);
+	{
+		unsigned short i, j = RVS_FT_WAY;
+		for (i = 0; i < RVS_FT_WAY; i++) {
+			if ((b->ent[i] >> 16) == mac) /* the station has moved */
+				break;
+			if (j == RVS_FT_WAY || (b->ent[j] && (!b->ent[i]
+							|| (unsigned short)(vs->ft.epoch - b->epoch[i]) > (unsigned short)(vs->ft.epoch - b->epoch[j]))))
+				j = i; /* an empty way, otherwise the least recently seen one */
+		}
+		if (i == RVS_FT_WAY)
+			i = j;
+		else if ((b->ent[i] & 0xffff) != vid)
+			ret = RVS_FT_MOVE;
+		else
+			ret = 0; /* another thread has learned it */
+		b->epoch[i] = vs->ft.epoch;
+		((volatile unsigned long *) b->ent)[i] = (mac << 16) | vid;
+	}
+	rvs_wrunlock(vs->ft.lock);
+	return ret;
+}
+
+/* returns RVS_FT_LEARN or RVS_FT_MOVE if the table is updated, otherwise 0 */
+static int rvs_ft_learn(struct rvs *vs, unsigned long mac, unsigned short vid)
+{
+	unsigned short c = RVS_CUR(vs, ft);
+	struct rvs_ft_bucket *b = &vs->ft.tbl[c].bucket[rvs_ft_hash(mac) & vs->ft.tbl[c].mask];
+	unsigned short i;
+	for (i = 0; i < RVS_FT_WAY; i++) {
+		if (((volatile unsigned long *) b->ent)[i] == ((mac << 16) | vid)) {
+			/* the binding is unchanged; only refresh the age once per epoch */
+			if (b->epoch[i] != vs->ft.epoch)
+				b->epoch[i] = vs->ft.epoch;
+			return 0;
+		}
+	}
+	return rvs_ft_update(vs, b, mac, vid);
+}
+
+/*
+ * the new table is published with its mask by a flip, and the old one is
+ * not used after we return; ft.lock is released before the flip because an
+ * rvs_fwd() caller may wait for it to learn an address
+ */
+int rvs_ft_setup(struct rvs *vs, void *mem, unsigned long size, unsigned short age)
+{
+	unsigned long num = 1;
+	if (!mem) {
+		mem = vs->ft.builtin;
+		size = sizeof(vs->ft.builtin);
+	}
+	if ((unsigned long) mem % sizeof(unsigned long) || size < sizeof(struct rvs_ft_bucket) || !age)
+		return -1;
+	while (num * 2 <= size / sizeof(struct rvs_ft_bucket))
+		num *= 2;
+	rvs_wrlock(vs->lock);
+	rvs_wrlock(vs->ft.lock);
+	{
+		unsigned long i;
+		for (i = 0; i < num * sizeof(struct rvs_ft_bucket) / sizeof(unsigned long); i++)
+			((unsigned long *) mem)[i] = 0;
+	}
+	vs->ft.tbl[!vs->cur_ft].bucket = (struct rvs_ft_bucket *) mem;
+	vs->ft.tbl[!vs->cur_ft].mask = num - 1;
+	vs->ft.age = age;
+	rvs_wrunlock(vs->ft.lock);
+	rvs_flip(vs, &vs->cur_ft);
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+void rvs_ft_tick(struct rvs *vs)
+{
+	rvs_wrlock(vs->ft.lock);
+	vs->ft.epoch++;
+	{
+		struct rvs_ft_bucket *b = vs->ft.tbl[vs->cur_ft].bucket;
+		unsigned long i;
+		for (i = 0; i <= vs->ft.tbl[vs->cur_ft].mask; i++) {
+			unsigned short j;
+			for (j = 0; j < RVS_FT_WAY; j++) {
+				if (b[i].ent[j] && (unsigned short)(vs->ft.epoch - b[i].epoch[j]) > vs->ft.age)
+					((volatile unsigned long *) b[i].ent)[j] = 0;
+			}
+		}
+	}
+	rvs_wrunlock(vs->ft.lock);
+}
+
+/*
+ * the built-in lookup, the learning bridge; rvs_fwd_stat() calls it directly,
+ * rather than through a function pointer, so that it is inlined there
+ */
+static void rvs_l2(struct rvs *vs, unsigned short vid, char *const *pkt, const unsigned short *len,
+		   unsigned short cnt, unsigned short *dst, struct rvs_stat *st)
+{
+	unsigned short n;
+	for (n = 0; n < cnt; n++) {
+		char *p = pkt[n];
+		if (n + RVS_PREFETCH_DIST < cnt)
+			__builtin_prefetch(pkt[n + RVS_PREFETCH_DIST]);
+		if (len[n] > RVS_GSO_FRAME_MAX) {
+			dst[n] = RVS_PORT_DROP;
+			continue;
+		}
+		{
+			unsigned long s = (*((unsigned long *)(&p[4])) >> 16) & 0x0000ffffffffffff;
+			if (s) { /* zero represents an empty entry */
+				int e = rvs_ft_learn(vs, s, vid);
+				if (st && e == RVS_FT_LEARN)
+					st[vid].learn++;
+				else if (st && e == RVS_FT_MOVE)
+					st[vid].move++;
+			}
+		}
+		{
+			unsigned long d = *((unsigned long *)(&p[0])) & 0x0000ffffffffffff;
+			dst[n] = rvs_ft_lookup(vs, d); /* RVS_PORT_FLOOD if unknown */
+		}
+	}
+}
+
+/* the built-in lookup for the lookup functions leaving some frames to it */
+void rvs_lookup_l2(struct rvs *vs, unsigned short vid, unsigned short qid,
+		   char *const *pkt, const unsigned short *len, unsigned short cnt, unsigned short *dst, void *arg)
+{
+	(void) qid;
+	(void) arg;
+	rvs_l2(vs, vid, pkt, len, cnt, dst, (void *) 0);
+}
+
+/*
+ * fn replaces the built-in lookup, and NULL restores it; with RVS_LOOKUP,
+ * only arg is used, and fn is NULL or the function fixed at build time
+ */
+int rvs_lookup_set(struct rvs *vs, rvs_lookup_t fn, void *arg)
+{
+#if defined(RVS_LOOKUP)
+	if (fn && fn != RVS_LOOKUP)
+		return -1; /* the stage 2 calls RVS_LOOKUP anyway */
+#endif
+	rvs_wrlock(vs->lock);
+	vs->lookup[!vs->cur_lookup].fn = fn;
+	vs->lookup[!vs->cur_lookup].arg = arg;
+	/* the old function and arg are not used after we return */
+	rvs_flip(vs, &vs->cur_lookup);
+	rvs_wrunlock(vs->lock);
+	return 0;
+}
+
+/*
+ * the IPv4 routing table; a route of up to 24 bits sets the tbl24 entries it
+ * covers, and a longer one takes a tbl8 group of 256 entries for the last 8
+ * bits, which the tbl24 entry points to; a lookup reads a tbl24 entry and,
+ * if it is extended, a tbl8 entry, without taking any lock. an update stores
+ * a whole entry at once, and fills a new tbl8 group before the tbl24 entry
+ * points to it; a freed tbl8 group is reused after a grace period of the
+ * rvs_fwd() callers, and so is a next hop being changed.
+ */
+#define RVS_LPM_VALID (1U << 31)
+#define RVS_LPM_EXT (1U << 30)
+#define RVS_LPM_DEPTH(_e) (((_e) >> 24) & 0x3f)
+#define RVS_LPM_IDX(_e) ((_e) & 0xffffff) /* the next hop, or the tbl8 group if extended */
+#define RVS_LPM_ENT(_depth, _nh) (RVS_LPM_VALID | ((unsigned int)(_depth) << 24) | (_nh))
+
+/* the port of a next hop is written after, and read before, its addresses */
+#if !defined(RVS_NO_ATOMIC)
+#define RVS_LPM_NH_PORT(_h) __atomic_load_n(&(_h)->port, __ATOMIC_ACQUIRE)
+#define RVS_LPM_NH_PORT_SET(_h, _port) __atomic_store_n(&(_h)->port, _port, __ATOMIC_RELEASE)
+#else
+#define RVS_LPM_NH_PORT(_h) ((_h)->port)
+#define RVS_LPM_NH_PORT_SET(_h, _port) ((_h)->port = (_port))
+#endif
+
+static unsigned int rvs_lpm_mask(unsigned char depth)
+{
+	return (depth ? 0xffffffffU << (32 - depth) : 0);
+}
+
+static unsigned long rvs_lpm_hash(unsigned int addr, unsigned char depth)
+{
+	return rvs_ft_hash(((unsigned long) addr << 8) | depth);
+}
+
+/* the slot of the rule, or the empty slot where it is put */
+static unsigned long rvs_lpm_rule_find(struct rvs_lpm *lpm, unsigned int addr, unsigned char depth)
+{
+	unsigned long i = rvs_lpm_hash(addr, depth) & lpm->rule_mask;
+	while (lpm->rule[i].used && (lpm->rule[i].addr != addr || lpm->rule[i].depth != depth))
+		i = (i + 1) & lpm->rule_mask;
+	return i;
+}
+
+/* removes the rule at slot i, and moves back the following rules of the probe sequence */
+static void rvs_lpm_rule_remove(struct rvs_lpm *lpm, unsigned long i)
+{
+	unsigned long j = i;
+	lpm->rule[i].used = 0;
+	while (1) {
+		unsigned long k;
+		j = (j + 1) & lpm->rule_mask;
+		if (!lpm->rule[j].used)
+			break;
+		k = rvs_lpm_hash(lpm->rule[j].addr, lpm->rule[j].depth) & lpm->rule_mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue; /* the rule at j is still reachable from its home slot k */
+		lpm->rule[i] = lpm->rule[j];
+		lpm->rule[j].used = 0;
+		i = j;
+	}
+	lpm->num_rule--;
+}
+
+static unsigned int rvs_lpm_tbl8_alloc(struct rvs_lpm *lpm)
+{
+	unsigned int g;
+	if (lpm->tbl8_free == lpm->num_tbl8 && lpm->tbl8_retired != lpm->num_tbl8) {
+		/* wait for the rvs_fwd() callers that may read the retired groups */
+		rvs_sync(lpm->vs);
+		lpm->tbl8_free = lpm->tbl8_retired;
+		lpm->tbl8_retired = lpm->num_tbl8;
+	}
+	g = lpm->tbl8_free;
+	if (g != lpm->num_tbl8)
+		lpm->tbl8_free = lpm->tbl8_next[g];
+	return g;
+}
+
+/* makes the tbl24 entry i point to no group if all the entries of its group are the same route of up to 24 bits */
+static void rvs_lpm_compress(struct rvs_lpm *lpm, unsigned long i)
+{
+	unsigned int g = RVS_LPM_IDX(lpm->tbl24[i]), *t = &lpm->tbl8[(unsigned long) g * 256];
+	unsigned short j;
+	if ((t[0] & RVS_LPM_VALID) && RVS_LPM_DEPTH(t[0]) > 24)
+		return;
+	for (j = 1; j < 256; j++) {
+		if (t[j] != t[0])
+			return;
+	}
+	*((volatile unsigned int *) &lpm->tbl24[i]) = t[0];
+	lpm->tbl8_next[g] = lpm->tbl8_retired;
+	lpm->tbl8_retired = g;
+}
+
+/*
+ * sets v to the entries covered by the route addr/depth that are not covered
+ * by a longer route, or, if del is set, those of the route itself
+ */
+static void rvs_lpm_update(struct rvs_lpm *lpm, unsigned int addr, unsigned char depth, unsigned int v, int del)
+{
+	if (depth <= 24) {
+		unsigned long i;
+		for (i = addr >> 8; i < (addr >> 8) + (1UL << (24 - depth)); i++) {
+			unsigned int e = lpm->tbl24[i];
+			if (e & RVS_LPM_EXT) {
+				unsigned int *t = &lpm->tbl8[(unsigned long) RVS_LPM_IDX(e) * 256];
+				unsigned short j;
+				for (j = 0; j < 256; j++) {
+					if (del ? ((t[j] & RVS_LPM_VALID) && RVS_LPM_DEPTH(t[j]) == depth)
+							: (!(t[j] & RVS_LPM_VALID) || RVS_LPM_DEPTH(t[j]) <= depth))
+						*((volatile unsigned int *) &t[j]) = v;
+				}
+				if (del)
+					rvs_lpm_compress(lpm, i);
+			} else if (del ? ((e & RVS_LPM_VALID) && RVS_LPM_DEPTH(e) == depth)
+					: (!(e & RVS_LPM_VALID) || RVS_LPM_DEPTH(e) <= depth))
+				*((volatile unsigned int *) &lpm->tbl24[i]) = v;
+		}
+	} else {
+		unsigned int *t = &lpm->tbl8[(unsigned long) RVS_LPM_IDX(lpm->tbl24[addr >> 8]) * 256];
+		unsigned short j;
+		for (j = (addr & 0xff); j < (addr & 0xff) + (1U << (32 - depth)); j++) {
+			if (del ? ((t[j] & RVS_LPM_VALID) && RVS_LPM_DEPTH(t[j]) == depth)
+					: (!(t[j] & RVS_LPM_VALID) || RVS_LPM_DEPTH(t[j]) <= depth))
+				*((volatile unsigned int *) &t[j]) = v;
+		}
+		if (del)
+			rvs_lpm_compress(lpm, addr >> 8);
+	}
+}
+
+/* the memory for rvs_lpm_setup() to have num_tbl8 tbl8 groups and num_rule routes */
+unsigned long rvs_lpm_size(unsigned int num_tbl8, unsigned long num_rule)
+{
+	unsigned long num = 1;
+	while (num / 4 * 3 < num_rule) /* the rule table is used up to 3/4 */
+		num *= 2;
+	return RVS_LPM_TBL24_SIZE + (unsigned long) num_tbl8 * (256 + 1) * sizeof(unsigned int) + num * sizeof(struct rvs_lpm_rule);
+}
+
+/*
+ * builds an empty table on mem of size bytes for vs, which has num_tbl8 tbl8
+ * groups, and the rest of mem is the rule table; the routes longer than 24
+ * bits in the same /24 share a group
+ */
+int rvs_lpm_setup(struct rvs_lpm *lpm, struct rvs *vs, void *mem, unsigned long size, unsigned int num_tbl8)
+{
+	unsigned long fixed = RVS_LPM_TBL24_SIZE + (unsigned long) num_tbl8 * (256 + 1) * sizeof(unsigned int), num = 1;
+	if (!mem || (unsigned long) mem % 64 || num_tbl8 >= (1U << 24) || size < fixed + sizeof(struct rvs_lpm_rule))
+		return -1;
+	while (num * 2 <= (size - fixed) / sizeof(struct rvs_lpm_rule))
+		num *= 2;
+	rvs_lock_init(lpm->lock);
+	lpm->vs = vs;
+	lpm->tbl24 = (unsigned int *) mem;
+	lpm->tbl8 = (unsigned int *)((unsigned long) mem + RVS_LPM_TBL24_SIZE);
+	lpm->tbl8_next = &lpm->tbl8[(unsigned long) num_tbl8 * 256];
+	lpm->num_tbl8 = num_tbl8;
+	lpm->tbl8_free = 0;
+	lpm->tbl8_retired = num_tbl8;
+	lpm->rule = (struct rvs_lpm_rule *)((unsigned long) mem + fixed);
+	lpm->rule_mask = num - 1;
+	lpm->num_rule = 0;
+	{
+		unsigned long i;
+		for (i = 0; i < (1UL << 24); i++)
+			lpm->tbl24[i] = 0;
+		for (i = 0; i < num_tbl8; i++)
+			lpm->tbl8_next[i] = (unsigned int) i + 1;
+		for (i = 0; i < num; i++)
+			lpm->rule[i].used = 0;
+	}
+	{
+		unsigned short i;
+		for (i = 0; i < RVS_LPM_NUM_NH; i++)
+			lpm->nh[i].port = RVS_MAX_PORT;
+	}
+	return 0;
+}
+
+int rvs_lpm_exit(struct rvs_lpm *lpm)
+{
+	return rvs_lock_destroy(lpm->lock);
+}
+
+/*
+ * sets next hop nh; the routed frames go to port with the MAC addresses
+ * dst and src, and RVS_MAX_PORT makes them dropped
+ */
+int rvs_lpm_nh_set(struct rvs_lpm *lpm, unsigned short nh, unsigned short port, const unsigned char *dst, const unsigned char *src)
+{
+	if (nh >= RVS_LPM_NUM_NH || port > RVS_MAX_PORT)
+		return -1;
+	/*
+	 * the lookups read a next hop without any lock; its frames are dropped
+	 * while the addresses are rewritten, and it is rarely changed
+	 */
+	rvs_wrlock(lpm->vs->lock);
+	if (lpm->nh[nh].port != RVS_MAX_PORT) {
+		RVS_LPM_NH_PORT_SET(&lpm->nh[nh], RVS_MAX_PORT);
+		rvs_wait_readers(lpm->vs);
+	}
+	{
+		unsigned short i;
+		for (i = 0; i < 6; i++) {
+			lpm->nh[nh].dst[i] = dst[i];
+			lpm->nh[nh].src[i] = src[i];
+		}
+	}
+	RVS_LPM_NH_PORT_SET(&lpm->nh[nh], port);
+	rvs_wrunlock(lpm->vs->lock);
+	return 0;
+}
+
+/* adds, or replaces the next hop of, the route addr/depth; addr is in host byte order */
+int rvs_lpm_add(struct rvs_lpm *lpm, unsigned int addr, unsigned char depth, unsigned short nh)
+{
+	int ret = 0;
+	if (depth > 32 || nh >= RVS_LPM_NUM_NH)
+		return -1;
+	addr &= rvs_lpm_mask(depth);
+	rvs_wrlock(lpm->lock);
+	{
+		unsigned long r = rvs_lpm_rule_find(lpm, addr, depth);
+		if (!lpm->rule[r].used && lpm->num_rule + 1 > (lpm->rule_mask + 1) / 4 * 3)
+			ret = -1;
+		else if (depth > 24 && !(lpm->tbl24[addr >> 8] & RVS_LPM_EXT)) {
+			/* the first route longer than 24 bits in the /24 */
+			unsigned int g = rvs_lpm_tbl8_alloc(lpm);
+			if (g == lpm->num_tbl8)
+				ret = -1;
+			else {
+				unsigned short j;
+				for (j = 0; j < 256; j++)
+					lpm->tbl8[(unsigned long) g * 256 + j] = lpm->tbl24[addr >> 8];
+				__asm__ volatile ("" ::: "memory");
+				*((volatile unsigned int *) &lpm->tbl24[addr >> 8]) = RVS_LPM_VALID | RVS_LPM_EXT | g;
+			}
+		}
+		if (!ret) {
+			rvs_lpm_update(lpm, addr, depth, RVS_LPM_ENT(depth, nh), 0);
+			if (!lpm->rule[r].used) {
+				lpm->rule[r].addr = addr;
+				lpm->rule[r].depth = depth;
+				lpm->rule[r].used = 1;
+				lpm->num_rule++;
+			}
+			lpm->rule[r].nh = nh;
+		}
+	}
+	rvs_wrunlock(lpm->lock);
+	return ret;
+}
+
+/* deletes the route addr/depth, and the addresses it covers go to the longest route covering it */
+int rvs_lpm_del(struct rvs_lpm *lpm, unsigned int addr, unsigned char depth)
+{
+	int ret = 0;
+	if (depth > 32)
+		return -1;
+	addr &= rvs_lpm_mask(depth);
+	rvs_wrlock(lpm->lock);
+	{
+		unsigned long r = rvs_lpm_rule_find(lpm, addr, depth);
+		if (!lpm->rule[r].used)
+			ret = -1;
+		else {
+			unsigned int v = 0;
+			unsigned char d;
+			rvs_lpm_rule_remove(lpm, r);
+			for (d = depth; d > 0; d--) {
+				unsigned long p = rvs_lpm_rule_find(lpm, addr & rvs_lpm_mask(d - 1), d - 1);
+				if (lpm->rule[p].used) {
+					v = RVS_LPM_ENT(d - 1, lpm->rule[p].nh);
+					break;
+				}
+			}
+			rvs_lpm_update(lpm, addr, depth, v, 1);
+		}
+	}
+	rvs_wrunlock(lpm->lock);
+	return ret;
+}
 
-unsigned short rvs_fwd(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short batch)
+/* looks up cnt frames, up to RVS_BATCH_MAX, for rvs_lookup_lpm() */
+static void rvs_lpm_batch(struct rvs_lpm *lpm, char *const *pkt, const unsigned short *len, unsigned short cnt, unsigned short *dst)
+{
+	unsigned int addr[RVS_BATCH_MAX], ent[RVS_BATCH_MAX];
+	unsigned short n;
+	for (n = 0; n < cnt; n++) {
+		const unsigned char *p = (const unsigned char *) pkt[n];
+		if (len[n] >= 34 && len[n] <= RVS_GSO_FRAME_MAX
+				&& p[12] == 0x08 && p[13] == 0x00 && (p[14] & 0xf0) == 0x40 && p[22] > 1) {
+			addr[n] = ((unsigned int) p[30] << 24) | ((unsigned int) p[31] << 16) | ((unsigned int) p[32] << 8) | p[33];
+			__builtin_prefetch(&lpm->tbl24[addr[n] >> 8]);
+			dst[n] = 0;
+		} else
+			dst[n] = RVS_PORT_DROP;
+	}
+	for (n = 0; n < cnt; n++) {
+		if (dst[n] != RVS_PORT_DROP) {
+			ent[n] = ((volatile unsigned int *) lpm->tbl24)[addr[n] >> 8];
+			if (ent[n] & RVS_LPM_EXT)
+				__builtin_prefetch(&lpm->tbl8[(unsigned long) RVS_LPM_IDX(ent[n]) * 256 + (addr[n] & 0xff)]);
+		}
+	}
+	for (n = 0; n < cnt; n++) {
+		if (dst[n] != RVS_PORT_DROP) {
+			unsigned int e = ent[n];
+			unsigned short port = RVS_MAX_PORT;
+			if (e & RVS_LPM_EXT)
+				e = ((volatile unsigned int *) lpm->tbl8)[(unsigned long) RVS_LPM_IDX(e) * 256 + (addr[n] & 0xff)];
+			if (!(e & RVS_LPM_VALID) || (port = RVS_LPM_NH_PORT(&lpm->nh[RVS_LPM_IDX(e)])) == RVS_MAX_PORT)
+				dst[n] = RVS_PORT_DROP;
+			else {
+				struct rvs_lpm_nh *h = &lpm->nh[RVS_LPM_IDX(e)];
+				unsigned char *p = (unsigned char *) pkt[n];
+				unsigned short i;
+				for (i = 0; i < 6; i++) {
+					p[i] = h->dst[i];
+					p[6 + i] = h->src[i];
+				}
+				{
+					/* the checksum is updated incrementally for the TTL/protocol word (RFC 1624) */
+					unsigned int m = ((unsigned int) p[22] << 8) | p[23], sum;
+					p[22]--;
+					sum = (~(((unsigned int) p[24] << 8) | p[25]) & 0xffff) + (~m & 0xffff) + (m - 0x100);
+					sum = (sum & 0xffff) + (sum >> 16);
+					sum = (sum & 0xffff) + (sum >> 16);
+					p[24] = (unsigned char)(~sum >> 8);
+					p[25] = (unsigned char) ~sum;
+				}
+				dst[n] = port;
+			}
+		}
+	}
+}
+
+/*
+ * a lookup function routing IPv4 packets with the struct rvs_lpm given as
+ * arg; it looks up the batch in three passes, which prefetch the tbl24 and
+ * the tbl8 entries for the next ones, rewrites the MAC addresses, and
+ * decrements TTL; the other frames, those whose TTL expires, and those
+ * without a route are dropped. a caller other than rvs_fwd() holds
+ * vs->lock for reading while it calls this.
+ */
+void rvs_lookup_lpm(struct rvs *vs, unsigned short vid, unsigned short qid,
+		    char *const *pkt, const unsigned short *len, unsigned short cnt, unsigned short *dst, void *arg)
+{
+	(void) vs;
+	(void) vid;
+	(void) qid;
+	/* rvs_fwd() gives up to RVS_BATCH_MAX frames, and the other callers may give more */
+	while (cnt) {
+		unsigned short c = (cnt < RVS_BATCH_MAX ? cnt : RVS_BATCH_MAX);
+		rvs_lpm_batch((struct rvs_lpm *) arg, pkt, len, c, dst);
+		pkt += c;
+		len += c;
+		dst += c;
+		cnt -= c;
+	}
+}
+
+/*
+ * a destination RX ring is shared by the producers forwarding packets to it.
+ * a producer reserves a range of slots, fills it without holding any lock,
+ * and publishes it in the order of the reservations, like the lease of VALE.
+ * the reservation word has the next slot to be reserved in bits 0-15, the
+ * number of the producers holding a range in bits 16-31, the tail of the
+ * ring read last in bits 32-47, and a generation counter in bits 48-63 to
+ * avoid ABA on compare-and-swap; when no producer holds a range, the next
+ * reservation starts at head, thus, the reservation follows the ring
+ * reinitialized by the process/system.
+ * the tail in the rvif is read only when the cached one does not leave
+ * room for the request; as the cached tail is updated together with the
+ * next slot, the range computed from it never overtakes the consumer.
+ * RVS_NO_ATOMIC replaces it with the lock hooks for the platforms where
+ * the atomic builtins are not available.
+ */
+#define RVS_RESV_NEXT(_w) ((unsigned short)((_w) & 0xffff))
+#define RVS_RESV_INFLIGHT(_w) ((unsigned short)(((_w) >> 16) & 0xffff))
+#define RVS_RESV_TAIL(_w) ((unsigned short)(((_w) >> 32) & 0xffff))
+#define RVS_RESV_GEN (1UL << 48)
+
+/*
+ * need[k] is the number of the slots taken by the first k + 1 frames, or need
+ * is NULL when every frame takes a slot; the reservation has whole frames only
+ */
+static unsigned short rvs_rx_fit(const unsigned short *need, unsigned short want, unsigned short room, unsigned short *frames)
+{
+	if (!need) {
+		*frames = (room < want ? room : want);
+		return *frames;
+	} else {
+		unsigned short f = want;
+		while (f && need[f - 1] > room)
+			f--;
+		*frames = f;
+		return (f ? need[f - 1] : 0);
+	}
+}
+
+static unsigned short rvs_rx_reserve(struct rvs *vs, unsigned short vid, unsigned short qid,
+				     const unsigned short *need, unsigned short want,
+				     unsigned short *start, unsigned short *frames)
+{
+	unsigned short cnt;
+#if !defined(RVS_NO_ATOMIC)
+	unsigned long o = __atomic_load_n(&vs->port[vid].queue[qid].resv, __ATOMIC_ACQUIRE), n;
+	do {
+		unsigned short t = RVS_RESV_TAIL(o);
+		unsigned short num = RVS_RING(vs, vid, qid, 0, num);
+		*start = (RVS_RESV_INFLIGHT(o) ? RVS_RESV_NEXT(o) : __atomic_load_n(&RVS_RING(vs, vid, qid, 0, head), __ATOMIC_ACQUIRE));
+		cnt = rvs_rx_fit(need, want, (t > *start ? t - *start - 1 : t + num - *start - 1), frames);
+		if (*frames < want) {
+			t = __atomic_load_n(&RVS_RING(vs, vid, qid, 0, tail), __ATOMIC_ACQUIRE);
+			cnt = rvs_rx_fit(need, want, (t > *start ? t - *start - 1 : t + num - *start - 1), frames);
+		}
+		if (!cnt)
+			return 0;
+		n = ((o & ~(RVS_RESV_GEN - 1)) + RVS_RESV_GEN)
+			| ((unsigned long) t << 32)
+			| ((unsigned long)(RVS_RESV_INFLIGHT(o) + 1) << 16)
+			| (*start + cnt < num ? *start + cnt : *start + cnt - num);
+	} while (!__atomic_compare_exchange_n(&vs->port[vid].queue[qid].resv, &o, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+#else
+	rvs_wrlock(vs->port[vid].queue[qid].lock);
+	{
+		unsigned short t = RVS_RESV_TAIL(vs->port[vid].queue[qid].resv);
+		unsigned short num = RVS_RING(vs, vid, qid, 0, num);
+		*start = RVS_RING(vs, vid, qid, 0, head);
+		cnt = rvs_rx_fit(need, want, (t > *start ? t - *start - 1 : t + num - *start - 1), frames);
+		if (*frames < want) {
+			t = *((volatile unsigned short *) &RVS_RING(vs, vid, qid, 0, tail));
+			__asm__ volatile ("" ::: "memory");
+			vs->port[vid].queue[qid].resv = (unsigned long) t << 32;
+			cnt = rvs_rx_fit(need, want, (t > *start ? t - *start - 1 : t + num - *start - 1), frames);
+		}
+		if (!cnt)
+			rvs_wrunlock(vs->port[vid].queue[qid].lock);
+	}
+#endif
+	return cnt;
+}
+
+static void rvs_rx_publish(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short start, unsigned short cnt)
+{
+	unsigned short num = RVS_RING(vs, vid, qid, 0, num);
+#if !defined(RVS_NO_ATOMIC)
+	while (__atomic_load_n(&RVS_RING(vs, vid, qid, 0, head), __ATOMIC_ACQUIRE) != start) {
+		/* wait for the producers holding the preceding ranges */
+#if defined(__x86_64__)
+		__asm__ volatile ("pause" ::: "memory");
+#endif
+	}
+	__atomic_store_n(&RVS_RING(vs, vid, qid, 0, head), (start + cnt < num ? start + cnt : start + cnt - num), __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&vs->port[vid].queue[qid].resv, 1UL << 16, __ATOMIC_RELEASE);
+#else
+	__asm__ volatile ("" ::: "memory");
+	RVS_RING(vs, vid, qid, 0, head) = (start + cnt < num ? start + cnt : start + cnt - num);
+	rvs_wrunlock(vs->port[vid].queue[qid].lock);
+#endif
+}
+
+/* the free slots of an RX ring, except those reserved by the producers */
+static unsigned short rvs_rx_room(struct rvs *vs, unsigned short i, unsigned short dq)
+{
+	unsigned short s, t, num = RVS_RING(vs, i, dq, 0, num);
+#if !defined(RVS_NO_ATOMIC)
+	{
+		unsigned long w = __atomic_load_n(&vs->port[i].queue[dq].resv, __ATOMIC_ACQUIRE);
+		s = (RVS_RESV_INFLIGHT(w) ? RVS_RESV_NEXT(w) : __atomic_load_n(&RVS_RING(vs, i, dq, 0, head), __ATOMIC_ACQUIRE));
+	}
+	t = __atomic_load_n(&RVS_RING(vs, i, dq, 0, tail), __ATOMIC_ACQUIRE);
+#else
+	s = *((volatile unsigned short *) &RVS_RING(vs, i, dq, 0, head));
+	t = *((volatile unsigned short *) &RVS_RING(vs, i, dq, 0, tail));
+#endif
+	return (t > s ? t - s - 1 : t + num - s - 1);
+}
+
+/*
+ * the RX slots of port i taken by a frame of len bytes, or 0 if it is dropped;
+ * a super-frame is split into segments, each of which has the headers of hdr
+ * bytes in its first slot, for port i not taking it
+ */
+static unsigned short rvs_rx_slots(struct rvs *vs, unsigned short i, unsigned short len,
+				   unsigned short ofl, unsigned int o, unsigned short hdr)
+{
+	unsigned long b = vs->port[i].buf_size, m;
+	if (RVS_OFL_SEG(vs, i, ofl)) {
+		unsigned long mss = RVIF_OFFLOAD_MSS(o), k = (len - hdr + mss - 1) / mss; /* the segments */
+		unsigned long last = hdr + (len - hdr) - (k - 1) * mss;
+		if (hdr > b || (vs->port[i].ver != RVIF_VERSION_3 && (k > 1 ? hdr + mss : last) > b))
+			return 0;
+		m = (k - 1) * ((hdr + mss + b - 1) / b) + (last + b - 1) / b;
+		return (unsigned short)(m < 0xffff ? m : 0xffff);
+	}
+	m = (len ? (len + b - 1) / b : 1);
+	if (m > 1 && vs->port[i].ver != RVIF_VERSION_3)
+		return 0; /* the destination does not have multi-slot frames */
+	return (unsigned short) m;
+}
+
+/*
+ * returns the number of the leading frames of the batch that fit in the RX
+ * rings of the lossless destinations, the smallest timeout of the lossless
+ * destinations cutting the batch, and whether a lossless destination takes
+ * one of the leading frames; the free slots are those seen now, and the
+ * stage 3 waits for the slots taken by the other producers in the meantime;
+ * pkt_hash is the flow hashes selecting the RX queues, or NULL, and mon is
+ * the monitor port, which is not a destination
+ */
+static unsigned short rvs_lossless_fit(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short cnt,
+				       const unsigned short *pkt_dst, const unsigned short *pkt_len,
+				       const unsigned short *pkt_ofl, const unsigned int *pkt_meta, const unsigned short *pkt_hdr, const unsigned int *pkt_hash,
+				       const unsigned short *dst_list, unsigned short num_dst, int flood, unsigned short mon, unsigned long *timeout, int *take)
+{
+	unsigned short lim = cnt, first = cnt, x, a = RVS_CUR(vs, active); /* first is the first frame to a lossless destination */
+	for (x = 0; x < (flood ? vs->active[a].num : num_dst); x++) {
+		unsigned short i = (flood ? vs->active[a].vid[x] : dst_list[x]);
+		if (i != RVS_MAX_PORT && i != vid && i != mon && vs->port[i].lossless && RVS_PORT_UP(vs, i) && vs->port[i].vif->num) {
+			unsigned short room[RVIF_MAX_QUEUE], used[RVIF_MAX_QUEUE], n;
+			unsigned long seen[(RVIF_MAX_QUEUE + 63) / 64] = { 0 }; /* room[q] is valid if bit q is set */
+			for (n = 0; n < lim; n++) {
+				if (pkt_dst[n] == i || pkt_dst[n] == RVS_MAX_PORT) {
+					unsigned short m = rvs_rx_slots(vs, i, pkt_len[n], pkt_ofl[n], pkt_meta[n], pkt_hdr[n]);
+					unsigned short q = (pkt_hash ? pkt_hash[n] : qid) % vs->port[i].vif->num;
+					if (!m)
+						continue; /* dropped anyway */
+					if (!(seen[q / 64] & (1UL << (q % 64)))) {
+						seen[q / 64] |= (1UL << (q % 64));
+						room[q] = rvs_rx_room(vs, i, q);
+						used[q] = 0;
+					}
+					if (used[q] + m > room[q]) {
+						lim = n;
+						if (!*timeout || vs->port[i].lossless < *timeout)
+							*timeout = vs->port[i].lossless;
+						break;
+					}
+					used[q] += m;
+					if (n < first)
+						first = n;
+				}
+			}
+		}
+	}
+	*take = (first < lim);
+	return lim;
+}
+
+/* clears the flags of RX slot d, which may have the offload flags or the flow hash of a frame received before */
+static void rvs_slot_clear(struct rvs *vs, unsigned short i, unsigned short dq, unsigned short d)
+{
+	if (vs->port[i].ver == RVIF_VERSION_3)
+		RVS_SLOT3(vs, i, dq, 0, d).flags = 0;
+	else if (vs->port[i].ver == RVIF_VERSION_2)
+		((struct rvif2 *) vs->port[i].vif)->queue[dq].ring[0].slot[d].flags = 0;
+	else
+		vs->port[i].vif->queue[dq].ring[0].slot[d].flags = 0;
+}
+
+/* the length of a frame of frag slots from TX slot s, as the stage 1 has counted it */
+static unsigned long rvs_tx_len(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short s, unsigned short frag)
+{
+	unsigned long l = 0;
+	while (frag--) {
+		unsigned short n = RVS_SLOT(vs, vid, qid, 1, s, len);
+		l += (n < vs->port[vid].buf_size ? n : vs->port[vid].buf_size);
+		if (++s == RVS_RING(vs, vid, qid, 1, num))
+			s = 0;
+	}
+	return l;
+}
+
+/* puts the flow hash of a frame in its first RX slot d */
+static void rvs_slot_hash(struct rvs *vs, unsigned short i, unsigned short dq, unsigned short d, unsigned int hash)
+{
+	if (vs->port[i].ver == RVIF_VERSION_3) {
+		RVS_SLOT3(vs, i, dq, 0, d).flags |= RVIF_SLOT_F_HASH;
+		RVS_SLOT3(vs, i, dq, 0, d).hash = hash;
+	} else if (vs->port[i].ver == RVIF_VERSION_2)
+		((struct rvif2 *) vs->port[i].vif)->queue[dq].ring[0].slot[d].flags = ((unsigned long) hash << 32) | RVIF_SLOT_F_HASH;
+	else
+		vs->port[i].vif->queue[dq].ring[0].slot[d].flags = ((unsigned long) hash << 32) | RVIF_SLOT_F_HASH;
+}
+
+/*
+ * copies c bytes at s_pos of a source buffer to d_pos of a destination buffer;
+ * rounding up the rest to 64 bytes stays in the buffers, whose sizes are
+ * multiples of 64, if it starts at a 64-byte boundary of both
+ */
+static void rvs_copy_part(struct rvs *vs, char *dst, const char *src, unsigned short c,
+			  unsigned short d_pos, unsigned short s_pos, int nt)
+{
+	unsigned short b = c & ~63;
+	if (b)
+		rvs_copy(vs, dst, src, b, nt);
+	if (c - b) {
+		if (!((d_pos + b) % 64) && !((s_pos + b) % 64))
+			rvs_copy(vs, dst + b, src + b, c - b, nt);
+		else {
+			unsigned short k;
+			for (k = b; k < c; k++)
+				dst[k] = src[k];
+		}
+	}
+}
+
+/*
+ * copies a frame, which takes multiple slots at the source or the destination,
+ * from the TX slots of port vid starting at s to the RX slots of port i starting
+ * at d, and returns whether non-temporal stores are used
+ */
+static int rvs_copy_frame(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short s, unsigned short frag,
+			  unsigned short i, unsigned short dq, unsigned short d, unsigned short len)
+{
+	int nt = (vs->port[i].nt && vs->port[i].nt <= len);
+	unsigned short s_len = RVS_SLOT(vs, vid, qid, 1, s, len), s_pos = 0, d_pos = 0;
+	if (s_len > vs->port[vid].buf_size)
+		s_len = vs->port[vid].buf_size;
+	while (1) {
+		if (s_pos == s_len) {
+			if (!--frag)
+				break;
+			if (++s == RVS_RING(vs, vid, qid, 1, num)) s = 0;
+			s_len = RVS_SLOT(vs, vid, qid, 1, s, len);
+			if (s_len > vs->port[vid].buf_size)
+				s_len = vs->port[vid].buf_size;
+			s_pos = 0;
+			continue;
+		}
+		if (d_pos == vs->port[i].buf_size) {
+			/* only version 3 gets here, as a frame taking multiple slots is not sent to the others */
+			RVS_SLOT(vs, i, dq, 0, d, len) = d_pos;
+			RVS_SLOT3(vs, i, dq, 0, d).flags = RVIF_SLOT_F_MORE;
+			if (++d == RVS_RING(vs, i, dq, 0, num)) d = 0;
+			d_pos = 0;
+		}
+		{
+			unsigned short c = s_len - s_pos, r = (unsigned short)(vs->port[i].buf_size - d_pos);
+			if (c > r)
+				c = r;
+			rvs_copy_part(vs, (char *)((unsigned long) vs->port[i].vif + RVS_SLOT(vs, i, dq, 0, d, off) + d_pos),
+				      (const char *)((unsigned long) vs->port[vid].vif + RVS_SLOT(vs, vid, qid, 1, s, off) + s_pos),
+				      c, d_pos, s_pos, nt);
+			s_pos += c;
+			d_pos += c;
+		}
+	}
+	RVS_SLOT(vs, i, dq, 0, d, len) = d_pos;
+	rvs_slot_clear(vs, i, dq, d);
+	return nt;
+}
+
+/*
+ * the one's complement sum of len bytes at p added to sum, not folded; the
+ * words are in the byte order of the CPU, and rvs_csum_fold() gives the sum
+ * in the network byte order (RFC 1071)
+ */
+static unsigned long rvs_csum_add(unsigned long sum, const unsigned char *p, unsigned long len)
+{
+	unsigned long k = 0;
+	for (; k + 8 <= len; k += 8) {
+		unsigned long w;
+		__builtin_memcpy(&w, p + k, 8);
+		sum += w;
+		sum += (sum < w); /* the end-around carry */
+	}
+	for (; k + 2 <= len; k += 2) {
+		unsigned short w;
+		__builtin_memcpy(&w, p + k, 2);
+		sum += w;
+		sum += (sum < w);
+	}
+	if (k < len) {
+		/* the last byte is the upper half of a word padded by zero */
+		unsigned char b[2];
+		unsigned short w;
+		b[0] = p[k];
+		b[1] = 0;
+		__builtin_memcpy(&w, b, 2);
+		sum += w;
+		sum += (sum < w);
+	}
+	return sum;
+}
+
+static unsigned short rvs_csum_fold(unsigned long sum)
+{
+	unsigned char b[2];
+	unsigned short w;
+	sum = (sum & 0xffffffffUL) + (sum >> 32);
+	sum = (sum & 0xffffffffUL) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	w = (unsigned short) sum;
+	__builtin_memcpy(b, &w, 2);
+	return (unsigned short)((b[0] << 8) | b[1]);
+}
+
+static void rvs_put16(unsigned char *p, unsigned short v)
+{
+	p[0] = (unsigned char)(v >> 8);
+	p[1] = (unsigned char) v;
+}
+
+/* byte pos of a frame in the RX slots of port i starting at d, all of which but the last one are full */
+static unsigned char *rvs_rx_byte(struct rvs *vs, unsigned short i, unsigned short dq, unsigned short d, unsigned long pos)
+{
+	unsigned long x = d + pos / vs->port[i].buf_size;
+	if (x >= RVS_RING(vs, i, dq, 0, num))
+		x -= RVS_RING(vs, i, dq, 0, num);
+	return (unsigned char *)((unsigned long) vs->port[i].vif + RVS_SLOT(vs, i, dq, 0, x, off) + pos % vs->port[i].buf_size);
+}
+
+/*
+ * puts the checksum over [start, len) of a frame in the RX slots of port i
+ * starting at d at start + off, which has the sum of the pseudo header
+ */
+static void rvs_rx_csum(struct rvs *vs, unsigned short i, unsigned short dq, unsigned short d,
+			unsigned short len, unsigned short start, unsigned short off)
+{
+	unsigned long b = vs->port[i].buf_size, pos = start, sum = 0;
+	while (pos < len) {
+		unsigned long c = (pos / b + 1) * b;
+		unsigned short w;
+		if (c > len)
+			c = len;
+		w = rvs_csum_fold(rvs_csum_add(0, rvs_rx_byte(vs, i, dq, d, pos), c - pos));
+		if ((pos - start) % 2) /* the part starts at the lower half of a word */
+			w = (unsigned short)((w << 8) | (w >> 8));
+		sum += w;
+		pos = c;
+	}
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	if (!sum) /* zero means no checksum for UDP */
+		sum = 0xffff;
+	*rvs_rx_byte(vs, i, dq, d, (unsigned long) start + off) = (unsigned char)(sum >> 8);
+	*rvs_rx_byte(vs, i, dq, d, (unsigned long) start + off + 1) = (unsigned char) sum;
+}
+
+/* puts the offload flags and the offload word in RX slot d, the first one of a frame */
+static void rvs_slot_offload(struct rvs *vs, unsigned short i, unsigned short dq, unsigned short d, unsigned short ofl, unsigned int o)
+{
+	if (vs->port[i].ver == RVIF_VERSION_3) {
+		RVS_SLOT3(vs, i, dq, 0, d).flags |= ofl;
+		RVS_SLOT3(vs, i, dq, 0, d).hash = o;
+	} else /* version 1 does not have the offloads */
+		RVS_SLOT2(vs, i, dq, 0, d).flags = ((unsigned long) o << 32) | ofl;
+}
+
+/*
+ * the size of the headers of a frame of len bytes having the offload flags
+ * ofl and the offload word o, whose first slot buffer p has the first l
+ * bytes, or 0 if they are not sane; the bytes rvs rewrites for the offloads
+ * have to be in the first slot. a super-frame has the TCP header at
+ * csum_start, after IPv4 or IPv6, and a VLAN tag if any
+ */
+static unsigned short rvs_ofl_hdr(const unsigned char *p, unsigned long l, unsigned long len, unsigned short ofl, unsigned int o)
+{
+	unsigned long start = RVIF_OFFLOAD_CSUM_START(o), end = start + RVIF_OFFLOAD_CSUM_OFF(o) + 2;
+	if (!(ofl & RVIF_SLOT_F_CSUM) || end > l || end > len)
+		return 0;
+	if (ofl & RVS_SLOT_F_GSO) {
+		unsigned long nh = (p[12] == 0x81 && p[13] == 0x00 ? 18 : 14), hdr;
+		if (RVIF_OFFLOAD_CSUM_OFF(o) != 16 || !RVIF_OFFLOAD_MSS(o) || start + 20 > l)
+			return 0;
+		if (ofl == (RVIF_SLOT_F_CSUM | RVIF_SLOT_F_GSO_TCP4)) {
+			if (p[nh - 2] != 0x08 || p[nh - 1] != 0x00 || (p[nh] >> 4) != 4 || (p[nh] & 0xf) < 5
+					|| nh + (p[nh] & 0xf) * 4 != start || p[nh + 9] != 6)
+				return 0;
+		} else if (ofl == (RVIF_SLOT_F_CSUM | RVIF_SLOT_F_GSO_TCP6)) {
+			/* the extension headers, if any, are not looked into */
+			if (p[nh - 2] != 0x86 || p[nh - 1] != 0xdd || (p[nh] >> 4) != 6 || start < nh + 40
+					|| (start == nh + 40 && p[nh + 6] != 6))
+				return 0;
+		} else
+			return 0;
+		hdr = start + (p[start + 12] >> 4) * 4;
+		if ((p[start + 12] >> 4) < 5 || hdr > l || hdr >= len)
+			return 0;
+		return (unsigned short) hdr;
+	}
+	return (unsigned short) end;
+}
+
+/*
+ * splits a super-frame of len bytes from the TX slots of port vid starting at
+ * s into segments of mss bytes of payload to the RX slots of port i starting
+ * at d; each segment has a copy of the headers of hdr bytes whose lengths,
+ * IPv4 ID, sequence number, and flags are fixed, and its checksum is left to
+ * port i if it takes RVIF_SLOT_F_CSUM, or computed otherwise; hash, if not
+ * NULL, is put in the segments without the offload flags, and whether
+ * non-temporal stores are used is returned
+ */
+static int rvs_gso(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short s, unsigned short frag,
+		   unsigned short len, unsigned short ofl, unsigned int o, unsigned short hdr,
+		   unsigned short i, unsigned short dq, unsigned short d, const unsigned int *hash)
+{
+	unsigned long b = vs->port[i].buf_size;
+	unsigned short num = RVS_RING(vs, i, dq, 0, num), start = RVIF_OFFLOAD_CSUM_START(o), mss = RVIF_OFFLOAD_MSS(o);
+	unsigned short s_len = RVS_SLOT(vs, vid, qid, 1, s, len), s_pos = hdr, left = len - hdr, k;
+	const char *h_src = (const char *)((unsigned long) vs->port[vid].vif + RVS_SLOT(vs, vid, qid, 1, s, off));
+	int csum = (vs->port[i].offload & RVIF_F_CSUM) != 0;
+	int nt = (csum && vs->port[i].nt && vs->port[i].nt <= hdr + mss); /* the payload is not read again */
+	if (s_len > vs->port[vid].buf_size)
+		s_len = vs->port[vid].buf_size;
+	for (k = 0; left; k++) {
+		unsigned short p = (left < mss ? left : mss), sl = hdr + p, seg = d, d_pos = hdr, c = p;
+		unsigned char *h = (unsigned char *)((unsigned long) vs->port[i].vif + RVS_SLOT(vs, i, dq, 0, d, off));
+		rvs_copy(vs, h, h_src, hdr, 0); /* the headers are in the first slot at both sides */
+		while (c) {
+			unsigned short x;
+			if (s_pos >= s_len && frag > 1) {
+				if (++s == RVS_RING(vs, vid, qid, 1, num)) s = 0;
+				s_len = RVS_SLOT(vs, vid, qid, 1, s, len);
+				if (s_len > vs->port[vid].buf_size)
+					s_len = vs->port[vid].buf_size;
+				s_pos = 0;
+				frag--;
+				continue;
+			}
+			if (d_pos == b) {
+				/* only version 3 gets here, as a segment taking multiple slots is not sent to the others */
+				RVS_SLOT(vs, i, dq, 0, d, len) = d_pos;
+				RVS_SLOT3(vs, i, dq, 0, d).flags = RVIF_SLOT_F_MORE;
+				if (++d == num) d = 0;
+				d_pos = 0;
+			}
+			x = (unsigned short)(b - d_pos);
+			if (x > c)
+				x = c;
+			if (s_pos < s_len) {
+				if (x > s_len - s_pos)
+					x = s_len - s_pos;
+				rvs_copy_part(vs, (char *)((unsigned long) vs->port[i].vif + RVS_SLOT(vs, i, dq, 0, d, off) + d_pos),
+					      (const char *)((unsigned long) vs->port[vid].vif + RVS_SLOT(vs, vid, qid, 1, s, off) + s_pos),
+					      x, d_pos, s_pos, nt);
+				s_pos += x;
+			} /* otherwise, the slots have been shortened after the stage 1, and the rest is left as it is */
+			d_pos += x;
+			c -= x;
+		}
+		RVS_SLOT(vs, i, dq, 0, d, len) = d_pos;
+		rvs_slot_clear(vs, i, dq, d);
+		{
+			/* the stage 1 has checked the headers, which are in the first slot */
+			unsigned short nh = (h[12] == 0x81 && h[13] == 0x00 ? 18 : 14);
+			unsigned char *t = h + start;
+			unsigned long sum;
+			unsigned int seq;
+			if (ofl & RVIF_SLOT_F_GSO_TCP4) {
+				rvs_put16(h + nh + 2, (unsigned short)(sl - nh));
+				rvs_put16(h + nh + 4, (unsigned short)(((h[nh + 4] << 8) | h[nh + 5]) + k));
+				rvs_put16(h + nh + 10, 0);
+				rvs_put16(h + nh + 10, (unsigned short) ~rvs_csum_fold(rvs_csum_add(0, h + nh, start - nh)));
+				sum = rvs_csum_fold(rvs_csum_add(0, h + nh + 12, 8));
+			} else {
+				rvs_put16(h + nh + 4, (unsigned short)(sl - nh - 40));
+				sum = rvs_csum_fold(rvs_csum_add(0, h + nh + 8, 32));
+			}
+			sum += 6 + (sl - start); /* the protocol and the TCP length of the pseudo header */
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			seq = (((unsigned int) t[4] << 24) | ((unsigned int) t[5] << 16) | ((unsigned int) t[6] << 8) | t[7])
+				+ (unsigned int) k * mss;
+			rvs_put16(t + 4, (unsigned short)(seq >> 16));
+			rvs_put16(t + 6, (unsigned short) seq);
+			if (left > p)
+				t[13] &= ~(0x01 | 0x08); /* FIN and PSH are for the last segment */
+			if (k)
+				t[13] &= ~0x80; /* CWR is for the first segment */
+			rvs_put16(t + 16, (unsigned short) sum);
+		}
+		if (csum)
+			rvs_slot_offload(vs, i, dq, seg, RVIF_SLOT_F_CSUM, RVIF_OFFLOAD(start, 16, 0));
+		else {
+			rvs_rx_csum(vs, i, dq, seg, sl, start, 16);
+			if (hash)
+				rvs_slot_hash(vs, i, dq, seg, *hash);
+		}
+		if (++d == num) d = 0;
+		left -= p;
+	}
+	return nt;
+}
+
+/*
+ * sends a frame having the offload flags ofl from the TX slots of port vid
+ * starting at s to the RX slots of port i starting at d; port i gets the
+ * offload flags if it takes them, otherwise, the frame is segmented or its
+ * checksum is computed; hash, if not NULL, is put in a frame without the
+ * offload flags, and whether non-temporal stores are used is returned
+ */
+static int rvs_rx_offload(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short s, unsigned short frag,
+			  unsigned short len, unsigned short ofl, unsigned int o, unsigned short hdr,
+			  unsigned short i, unsigned short dq, unsigned short d, const unsigned int *hash)
+{
+	int nt;
+	if (RVS_OFL_SEG(vs, i, ofl))
+		return rvs_gso(vs, vid, qid, s, frag, len, ofl, o, hdr, i, dq, d, hash);
+	nt = rvs_copy_frame(vs, vid, qid, s, frag, i, dq, d, len);
+	if (!(ofl & ~RVS_OFL_FLAGS(vs->port[i].offload)))
+		rvs_slot_offload(vs, i, dq, d, ofl, o);
+	else {
+		rvs_rx_csum(vs, i, dq, d, len, RVIF_OFFLOAD_CSUM_START(o), RVIF_OFFLOAD_CSUM_OFF(o));
+		if (hash)
+			rvs_slot_hash(vs, i, dq, d, *hash);
+	}
+	return nt;
+}
+
+/*
+ * copies the frames of the batch, whose indexes are in list, to the monitor port;
+ * this is called after the frames have been sent to the destinations, and the
+ * frames not fitting in the RX ring of the monitor port are dropped and counted
+ */
+static void rvs_mirror(struct rvs *vs, unsigned short vid, unsigned short qid,
+		       unsigned short i, const unsigned short *list, unsigned short cnt,
+		       const unsigned short *pkt_slot, const unsigned short *pkt_frag, const unsigned short *pkt_len,
+		       const unsigned short *pkt_ofl, const unsigned int *pkt_meta, const unsigned short *pkt_hdr, unsigned short *need)
+{
+	unsigned short drop = cnt;
+	if (RVS_PORT_UP(vs, i) && vs->port[i].vif->num) {
+		unsigned short dq = qid % vs->port[i].vif->num, num = RVS_RING(vs, i, dq, 0, num);
+		unsigned short d_s, d_f, d_n, j, c = 0;
+		for (j = 0; j < cnt; j++) {
+			unsigned short n = list[j], m = 0;
+			if (pkt_len[n] <= RVS_GSO_FRAME_MAX)
+				m = rvs_rx_slots(vs, i, pkt_len[n], pkt_ofl[n], pkt_meta[n], pkt_hdr[n]);
+			if (c + m >= num)
+				break;
+			c += m;
+			need[j] = c;
+		}
+		d_n = rvs_rx_reserve(vs, i, dq, need, j, &d_s, &d_f);
+		if (d_n) {
+			unsigned short d_h = d_s;
+			int nt = 0;
+			for (j = 0; j < d_f; j++) {
+				unsigned short n = list[j], m = need[j] - (j ? need[j - 1] : 0);
+				if (!m)
+					continue;
+				if (pkt_ofl[n]) {
+					if (rvs_rx_offload(vs, vid, qid, pkt_slot[n], pkt_frag[n], pkt_len[n], pkt_ofl[n], pkt_meta[n], pkt_hdr[n],
+							   i, dq, d_h, (void *) 0))
+						nt = 1;
+				} else if (m == 1 && pkt_frag[n] == 1) {
+					RVS_SLOT(vs, i, dq, 0, d_h, len) = pkt_len[n];
+					rvs_slot_clear(vs, i, dq, d_h);
+					if (vs->port[i].nt && vs->port[i].nt <= pkt_len[n])
+						nt = 1;
+					rvs_copy(vs, (void *)((unsigned long) vs->port[i].vif + RVS_SLOT(vs, i, dq, 0, d_h, off)),
+						 (void *)((unsigned long) vs->port[vid].vif + RVS_SLOT(vs, vid, qid, 1, pkt_slot[n], off)),
+						 pkt_len[n], (vs->port[i].nt && vs->port[i].nt <= pkt_len[n]));
+				} else if (rvs_copy_frame(vs, vid, qid, pkt_slot[n], pkt_frag[n], i, dq, d_h, pkt_len[n]))
+					nt = 1;
+				d_h = (d_h + m < num ? d_h + m : d_h + m - num);
+				drop--;
+			}
+			if (nt)
+				rvs_copy_sync(vs);
+			rvs_rx_publish(vs, i, dq, d_s, d_n);
+			rvs_notify(vs, i, dq);
+		}
+	}
+	if (drop) {
+#if !defined(RVS_NO_ATOMIC)
+		__atomic_fetch_add(&vs->mirror_drop, drop, __ATOMIC_RELAXED);
+#else
+		vs->mirror_drop += drop; /* approximate */
+#endif
+	}
+}
+
+/* st, if not NULL, is the counters of the caller, RVS_STAT_SIZE(vs->max_port, vs->max_queue) bytes, and only the caller updates them */
+unsigned short rvs_fwd_stat(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short batch, struct rvs_stat *st)
 {
 	unsigned short cnt = 0;
 	{
-		rvs_rdlock(vs->lock);
-		if (vs->port[vid].vif) {
-			volatile unsigned short h = vs->port[vid].vif->queue[qid].ring[1].head;
+		rvs_read_begin(vs, vid, qid);
+		if (RVS_PORT_UP(vs, vid)) {
+			volatile unsigned short h = RVS_RING(vs, vid, qid, 1, head);
 			{
-				unsigned short fwd[RVS_MAX_PORT + 1][RVIF_MAX_SLOT], fwd_cnt[RVS_MAX_PORT + 1] = { 0 };
-				{
-					volatile unsigned short t = vs->port[vid].vif->queue[qid].ring[1].tail;
-					__asm__ volatile ("" ::: "memory");
+				unsigned short pkt_slot[RVS_BATCH_MAX], pkt_frag[RVS_BATCH_MAX], pkt_len[RVS_BATCH_MAX], pkt_dst[RVS_BATCH_MAX], fwd[RVS_BATCH_MAX];
+				char *pkt[RVS_BATCH_MAX]; /* the first slot buffer of each frame */
+				unsigned short need[RVS_BATCH_MAX];
+				unsigned short rss_cur = RVS_CUR(vs, rss), rss = vs->rss[rss_cur].func; /* the flow hash of the batch, RVS_RSS_* */
+				unsigned int pkt_hash[RVS_BATCH_MAX]; /* valid if rss is set */
+				unsigned short pkt_ofl[RVS_BATCH_MAX], pkt_hdr[RVS_BATCH_MAX]; /* the offload flags, and the size of the headers if they are set */
+				unsigned int pkt_meta[RVS_BATCH_MAX]; /* the offload word, valid if the offload flags are set */
+				unsigned short sel[RVS_BATCH_MAX]; /* the frames to a destination, grouped by RX queue */
+				unsigned short fwd_cnt[RVS_MAX_PORT + 1], fwd_off[RVS_MAX_PORT + 1];
+				unsigned short dst_list[RVS_MAX_PORT + 1], num_dst = 0;
+				unsigned long dst_map[(RVS_MAX_PORT + 1 + 63) / 64] = { 0 }; /* fwd_cnt[i] is valid if bit i is set */
+				unsigned short max_len = 0, multi = 0, gso = 0; /* the largest frame, whether a frame has multiple slots, and whether one is a super-frame */
+				unsigned char mir[RVS_BATCH_MAX]; /* frames to be mirrored, valid if mirror is set */
+				unsigned short mon = *((volatile unsigned short *) &vs->mirror); /* the monitor port */
+				int mirror = (mon != RVS_MAX_PORT && mon != vid);
+				int hol = 0; /* the head-of-line timeout has expired, and the lossless ports drop frames */
+				if (batch > RVS_BATCH_MAX)
+					batch = RVS_BATCH_MAX;
+				{ /* stage 1, build a batch of frames and prefetch */
+					unsigned short t = vs->port[vid].queue[qid].tx_tail;
+					if (h == t || h != vs->port[vid].queue[qid].tx_head) {
+						/* the cached tail has run out, or the process/system has reinitialized the ring */
+						t = vs->port[vid].queue[qid].tx_tail = rvif_idx_load(&RVS_RING(vs, vid, qid, 1, tail));
+					}
 					while (h != t && cnt < batch) {
-						char *p = (char *)((unsigned long) vs->port[vid].vif + vs->port[vid].vif->queue[qid].ring[1].slot[h].off);
-						{
-							unsigned long s = (*((unsigned long *)(&p[4])) >> 16) & 0x0000ffffffffffff;
-							vs->ft.ent[s % (RVS_NUM_HASH_ENT - 1)].port = vid;
-							vs->ft.ent[s % (RVS_NUM_HASH_ENT - 1)].mac = s;
+						unsigned short f = h, k = 0;
+						unsigned long l = 0;
+						int more;
+						do {
+							unsigned short n = RVS_SLOT(vs, vid, qid, 1, f, len);
+							l += (n < vs->port[vid].buf_size ? n : vs->port[vid].buf_size);
+							more = RVS_SLOT_MORE(vs, vid, qid, 1, f);
+							k++;
+							if (++f == RVS_RING(vs, vid, qid, 1, num)) f = 0;
+						} while (more && f != t);
+						if (more) {
+							/* the rest of the frame may have been queued after we read tail */
+							unsigned short _t = rvif_idx_load(&RVS_RING(vs, vid, qid, 1, tail));
+							if (_t == t)
+								break;
+							t = vs->port[vid].queue[qid].tx_tail = _t;
+							continue;
 						}
+						pkt[cnt] = (char *)((unsigned long) vs->port[vid].vif + RVS_SLOT(vs, vid, qid, 1, h, off));
+						if (cnt < RVS_PREFETCH_DIST)
+							__builtin_prefetch(pkt[cnt]);
+						pkt_slot[cnt] = h;
+						pkt_frag[cnt] = k;
+						pkt_ofl[cnt] = 0;
 						{
-							unsigned short dst;
-							{
-								unsigned long d = *((unsigned long *)(&p[0])) & 0x0000ffffffffffff;
-								if (vs->ft.ent[d % (RVS_NUM_HASH_ENT - 1)].mac == d)
-									dst = vs->ft.ent[d % (RVS_NUM_HASH_ENT - 1)].port;
-								else
-									dst = RVS_MAX_PORT;
+							unsigned long lim = RVS_FRAME_MAX;
+							unsigned short o = (vs->port[vid].offload ? RVS_SLOT_FLAGS(vs, vid, qid, 1, h) & RVS_OFL_FLAGS(vs->port[vid].offload) : 0);
+							int ok = 1;
+							if (o) {
+								/* the offload word is kept, as the process/system may rewrite the slot after the check */
+								unsigned short f_len = RVS_SLOT(vs, vid, qid, 1, h, len);
+								pkt_meta[cnt] = RVS_SLOT_OFFLOAD(vs, vid, qid, 1, h);
+								pkt_hdr[cnt] = rvs_ofl_hdr((const unsigned char *) pkt[cnt], (f_len < vs->port[vid].buf_size ? f_len : vs->port[vid].buf_size),
+											   l, o, pkt_meta[cnt]);
+								if (pkt_hdr[cnt]) {
+									pkt_ofl[cnt] = o;
+									if (o & RVS_SLOT_F_GSO) {
+										lim = RVS_GSO_FRAME_MAX;
+										gso = 1;
+									}
+								} else
+									ok = 0;
 							}
-							fwd[dst][fwd_cnt[dst]++] = h;
+							if (ok && l <= lim) {
+								pkt_len[cnt] = (unsigned short) l;
+								if (max_len < l)
+									max_len = (unsigned short) l;
+							} else
+								pkt_len[cnt] = RVS_GSO_FRAME_MAX + 1;
 						}
-						if (++h == vs->port[vid].vif->queue[qid].ring[1].num) h = 0;
+						if (k > 1)
+							multi = 1;
 						cnt++;
+						h = f;
 					}
 				}
-				{
-					unsigned short i;
-					for (i = 0; i < RVS_MAX_PORT; i++) {
-						if (i != vid && vs->port[i].vif && vs->port[i].vif->num && (fwd_cnt[i] + fwd_cnt[RVS_MAX_PORT])) {
-							rvs_wrlock(vs->port[i].lock[qid % vs->port[i].vif->num]);
-							{
-								volatile unsigned short d_h = vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].head, d_t = vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].tail;
-								__asm__ volatile ("" ::: "memory");
+				{ /* stage 2, compute destinations */
+					unsigned short n;
+#if defined(RVS_LOOKUP)
+					RVS_LOOKUP(vs, vid, qid, pkt, pkt_len, cnt, pkt_dst, vs->lookup[RVS_CUR(vs, lookup)].arg);
+#else
+					unsigned short l = RVS_CUR(vs, lookup);
+					if (vs->lookup[l].fn) /* an indirect call for a batch */
+						vs->lookup[l].fn(vs, vid, qid, pkt, pkt_len, cnt, pkt_dst, vs->lookup[l].arg);
+					else
+						rvs_l2(vs, vid, pkt, pkt_len, cnt, pkt_dst, st);
+#endif
+					for (n = 0; n < cnt; n++) {
+						unsigned short dst = pkt_dst[n];
+						if ((dst >= vs->max_port && dst != RVS_PORT_FLOOD) || pkt_len[n] > RVS_GSO_FRAME_MAX
+								|| (dst == mon && mon != RVS_MAX_PORT)) /* the monitor port only gets the mirrored frames */
+							dst = vid; /* the stage 3 skips the source port, thus, the frame is dropped */
+						else if (dst == RVS_PORT_FLOOD && st) {
+							if (pkt[n][0] & 1) /* the group bit */
+								st[vid].flood++;
+							else
+								st[vid].unknown++;
+						}
+						if (!(dst_map[dst / 64] & (1UL << (dst % 64)))) {
+							dst_map[dst / 64] |= (1UL << (dst % 64));
+							dst_list[num_dst++] = dst;
+							fwd_cnt[dst] = 0;
+						}
+						fwd_cnt[dst]++;
+						pkt_dst[n] = dst;
+					}
+					if (rss) {
+						for (n = 0; n < cnt; n++)
+							pkt_hash[n] = rvs_rss_hash(vs, rss_cur, (const unsigned char *) pkt[n],
+										   (pkt_len[n] < vs->port[vid].buf_size ? pkt_len[n] : vs->port[vid].buf_size));
+					}
+				}
+				if (vs->num_lossless && cnt) { /* the frames not fitting in a lossless destination stay in the TX ring */
+					unsigned long timeout = 0;
+					int take;
+					unsigned short lim = rvs_lossless_fit(vs, vid, qid, cnt, pkt_dst, pkt_len, pkt_ofl, pkt_meta, pkt_hdr,
+									      (rss ? pkt_hash : (void *) 0), dst_list, num_dst,
+									      (dst_map[RVS_MAX_PORT / 64] & (1UL << (RVS_MAX_PORT % 64))) != 0, mon, &timeout, &take);
+					if (lim == cnt) {
+						if (take) /* a batch without a frame to a lossless destination keeps the blocked time */
+							vs->port[vid].queue[qid].hol_since = 0;
+					} else {
+						unsigned long now = rvs_time_us();
+						if (take || !vs->port[vid].queue[qid].hol_since) /* a lossless destination takes a frame, or the head of the ring is blocked now */
+							vs->port[vid].queue[qid].hol_since = (now ? now : 1);
+						if (now - vs->port[vid].queue[qid].hol_since < timeout) {
+							unsigned short n;
+							for (n = lim; n < cnt; n++) {
+								fwd_cnt[pkt_dst[n]]--;
+								if (st && pkt_dst[n] == RVS_MAX_PORT) {
+									if (pkt[n][0] & 1)
+										st[vid].flood--;
+									else
+										st[vid].unknown--;
+								}
+							}
+							h = pkt_slot[lim];
+							cnt = lim;
+							if (st)
+								RVS_STAT_QUEUE(st, vs->max_port, vs->max_queue, vid, qid)->hold++;
+						} else
+							hol = 1; /* the head of the ring has been blocked for the timeout, and the frames not fitting are dropped */
+					}
+				}
+				if (st) {
+					/* the length in the TX ring, which a frame to be dropped does not have in pkt_len */
+					struct rvs_stat_queue *sq = RVS_STAT_QUEUE(st, vs->max_port, vs->max_queue, vid, qid);
+					unsigned short n;
+					for (n = 0; n < cnt; n++)
+						sq->rx_byte += (pkt_len[n] <= RVS_GSO_FRAME_MAX ? pkt_len[n]
+								: rvs_tx_len(vs, vid, qid, pkt_slot[n], pkt_frag[n]));
+					sq->rx_pkt += cnt;
+				}
+				{ /* group the frames by destination with a counting sort, fwd_off[i] is the first frame to port i in fwd */
+					unsigned short n, x, o = 0;
+					for (x = 0; x < num_dst; x++) {
+						fwd_off[dst_list[x]] = o;
+						o += fwd_cnt[dst_list[x]];
+					}
+					for (n = 0; n < cnt; n++)
+						fwd[fwd_off[pkt_dst[n]]++] = n;
+					for (x = 0; x < num_dst; x++)
+						fwd_off[dst_list[x]] -= fwd_cnt[dst_list[x]];
+				}
+				if (dst_map[RVS_MAX_PORT / 64] & (1UL << (RVS_MAX_PORT % 64))) {
+					/* flooded frames go to all attached ports */
+					unsigned short x, a = RVS_CUR(vs, active);
+					for (x = 0, num_dst = 0; x < vs->active[a].num; x++) {
+						unsigned short i = vs->active[a].vid[x];
+						if (!(dst_map[i / 64] & (1UL << (i % 64))))
+							fwd_cnt[i] = fwd_off[i] = 0;
+						if (i != mon) /* the monitor port only gets the mirrored frames */
+							dst_list[num_dst++] = i;
+					}
+				} else
+					fwd_cnt[RVS_MAX_PORT] = 0;
+				if (mirror) {
+					unsigned short n;
+					for (n = 0; n < cnt; n++)
+						mir[n] = (vs->port[vid].mirror & RVS_MIRROR_INGRESS ? 1 : 0);
+				}
+				{ /* stage 3, forward, looping on destinations */
+					unsigned short x;
+					for (x = 0; x < num_dst; x++) {
+						unsigned short i = dst_list[x];
+						if (i != RVS_MAX_PORT && i != vid && RVS_PORT_UP(vs, i) && vs->port[i].vif->num && (fwd_cnt[i] + fwd_cnt[RVS_MAX_PORT])) {
+							unsigned short p, parts = 1, qo[RVIF_MAX_QUEUE], qu[RVIF_MAX_QUEUE], qf[RVIF_MAX_QUEUE];
+							if (rss && vs->port[i].vif->num > 1) {
+								/* the RX queue of a frame is its flow hash modulo the number of the RX queues */
+								unsigned short q, j, o = 0;
+								parts = (unsigned short) vs->port[i].vif->num;
+								for (q = 0; q < parts; q++)
+									qu[q] = qf[q] = 0;
+								for (j = 0; j < fwd_cnt[i]; j++)
+									qu[pkt_hash[fwd[fwd_off[i] + j]] % parts]++;
+								for (j = 0; j < fwd_cnt[RVS_MAX_PORT]; j++)
+									qf[pkt_hash[fwd[fwd_off[RVS_MAX_PORT] + j]] % parts]++;
+								for (q = 0; q < parts; q++) {
+									qo[q] = o;
+									o += qu[q] + qf[q];
+									qf[q] = qu[q]; /* the next unicast frame, then, the next flooded frame */
+									qu[q] = 0;
+								}
+								for (j = 0; j < fwd_cnt[i]; j++) {
+									unsigned short n = fwd[fwd_off[i] + j];
+									q = pkt_hash[n] % parts;
+									sel[qo[q] + qu[q]++] = n;
+								}
+								for (j = 0; j < fwd_cnt[RVS_MAX_PORT]; j++) {
+									unsigned short n = fwd[fwd_off[RVS_MAX_PORT] + j];
+									q = pkt_hash[n] % parts;
+									sel[qo[q] + qf[q]++] = n;
+								}
+								for (q = 0; q < parts; q++)
+									qf[q] -= qu[q];
+							}
+							for (p = 0; p < parts; p++) {
+								/* the unicast frames la[0..nu) and the flooded frames lb[0..nfl) to the RX queue dq */
+								unsigned short dq, nu, nfl, *la, *lb;
+								if (parts > 1) {
+									dq = p;
+									nu = qu[p];
+									nfl = qf[p];
+									la = sel + qo[p];
+									lb = la + nu;
+									if (!(nu + nfl))
+										continue;
+								} else {
+									dq = qid % vs->port[i].vif->num;
+									nu = fwd_cnt[i];
+									nfl = fwd_cnt[RVS_MAX_PORT];
+									la = fwd + fwd_off[i];
+									lb = fwd + fwd_off[RVS_MAX_PORT];
+								}
 								{
-									unsigned short j;
-									for (j = 0;
-											(j < fwd_cnt[i] + fwd_cnt[RVS_MAX_PORT])
-											&& ((d_h + 1 == vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].num ? 0 : d_h + 1) != d_t);
-											j++, d_h = (d_h + 1 == vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].num ? 0 : d_h + 1)) {
-										vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].slot[d_h].len = vs->port[vid].vif->queue[qid].ring[1].slot[fwd[j < fwd_cnt[i] ? i : RVS_MAX_PORT][j < fwd_cnt[i] ? j : j - fwd_cnt[i]]].len;
-										{
-											void *dst = (void *)(((unsigned long) vs->port[i].vif) + vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].slot[d_h].off);
-											void *src = (void *)(((unsigned long) vs->port[vid].vif) + vs->port[vid].vif->queue[qid].ring[1].slot[fwd[j < fwd_cnt[i] ? i : RVS_MAX_PORT][j < fwd_cnt[i] ? j : j - fwd_cnt[i]]].off);
-											unsigned short n = vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].slot[d_h].len;
+									unsigned short num = RVS_RING(vs, i, dq, 0, num);
+									unsigned short nf = nu + nfl, *nd = (void *) 0;
+									unsigned short d_s, d_f, d_n, want = nf, sent = 0, done = 0, from = 0;
+									unsigned long tx_byte = 0, since = 0;
+									if (multi || max_len > vs->port[i].buf_size || gso) {
+										/* some frames do not take a single slot */
+										unsigned short j, c = 0;
+										for (j = 0; j < nf; j++) {
+											unsigned short n = (j < nu ? la[j] : lb[j - nu]);
+											unsigned short m = rvs_rx_slots(vs, i, pkt_len[n], pkt_ofl[n], pkt_meta[n], pkt_hdr[n]);
+											if (c + m >= num)
+												break;
+											c += m;
+											need[j] = c;
+										}
+										nf = j;
+										nd = need;
+									}
+									while (1) {
+										d_n = rvs_rx_reserve(vs, i, dq, (nd ? nd + done : nd), nf - done, &d_s, &d_f);
+										if (d_n) {
+											unsigned short d_h = d_s;
+											int nt = 0;
 											{
-												unsigned short k;
-												for (k = 0; k < ((n / 8) + 1); k++)
-													((unsigned long *) dst)[k] = ((unsigned long *) src)[k];
+												unsigned short j;
+												for (j = 0; j < d_f; j++) {
+													unsigned short k = done + j, n = (k < nu ? la[k] : lb[k - nu]);
+													unsigned short s = pkt_slot[n], m = (nd ? need[k] - (j ? need[k - 1] : 0) : 1);
+													if (!m)
+														continue;
+													if (mirror && (vs->port[i].mirror & RVS_MIRROR_EGRESS))
+														mir[n] = 1;
+													if (pkt_ofl[n]) {
+														/* a frame having the offload flags is always copied */
+														if (rvs_rx_offload(vs, vid, qid, s, pkt_frag[n], pkt_len[n], pkt_ofl[n], pkt_meta[n], pkt_hdr[n],
+																   i, dq, d_h, (rss ? &pkt_hash[n] : (void *) 0)))
+															nt = 1;
+													} else if (m == 1 && pkt_frag[n] == 1) {
+														unsigned long dst = ((unsigned long) vs->port[i].vif) + RVS_SLOT(vs, i, dq, 0, d_h, off);
+														unsigned long src = ((unsigned long) vs->port[vid].vif) + RVS_SLOT(vs, vid, qid, 1, s, off);
+														RVS_SLOT(vs, i, dq, 0, d_h, len) = pkt_len[n];
+														rvs_slot_clear(vs, i, dq, d_h);
+														if (k < nu /* unicast */
+																&& !(mirror && ((vs->port[vid].mirror & RVS_MIRROR_INGRESS) || (vs->port[i].mirror & RVS_MIRROR_EGRESS)))
+																&& vs->port[i].pool && vs->port[i].pool == vs->port[vid].pool
+																&& RVS_POOL_HAS(vs, i, dst) && RVS_POOL_HAS(vs, vid, src)) {
+															/* zero-copy: exchange the buffers of the source and destination slots */
+															RVS_SLOT(vs, i, dq, 0, d_h, off) = src - (unsigned long) vs->port[i].vif;
+															RVS_SLOT(vs, vid, qid, 1, s, off) = dst - (unsigned long) vs->port[vid].vif;
+														} else {
+															if (vs->port[i].nt && vs->port[i].nt <= pkt_len[n])
+																nt = 1;
+															rvs_copy(vs, (void *) dst, (void *) src, pkt_len[n], (vs->port[i].nt && vs->port[i].nt <= pkt_len[n]));
+														}
+													} else if (rvs_copy_frame(vs, vid, qid, s, pkt_frag[n], i, dq, d_h, pkt_len[n]))
+														nt = 1;
+													if (rss && !pkt_ofl[n])
+														rvs_slot_hash(vs, i, dq, d_h, pkt_hash[n]);
+													d_h = (d_h + m < num ? d_h + m : d_h + m - num);
+													sent++;
+													tx_byte += pkt_len[n];
+												}
 											}
+											if (nt)
+												rvs_copy_sync(vs);
+											rvs_rx_publish(vs, i, dq, d_s, d_n);
+											rvs_notify(vs, i, dq);
+										}
+										done += d_f;
+										if (done == nf || !vs->port[i].lossless || hol)
+											break;
+										{
+											/* the other producers have taken the slots of the lossless destination; wait for its consumer */
+											unsigned long now = rvs_time_us();
+											if (!since || d_f)
+												since = (now ? now : 1);
+											else if (now - since >= vs->port[i].lossless)
+												break;
+										}
+										if (nd && done > from) {
+											/* need for the rest of the frames */
+											unsigned short k, b = need[done - 1];
+											for (k = done; k < nf; k++)
+												need[k] -= b;
+											from = done;
 										}
 									}
+									if (st) {
+										struct rvs_stat_queue *sq = RVS_STAT_QUEUE(st, vs->max_port, vs->max_queue, i, dq);
+										sq->tx_pkt += sent;
+										sq->tx_byte += tx_byte;
+										sq->drop += want - sent;
+									}
 								}
-								vs->port[i].vif->queue[qid % vs->port[i].vif->num].ring[0].head = d_h;
-								rvs_notify(vs, i, qid % vs->port[i].vif->num);
 							}
-							rvs_wrunlock(vs->port[i].lock[qid % vs->port[i].vif->num]);
 						}
 					}
 				}
+				if (mirror) { /* after all the destinations, so that the monitor port does not delay them */
+					unsigned short n, num_mir = 0;
+					for (n = 0; n < cnt; n++) {
+						if (mir[n])
+							fwd[num_mir++] = n;
+					}
+					if (num_mir)
+						rvs_mirror(vs, vid, qid, mon, fwd, num_mir, pkt_slot, pkt_frag, pkt_len, pkt_ofl, pkt_meta, pkt_hdr, need);
+				}
 			}
-			__asm__ volatile ("" ::: "memory");
-			vs->port[vid].vif->queue[qid].ring[1].head = h;
+			vs->port[vid].queue[qid].tx_head = h;
+			rvif_idx_store(&RVS_RING(vs, vid, qid, 1, head), h);
 		}
-		rvs_rdunlock(vs->lock);
+		rvs_read_end(vs, vid, qid);
 	}
 	return cnt;
 }
 
+unsigned short rvs_fwd(struct rvs *vs, unsigned short vid, unsigned short qid, unsigned short batch)
+{
+	return rvs_fwd_stat(vs, vid, qid, batch, (void *) 0);
+}
+
+static int rvs_vif_version(struct rvif *vif, unsigned int *ver, unsigned int *buf_size)
+{
+	*buf_size = RVS_BUF_SIZE;
+	if (((struct rvif_hdr *) vif)->magic == RVIF_MAGIC) {
+		*ver = ((struct rvif_hdr *) vif)->version;
+		if (*ver == RVIF_VERSION_3) {
+			*buf_size = ((struct rvif3 *) vif)->buf_size;
+			/* the copy rounds up the length to 64 bytes, and len of a slot is 16-bit */
+			if (!*buf_size || *buf_size % 64 || *buf_size > 0xffff)
+				return -1;
+		} else if (*ver != RVIF_VERSION_1 && *ver != RVIF_VERSION_2)
+			return -1;
+	} else if (vif->flags) /* neither the header nor the zero of the rvifs before the versioning */
+		return -1;
+	else
+		*ver = RVIF_VERSION_1;
+	{
+		/* the copy rounds up the length to 64 bytes, which stays in the buffer of a slot only if it starts at a 64-byte boundary */
+		unsigned int i;
+		for (i = 0; i < vif->num && i < RVIF_MAX_QUEUE; i++) {
+			unsigned short j;
+			for (j = 0; j < 2; j++) {
+				unsigned short k;
+				if (RVIF_RING(vif, *ver, i, j, num) > RVIF_MAX_SLOT)
+					return -1;
+				for (k = 0; k < RVIF_RING(vif, *ver, i, j, num); k++) {
+					if (RVIF_SLOT(vif, *ver, i, j, k, off) % 64)
+						return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static void rvs_port_setup(struct rvs *vs, unsigned short vid, struct rvif *vif, unsigned int ver, unsigned int buf_size)
+{
+	unsigned short i;
+#if defined(RVS_NO_ATOMIC)
+	if (!vs->port[vid].lock_init) {
+		/* the locks are initialized when the port is attached first */
+		for (i = 0; i < vs->max_queue; i++)
+			rvs_lock_init(vs->port[vid].queue[i].lock);
+		vs->port[vid].lock_init = 1;
+	}
+#endif
+	for (i = 0; i < vs->max_queue; i++) {
+		/* the cached tail of a TX ring equal to head is refreshed at the first rvs_fwd */
+		vs->port[vid].queue[i].tx_head = vs->port[vid].queue[i].tx_tail = RVIF_RING(vif, ver, i, 1, head);
+		vs->port[vid].queue[i].resv = (unsigned long) RVIF_RING(vif, ver, i, 0, tail) << 32;
+	}
+	vs->port[vid].ver = ver;
+	vs->port[vid].buf_size = buf_size;
+	vs->port[vid].offload = 0;
+	if (ver != RVIF_VERSION_1) { /* version 1 does not have flags of the rvif */
+		vs->port[vid].offload = (unsigned short)(((struct rvif2 *) vif)->flags & (RVIF_F_CSUM | RVIF_F_GSO));
+		if (!(vs->port[vid].offload & RVIF_F_CSUM) || ver != RVIF_VERSION_3)
+			vs->port[vid].offload &= ~RVIF_F_GSO;
+	}
+	vs->port[vid].vif = vif;
+#if !defined(RVS_NO_ATOMIC)
+	__atomic_store_n(&vs->port[vid].up, 1, __ATOMIC_RELEASE);
+#else
+	vs->port[vid].up = 1;
+#endif
+	{
+		/* a new active list with the port */
+		unsigned short c = vs->cur_active, i;
+		for (i = 0; i < vs->active[c].num; i++)
+			vs->active[!c].vid[i] = vs->active[c].vid[i];
+		vs->active[!c].vid[i] = vid;
+		vs->active[!c].num = (unsigned short)(i + 1);
+		rvs_flip(vs, &vs->cur_active);
+	}
+}
+
 int rvs_vif_attach(struct rvs *vs, unsigned short vid, struct rvif *vif)
 {
 	int ret = 0;
+	unsigned int ver, buf_size;
+	if (vid >= vs->max_port || vif->num > vs->max_queue || rvs_vif_version(vif, &ver, &buf_size))
+		return -1;
 	rvs_wrlock(vs->lock);
 	if (!vs->port[vid].vif)
-		vs->port[vid].vif = vif;
+		rvs_port_setup(vs, vid, vif, ver, buf_size);
 	else
 		ret = -1;
 	rvs_wrunlock(vs->lock);
 	return ret;
 }
 
+int rvs_vif_attach_pool(struct rvs *vs, unsigned short vid, struct rvif *vif, void *pool, unsigned long pool_size)
+{
+	int ret = 0;
+	unsigned int ver, buf_size;
+	if (vid >= vs->max_port || vif->num > vs->max_queue || rvs_vif_version(vif, &ver, &buf_size))
+		return -1;
+	if (!pool || pool_size < buf_size
+			|| ((unsigned long) pool % 64) || (pool_size % buf_size)
+			|| ((unsigned long) vif < (unsigned long) pool + pool_size
+				&& (unsigned long) pool < (unsigned long) vif + RVIF_SIZE(ver)))
+		return -1;
+	rvs_wrlock(vs->lock);
+	{
+		unsigned short i;
+		for (i = 0; i < vs->max_port; i++) {
+			if (vs->port[i].vif && vs->port[i].pool == pool
+					&& (vs->port[i].pool_size != pool_size || vs->port[i].buf_size != buf_size))
+				ret = -1;
+		}
+	}
+	if (!ret && !vs->port[vid].vif) {
+		vs->port[vid].pool = pool;
+		vs->port[vid].pool_size = pool_size;
+		rvs_port_setup(vs, vid, vif, ver, buf_size);
+	} else
+		ret = -1;
+	rvs_wrunlock(vs->lock);
+	return ret;
+}
+
 int rvs_vif_detach(struct rvs *vs, unsigned short vid, struct rvif *vif)
 {
 	int ret = 0;
+	if (vid >= vs->max_port)
+		return -1;
 	rvs_wrlock(vs->lock);
-	if (vs->port[vid].vif == vif)
+	if (vs->port[vid].vif == vif) {
+#if !defined(RVS_NO_ATOMIC)
+		__atomic_store_n(&vs->port[vid].up, 0, __ATOMIC_RELAXED);
+#else
+		vs->port[vid].up = 0;
+#endif
+		{
+			/* a new active list without the port; the flip waits for the callers that may use the port */
+			unsigned short c = vs->cur_active, i, n = 0;
+			for (i = 0; i < vs->active[c].num; i++) {
+				if (vs->active[c].vid[i] != vid)
+					vs->active[!c].vid[n++] = vs->active[c].vid[i];
+			}
+			vs->active[!c].num = n;
+			rvs_flip(vs, &vs->cur_active);
+		}
 		vs->port[vid].vif = (void *) 0;
-	else
+		vs->port[vid].pool = (void *) 0;
+		vs->port[vid].pool_size = 0;
+	} else
 		ret = -1;
 	rvs_wrunlock(vs->lock);
 	return ret;
 }
 
-int rvs_init(struct rvs *vs)
+/* the memory rvs_init() takes for max_port ports having max_queue queues */
+unsigned long rvs_size(unsigned short max_port, unsigned short max_queue)
+{
+	unsigned long q = sizeof(struct rvs_queue);
+#if defined(RVS_NO_ATOMIC)
+	q += RVS_LOCK_BUF_SIZE; /* the atomic reservation does not use the lock of a queue */
+#endif
+	return sizeof(struct rvs) + 63 + max_port * (sizeof(struct rvs_port) + max_queue * q);
+}
+
+/*
+ * vs points to rvs_size(max_port, max_queue) bytes; the port and queue
+ * tables start at the first 64-byte boundary after struct rvs, and the
+ * locks of the queues, only for RVS_NO_ATOMIC, follow them
+ */
+int rvs_init(struct rvs *vs, unsigned short max_port, unsigned short max_queue)
 {
+	if ((unsigned long) vs % sizeof(unsigned long)
+			|| !max_port || max_port > RVS_MAX_PORT || !max_queue || max_queue > RVIF_MAX_QUEUE)
+		return -1;
 	{
+		/* all but ft.builtin, which rvs_ft_setup() zeroes below */
 		unsigned long i;
-		for (i = 0; i < sizeof(struct rvs); i++)
-			((char *) vs)[i] = 0;
+		for (i = 0; i < ((unsigned long) vs->ft.builtin - (unsigned long) vs) / sizeof(unsigned long); i++)
+			((unsigned long *) vs)[i] = 0;
+		for (i = ((unsigned long)(vs->ft.builtin + RVS_FT_NUM_BUCKET) - (unsigned long) vs) / sizeof(unsigned long);
+				i < sizeof(struct rvs) / sizeof(unsigned long); i++)
+			((unsigned long *) vs)[i] = 0;
 	}
-	rvs_lock_init(vs->lock);
-	rvs_lock_init(vs->ft.lock);
+	vs->max_port = max_port;
+	vs->max_queue = max_queue;
+	vs->port = (struct rvs_port *)(((unsigned long) vs + sizeof(struct rvs) + 63) & ~63UL);
 	{
-		unsigned short i;
-		for (i = 0; i < RVS_MAX_PORT; i++) {
+		struct rvs_queue *q = (struct rvs_queue *)(vs->port + max_port);
+		unsigned long i;
+		for (i = 0; i < (max_port * (sizeof(struct rvs_port) + max_queue * sizeof(struct rvs_queue))) / sizeof(unsigned long); i++)
+			((unsigned long *) vs->port)[i] = 0;
+		for (i = 0; i < max_port; i++) {
+			vs->port[i].queue = q + i * max_queue;
+#if defined(RVS_NO_ATOMIC)
 			{
 				unsigned short j;
-				for (j = 0; j < RVIF_MAX_QUEUE; j++)
-					rvs_lock_init(vs->port[i].lock[j]);
+				for (j = 0; j < max_queue; j++)
+					vs->port[i].queue[j].lock = (char *)(q + (unsigned long) max_port * max_queue)
+						+ (i * max_queue + j) * RVS_LOCK_BUF_SIZE;
 			}
-			vs->port[i].vif = (void *) 0;
+#endif
 		}
 	}
+	rvs_lock_init(vs->lock);
+	rvs_lock_init(vs->ft.lock);
+	rvs_ft_setup(vs, (void *) 0, 0, RVS_FT_AGE);
+	vs->mirror = RVS_MAX_PORT;
+	{
+		unsigned short i;
+		for (i = RVS_COPY_NUM - 1; i > RVS_COPY_SCALAR && rvs_copy_select(vs, i); i--) ;
+		vs->copy = i;
+	}
 	return 0;
 }
 
@@ -157,11 +2276,11 @@ int rvs_exit(struct rvs *vs)
 	rvs_lock_destroy(vs->ft.lock);
 	{
 		unsigned short i;
-		for (i = 0; i < RVS_MAX_PORT; i++) {
-			{
+		for (i = 0; i < vs->max_port; i++) {
+			if (vs->port[i].lock_init) {
 				unsigned short j;
-				for (j = 0; j < RVIF_MAX_QUEUE; j++)
-					rvs_lock_destroy(vs->port[i].lock[j]);
+				for (j = 0; j < vs->max_queue; j++)
+					rvs_lock_destroy(vs->port[i].queue[j].lock);
 			}
 		}
 	}